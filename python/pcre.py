@@ -27,21 +27,17 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 """
 
 import _pcre
+import atexit
+from collections import namedtuple
 
 __version__ = '0.7'
 
 class Pattern(_pcre.Pattern):
     def search(self, string, pos=-1, endpos=-1, flags=0):
-        try:
-            return Match(self, string, pos, endpos, flags)
-        except NoMatch:
-            pass
+        return self._search(Match, string, pos, endpos, flags)
 
     def match(self, string, pos=-1, endpos=-1, flags=0):
-        try:
-            return Match(self, string, pos, endpos, flags | ANCHORED)
-        except NoMatch:
-            pass
+        return self._search(Match, string, pos, endpos, flags | ANCHORED)
 
     def split(self, string, maxsplit=0, flags=0):
         output = []
@@ -66,26 +62,182 @@ class Pattern(_pcre.Pattern):
             return [m.groups('')[0] for m in matches]
         return [m.groups('') for m in matches]
 
-    def finditer(self, string, pos=-1, endpos=-1, flags=0):
+    def finditer(self, string, pos=-1, endpos=-1, flags=0, reuse_match=False, detached=False):
+        # The subject is encoded or checked only once for all matches.
+        # With reuse_match, a match no longer referenced by anything (e.g.
+        # after del of the loop variable) is updated in place by the next
+        # iteration.  With detached, matches keep only the text they span
+        # (see Match.detach()).
+        return self._finditer(Match, string, pos, endpos, flags, reuse_match, detached)
+
+    def finditer_parallel(self, string, max_match_len, workers=None, pos=-1, endpos=-1, flags=0):
+        # Same as finditer() but the string is split into chunks searched
+        # by native threads.  Matches must not look further than max_match_len
+        # characters past their start for the results to be the same.
+        if workers is None:
+            import multiprocessing
+            workers = multiprocessing.cpu_count()
+        return iter(self._finditer_parallel(Match, string, max_match_len,
+                                            workers, pos, endpos, flags))
+
+    def grep(self, source, invert=False, offsets=False, flags=0):
+        # Yields lines of source containing a match, or not containing one
+        # with invert, without the newline.  With offsets, (start, end)
+        # tuples are yielded instead.  Source can be a bytes-like object or
+        # a binary file object which is read in chunks of GREP_BUFFER_SIZE.
+        pattern = self._multiline()
+        per_line = _sees_other_lines(self.pattern)
+        if not hasattr(source, 'readinto'):
+            for start, end in pattern._grep(source, invert, -1, flags, per_line):
+                yield (start, end) if offsets else source[start:end]
+            return
+        buf = bytearray(GREP_BUFFER_SIZE)
+        view = memoryview(buf)
+        base = size = 0
+        while 1:
+            n = source.readinto(view[size:])
+            if n:
+                # Search complete lines only, the rest is moved to the front.
+                size += n
+                end = buf.rfind(b'\n', 0, size) + 1
+                if end == 0:
+                    if size == len(buf):
+                        del view
+                        buf.extend(bytearray(len(buf)))
+                        view = memoryview(buf)
+                    continue
+            else:
+                end = size
+            for start, stop in pattern._grep(buf, invert, end, flags, per_line):
+                yield (base + start, base + stop) if offsets else bytes(buf[start:stop])
+            if not n:
+                break
+            buf[:size - end] = buf[end:size]
+            base += end
+            size -= end
+
+    def _multiline(self):
+        # Pattern used by grep(), ^ and $ have to match at line boundaries.
+        # It's kept studied like this one.
+        if self.flags & MULTILINE or self.pattern is None:
+            return self
         try:
-            while 1:
-                match = Match(self, string, pos, endpos, flags)
-                yield match
-                start, pos = match.span()
-                if pos == start:
-                    pos += 1
-        except NoMatch:
-            pass
-
-    def sub(self, repl, string, count=0, flags=0):
-        return self.subn(repl, string, count, flags)[0]
-
-    def subn(self, repl, string, count=0, flags=0):
+            pattern = self._multiline_pattern
+        except AttributeError:
+            pattern = self._multiline_pattern = Pattern(self.pattern, self.flags | MULTILINE)
+        options = getattr(self, '_study_options', None)
+        if options is not None and getattr(pattern, '_study_options', None) != options:
+            pattern.study(options)
+        return pattern
+
+    def search_async(self, string, pos=-1, endpos=-1, flags=0):
+        # Same as search() but returns an asyncio future.  Subjects of
+        # ASYNC_INLINE_SIZE or more are matched by a native worker thread.
+        return _submit(self, string, pos, endpos, flags, 1,
+                       lambda matches: matches[0] if matches else None)
+
+    def finditer_async(self, string, pos=-1, endpos=-1, flags=0):
+        # Same as finditer() but returns an asyncio future of the iterator.
+        return _submit(self, string, pos, endpos, flags, 0, iter)
+
+    def sub(self, repl, string, count=0, flags=0, reuse_match=False):
+        return self.subn(repl, string, count, flags, reuse_match)[0]
+
+    def sub_async(self, repl, string, count=0, flags=0):
+        # Same as sub() but returns an asyncio future of the result.
+        return _submit(self, string, -1, -1, flags, 0,
+                       lambda matches: self._subn(repl, string, count, matches)[0])
+
+    def subn(self, repl, string, count=0, flags=0, reuse_match=False):
+        return self._subn(repl, string, count,
+                          self.finditer(string, flags=flags, reuse_match=reuse_match))
+
+    def sub_to(self, sink, repl, source, count=0, flags=0, max_match_len=4096):
+        # Same as subn() but the output is written to sink, a file object or
+        # a file descriptor, in chunks of about SUB_BUFFER_SIZE.  Returns the
+        # number of substitutions.  Source can be a string, a bytes-like object
+        # or a file object which is read in chunks of SUB_BUFFER_SIZE.  Matches
+        # in files must not look further than max_match_len characters around
+        # their start for the result to be the same as sub(), and offsets of
+        # matches passed to a callable repl are relative to the chunk.
+        if hasattr(repl, '__call__'):
+            expand = repl
+        elif any((c.encode('ascii') if isinstance(repl, bytes) else c) in repl for c in '{}\\'):
+            expand = lambda match: match.expand(repl)
+        else:
+            # Templates without fields or escapes expand to themselves.
+            expand = lambda match: repl
+        if isinstance(sink, int):
+            import os
+            def write(data):
+                view = memoryview(data)
+                while len(view):
+                    view = view[os.write(sink, view):]
+        else:
+            write = sink.write
+        read = getattr(source, 'read', None)
+        data = source if read is None else read(SUB_BUFFER_SIZE)
+        eof = read is None or not data
+        empty = data[:0] if isinstance(data, bytes) or hasattr(data, 'encode') else b''
+        output = []
+        size = [0]
+        def emit(piece, flush=False):
+            output.append(piece)
+            size[0] += len(piece)
+            if flush or size[0] >= SUB_BUFFER_SIZE:
+                write(empty.join(output))
+                del output[:]
+                size[0] = 0
+        utf8 = flags & UTF8 and not flags & NO_UTF8_CHECK and isinstance(empty, bytes)
+        base = start = last = n = 0
+        while 1:
+            # Only matches starting before limit are known not to depend on
+            # data that hasn't been read yet.
+            end = len(data)
+            limit = end if eof else _char_boundary(data, end - max_match_len, utf8)
+            if limit > start or eof:
+                if utf8 and not eof:
+                    end = _utf8_end(data)
+                cur = start
+                for match in self.finditer(data, start, end, flags):
+                    s, e = match.span()
+                    if s >= limit and not eof:
+                        break
+                    if not last == base + s == base + e or last == 0:
+                        emit(data[cur:s])
+                        emit(expand(match))
+                        cur = e
+                        last = base + e
+                        n += 1
+                        if n == count:
+                            emit(data[cur:])
+                            while not eof:
+                                data = read(SUB_BUFFER_SIZE)
+                                eof = not data
+                                emit(data)
+                            emit(empty, True)
+                            return n
+                resume = max(cur, limit)
+                emit(data[cur:resume])
+                # Some text before the next search is kept for lookbehinds.
+                keep = _char_boundary(data, max(resume - max_match_len, 0), utf8)
+                data = data[keep:]
+                base += keep
+                start = resume - keep
+            if eof:
+                break
+            chunk = read(SUB_BUFFER_SIZE)
+            eof = not chunk
+            data += chunk
+        emit(empty, True)
+        return n
+
+    def _subn(self, repl, string, count, matches):
         if not hasattr(repl, '__call__'):
             repl = lambda match, tmpl=repl: match.expand(tmpl)
         output = []
         pos = n = 0
-        for match in self.finditer(string, flags=flags):
+        for match in matches:
             start, end = match.span()
             if not pos == start == end or pos == 0:
                 output.extend((string[pos:start], repl(match)))
@@ -93,14 +245,40 @@ class Pattern(_pcre.Pattern):
                 n += 1
                 if 0 < count <= n:
                     break
+            # Lets finditer(reuse_match=True) update the match in place.
+            del match
         output.append(string[pos:])
         return (string[:0].join(output), n)
 
+    def analyze(self):
+        # Returns a list of BacktrackingRisk tuples describing constructs
+        # that can make matching take exponential or polynomial time.
+        if self.pattern is None:
+            raise ValueError('cannot analyze a pattern without its source')
+        return _analyze(self.pattern, self.flags)
+
+    def study(self, options=0):
+        # Options are remembered so that unpickled patterns are studied again.
+        result = _pcre.Pattern.study(self, options)
+        self._study_options = options
+        return result
+
     def __reduce__(self):
         if self.pattern is None:
             return (Pattern, (None, 0, self.dumps()))
         return (Pattern, (self.pattern, self.flags))
 
+    def __reduce_ex__(self, protocol):
+        # Protocol 5 passes the compiled code as an out-of-band buffer so
+        # unpickling doesn't compile the pattern again.  With PCRE 8.x the
+        # buffer is the code itself and study data without JIT is passed too.
+        if protocol < 5 or self.flags & LOCALE:
+            return self.__reduce__()
+        from pickle import PickleBuffer
+        study = getattr(self, '_study_options', None)
+        return (_load_pattern, (self.pattern, self.flags, PickleBuffer(self._code()),
+                                study, None if study is None else self._study_data()))
+
     def __repr__(self):
         if self.pattern is None:
             return '{0}.loads({1})'.format(__name__, repr(self.dumps()))
@@ -121,6 +299,20 @@ class Match(_pcre.Match):
     def expand(self, template):
         return template.format(self.group(), *self.groups(''), **self.groupdict(''))
 
+    def __reduce_ex__(self, protocol):
+        # Pickled as the subject and offsets so unpickling doesn't match
+        # again.  Offsets are native ints, passed out-of-band with protocol 5.
+        ovector = self._ovector()
+        if protocol >= 5:
+            from pickle import PickleBuffer
+            ovector = PickleBuffer(ovector)
+        detached = self._detached()
+        if detached is not None:
+            # Only the matched part is pickled, along with its offsets.
+            return (type(self), (self.re, detached[0], self.pos, self.endpos, self.flags,
+                                 ovector, detached[1]))
+        return (type(self), (self.re, self.string, self.pos, self.endpos, self.flags, ovector))
+
     def __repr__(self):
         cls = self.__class__
         return '<{0}.{1} object; span={2}, match={3}>'.format(cls.__module__,
@@ -150,12 +342,709 @@ class REMatch(Match):
             return result
         return _REGEX_RE_TEMPLATE.sub(repl, template)
 
-def compile(pattern, flags=0):
+class Scanner(object):
+    # Tokenizer made of (pattern, kind) rules.  The rules are combined into
+    # a single pattern and the subject is scanned in one native pass.
+    # Tokens of rules whose kind is None or in skip are not returned.
+    def __init__(self, lexicon, flags=0, skip=()):
+        self.lexicon = lexicon
+        alternatives = []
+        kinds = []
+        mask = []
+        bar = '|'
+        for i, (phrase, kind) in enumerate(lexicon):
+            prefix, suffix = '(*MARK:%d)(?:' % i, '\n)' if flags & VERBOSE else ')'
+            if not isinstance(phrase, str):
+                prefix, suffix, bar = [x.encode('ascii') for x in (prefix, suffix, '|')]
+            alternatives.append(prefix + phrase + suffix)
+            kinds.append(kind)
+            mask.append(kind is None or kind in skip)
+        self.kinds = tuple(kinds)
+        self.pattern = Pattern(bar.join(alternatives), flags)
+        self._skip = bytes(bytearray(mask))
+
+    def tokenize(self, string, pos=-1, endpos=-1, text=False, flags=0):
+        # Returns a list of (kind, start, end) tuples, with the token text
+        # appended if text is true, and the offset where scanning stopped.
+        return self.pattern._scan(string, self.kinds, self._skip, 1 if text else 0,
+                                  pos, endpos, flags)
+
+    def columns(self, string, pos=-1, endpos=-1, flags=0):
+        # Same as tokenize() but returns the rule indexes into kinds, the
+        # starts and the ends of tokens as three array.array('i') objects.
+        import array
+        (rules, starts, ends), stop = self.pattern._scan(string, self.kinds, self._skip,
+                                                         2, pos, endpos, flags)
+        return (array.array('i', rules), array.array('i', starts),
+                array.array('i', ends)), stop
+
+    def scan(self, string):
+        # Same as re.Scanner.scan().  Callable kinds are called with the
+        # scanner and the token text; None results are dropped.
+        result = []
+        tokens, stop = self.tokenize(string, text=True)
+        for kind, start, end, token in tokens:
+            if hasattr(kind, '__call__'):
+                kind = kind(self, token)
+                if kind is None:
+                    continue
+            result.append(kind)
+        return result, string[stop:]
+
+class SharedPatternStore(object):
+    # Compiled patterns stored in a memory mapped segment.  Created before
+    # forking, or attached to using the path, it lets worker processes use
+    # the same read-only copy of the code.  Patterns are created lazily and
+    # studied (optionally with JIT) once per process.
+    _MAGIC = b'PYPCRES1'
+    _HEADER = '=8si'
+    _ENTRY = '=qqi'
+    _ALIGN = 16
+
+    def __init__(self, patterns, flags=0, path=None):
+        # Patterns can be given as regexes or (regex, flags) tuples.
+        import mmap, struct
+        entries = []
+        for pattern in patterns:
+            pattern, pflags = pattern if isinstance(pattern, tuple) else (pattern, flags)
+            entries.append((compile(pattern, pflags).dumps(), pflags))
+        offset = self._align(struct.calcsize(self._HEADER) +
+                             struct.calcsize(self._ENTRY) * len(entries))
+        index = []
+        for data, pflags in entries:
+            index.append((offset, len(data), pflags))
+            offset = self._align(offset + len(data))
+        if path is None:
+            buf = mmap.mmap(-1, offset)
+        else:
+            with open(path, 'w+b') as f:
+                f.truncate(offset)
+                buf = mmap.mmap(f.fileno(), offset)
+        buf[:struct.calcsize(self._HEADER)] = struct.pack(self._HEADER, self._MAGIC, len(entries))
+        pos = struct.calcsize(self._HEADER)
+        for (offset, length, pflags), (data, _) in zip(index, entries):
+            buf[pos:pos + struct.calcsize(self._ENTRY)] = struct.pack(self._ENTRY, offset, length, pflags)
+            pos += struct.calcsize(self._ENTRY)
+            buf[offset:offset + length] = data
+        self._setup(buf, index)
+
+    @classmethod
+    def attach(cls, path):
+        # Maps a store created with a path read-only.
+        import mmap, struct
+        with open(path, 'rb') as f:
+            buf = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        pos = struct.calcsize(cls._HEADER)
+        magic, count = struct.unpack(cls._HEADER, buf[:pos])
+        if magic != cls._MAGIC:
+            raise ValueError('not a pattern store')
+        index = []
+        for i in range(count):
+            index.append(struct.unpack(cls._ENTRY, buf[pos:pos + struct.calcsize(cls._ENTRY)]))
+            pos += struct.calcsize(cls._ENTRY)
+        self = cls.__new__(cls)
+        self._setup(buf, index)
+        return self
+
+    def _setup(self, buf, index):
+        self._buf = buf
+        self._index = index
+        self._patterns = {}
+        self._pid = None
+
+    def _align(self, offset):
+        return (offset + self._ALIGN - 1) & ~(self._ALIGN - 1)
+
+    def get(self, index, jit=False):
+        # Returns the pattern at index.  The code is not copied with PCRE
+        # 8.x, PCRE2 builds unserialize it once per process.  Patterns
+        # studied with and without JIT are cached separately.
+        import os
+        if self._pid != os.getpid():
+            self._patterns = {}
+            self._pid = os.getpid()
+        key = (index, bool(jit))
+        pattern = self._patterns.get(key)
+        if pattern is None:
+            offset, length, flags = self._index[index]
+            try:
+                view = memoryview(self._buf)[offset:offset + length]
+            except (NameError, TypeError):
+                # Python 2 mmap only supports the old buffer interface.
+                view = buffer(self._buf, offset, length)
+            pattern = Pattern(None, flags, buffer=view)
+            pattern.study(STUDY_JIT if jit else 0)
+            self._patterns[key] = pattern
+        return pattern
+
+    def __getitem__(self, index):
+        return self.get(index)
+
+    def __len__(self):
+        return len(self._index)
+
+    def __iter__(self):
+        for i in range(len(self)):
+            yield self.get(i)
+
+# Backtracking risk analysis.  The pattern source is parsed into a small
+# tree of _RiskNode objects which is then searched for constructs that let
+# PCRE try exponentially (nested quantifiers, overlapping alternatives
+# under a quantifier) or polynomially (adjacent quantifiers) many ways of
+# matching the same text.  Sets of characters are approximated by subsets
+# of _SAMPLE_CHARS.
+
+BacktrackingRisk = namedtuple('BacktrackingRisk', 'severity kind span message suggestion')
+CompiledPatterns = namedtuple('CompiledPatterns', 'patterns stats')
+
+try:
+    _unichr = unichr
+except NameError:
+    _unichr = chr
+
+def _charset(chars):
+    return frozenset(ord(c) for c in chars)
+
+_SAMPLE_CHARS = frozenset(list(range(128)) + [0xc9, 0xe9, 0x430, 0x20ac])
+_DIGIT = _charset('0123456789')
+_LOWER = _charset('abcdefghijklmnopqrstuvwxyz')
+_UPPER = _charset('ABCDEFGHIJKLMNOPQRSTUVWXYZ')
+_WORD = _DIGIT | _LOWER | _UPPER | _charset('_')
+_UNICODE_WORD = _WORD | frozenset([0xc9, 0xe9, 0x430])
+_SPACE = _charset(' \t\n\r\f\v')
+_HSPACE = _charset(' \t')
+_VSPACE = _charset('\n\r\f\v')
+_NEWLINE = _charset('\n')
+_POSIX_CLASSES = {
+    'alpha': _LOWER | _UPPER,
+    'digit': _DIGIT,
+    'alnum': _LOWER | _UPPER | _DIGIT,
+    'word': _WORD,
+    'upper': _UPPER,
+    'lower': _LOWER,
+    'space': _SPACE,
+    'blank': _HSPACE,
+    'xdigit': _DIGIT | _charset('abcdefABCDEF'),
+    'cntrl': frozenset(list(range(32)) + [127]),
+    'punct': frozenset(c for c in range(33, 127) if c not in _WORD or c == ord('_')),
+    'graph': frozenset(range(33, 127)),
+    'print': frozenset(range(32, 127)),
+    'ascii': frozenset(range(128)),
+}
+_SIMPLE_ESCAPES = {'a': 7, 'e': 27, 'f': 12, 'n': 10, 'r': 13, 't': 9}
+
+class _RiskNode(object):
+    # kind is 'char' (chars), 'empty' (anchors, assertions, comments),
+    # 'opaque' (backreferences, recursion), 'seq' and 'alt' (items),
+    # 'group' (group, body) or 'rep' (body, min, max, mode, qend).
+    def __init__(self, kind, start, end, **attrs):
+        self.kind = kind
+        self.start = start
+        self.end = end
+        self.__dict__.update(attrs)
+
+class _RiskParser(object):
+    # Tolerant parser of PCRE syntax.  The pattern has already been compiled
+    # so anything not understood is skipped rather than reported.
+    def __init__(self, source, flags):
+        self.s = source
+        self.i = 0
+        self.n = len(source)
+        self.caseless = bool(flags & IGNORECASE)
+        self.dotall = bool(flags & DOTALL)
+        self.extended = bool(flags & VERBOSE)
+        self.ucp = bool(flags & UNICODE)
+
+    def parse(self):
+        items = [self._alt()]
+        while self.i < self.n:
+            self.i += 1
+            items.append(self._alt())
+        if len(items) == 1:
+            return items[0]
+        return _RiskNode('seq', 0, self.n, items=items)
+
+    def _alt(self):
+        start = self.i
+        branches = [self._seq()]
+        while self.i < self.n and self.s[self.i] == '|':
+            self.i += 1
+            branches.append(self._seq())
+        if len(branches) == 1:
+            return branches[0]
+        return _RiskNode('alt', start, self.i, items=branches)
+
+    def _seq(self):
+        start = self.i
+        items = []
+        while 1:
+            self._skip_extended()
+            if self.i >= self.n or self.s[self.i] in '|)':
+                break
+            items.append(self._quantifier(self._atom()))
+        return _RiskNode('seq', start, self.i, items=items)
+
+    def _skip_extended(self):
+        s = self.s
+        while self.extended and self.i < self.n:
+            if s[self.i].isspace():
+                self.i += 1
+            elif s[self.i] == '#':
+                end = s.find('\n', self.i)
+                self.i = self.n if end < 0 else end + 1
+            else:
+                break
+
+    def _atom(self):
+        s, start = self.s, self.i
+        c = s[start]
+        self.i += 1
+        if c == '(':
+            return self._group(start)
+        if c == '[':
+            chars = self._class()
+        elif c == '\\':
+            if s.startswith('Q', self.i):
+                end = s.find('\\E', self.i)
+                end = self.n if end < 0 else end
+                text = s[self.i + 1:end]
+                self.i = min(end + 2, self.n)
+                return _RiskNode('seq', start, self.i,
+                                 items=[_RiskNode('char', start, self.i,
+                                                  chars=self._fold(_charset(x)))
+                                        for x in text])
+            chars = self._escape(False)
+            if chars is None or chars is False:
+                return _RiskNode('opaque' if chars is False else 'empty', start, self.i)
+        elif c == '.':
+            chars = _SAMPLE_CHARS if self.dotall else _SAMPLE_CHARS - _NEWLINE
+        elif c in '^$':
+            return _RiskNode('empty', start, self.i)
+        else:
+            chars = ord(c)
+        if not isinstance(chars, frozenset):
+            chars = self._fold(frozenset([chars]))
+        return _RiskNode('char', start, self.i, chars=chars)
+
+    def _fold(self, chars):
+        if not self.caseless:
+            return chars
+        folded = set(chars)
+        for c in chars:
+            for x in (_unichr(c).lower(), _unichr(c).upper()):
+                if len(x) == 1:
+                    folded.add(ord(x))
+        return frozenset(folded)
+
+    def _skip_name(self, close):
+        end = self.s.find(close, self.i)
+        self.i = self.n if end < 0 else end + 1
+
+    def _escape(self, in_class):
+        # Returns a code point, a frozenset of them, None for zero-width
+        # escapes or False for backreferences.
+        s = self.s
+        if self.i >= self.n:
+            return ord('\\')
+        c = s[self.i]
+        self.i += 1
+        if c in 'dDwWsShHvVNR':
+            chars = {'d': _DIGIT, 'w': _UNICODE_WORD if self.ucp else _WORD,
+                     's': _SPACE, 'h': _HSPACE, 'v': _VSPACE, 'R': _VSPACE,
+                     'N': _NEWLINE}[c.lower() if c not in 'NR' else c]
+            if c in 'DWSHVN':
+                chars = _SAMPLE_CHARS - chars
+            return chars
+        if c in 'pP':
+            if s.startswith('{', self.i):
+                self._skip_name('}')
+            else:
+                self.i += 1
+            return _SAMPLE_CHARS
+        if c in 'XC':
+            return _SAMPLE_CHARS
+        if c == 'b' and in_class:
+            return 8
+        if c in 'bBAZzGKE':
+            return None
+        if c in _SIMPLE_ESCAPES:
+            return _SIMPLE_ESCAPES[c]
+        if c == 'c' and self.i < self.n:
+            self.i += 1
+            return ord(s[self.i - 1].upper()) ^ 0x40
+        if c in 'xo':
+            digits, base = ('0123456789abcdefABCDEF', 16) if c == 'x' else ('01234567', 8)
+            if s.startswith('{', self.i):
+                end = s.find('}', self.i)
+                value = s[self.i + 1:end]
+                self.i = end + 1
+            else:
+                j = self.i
+                while j < self.n and j - self.i < 2 and s[j] in digits:
+                    j += 1
+                value, self.i = s[self.i:j], j
+            try:
+                return int(value or '0', base)
+            except ValueError:
+                return 0
+        if c.isdigit():
+            j = self.i
+            while j < self.n and s[j].isdigit():
+                j += 1
+            value, self.i = s[self.i - 1:j], j
+            if c != '0' and not in_class:
+                return False
+            try:
+                return int(value[:3], 8)
+            except ValueError:
+                return ord(c)
+        if c in 'gk' and not in_class:
+            if self.i < self.n and s[self.i] in '{<\'':
+                self._skip_name({'{': '}', '<': '>', '\'': '\''}[s[self.i]])
+            else:
+                while self.i < self.n and (s[self.i].isdigit() or s[self.i] in '+-'):
+                    self.i += 1
+            return False
+        return ord(c)
+
+    def _class(self):
+        s = self.s
+        negate = s.startswith('^', self.i)
+        if negate:
+            self.i += 1
+        chars = set()
+        first = True
+        while self.i < self.n:
+            c = s[self.i]
+            if c == ']' and not first:
+                self.i += 1
+                break
+            first = False
+            if c == '[' and s[self.i + 1:self.i + 2] in (':', '.', '='):
+                end = s.find(s[self.i + 1] + ']', self.i + 2)
+                if end > 0:
+                    name = s[self.i + 2:end]
+                    self.i = end + 2
+                    posix = _POSIX_CLASSES.get(name.lstrip('^'), frozenset())
+                    chars.update(_SAMPLE_CHARS - posix if name.startswith('^') else posix)
+                    continue
+            lo = self._class_char()
+            if s.startswith('-', self.i) and self.i + 1 < self.n and s[self.i + 1] != ']':
+                self.i += 1
+                hi = self._class_char()
+                if isinstance(lo, frozenset) or isinstance(hi, frozenset):
+                    chars.add(ord('-'))
+                else:
+                    chars.update(x for x in _SAMPLE_CHARS if lo <= x <= hi)
+                    chars.update((lo, hi))
+                    continue
+                chars.update(hi if isinstance(hi, frozenset) else (hi,))
+            chars.update(lo if isinstance(lo, frozenset) else (lo,))
+        chars = self._fold(frozenset(chars))
+        return _SAMPLE_CHARS - chars if negate else chars
+
+    def _class_char(self):
+        c = self.s[self.i]
+        self.i += 1
+        if c != '\\':
+            return ord(c)
+        chars = self._escape(True)
+        if chars is None or chars is False:
+            return frozenset()
+        return chars
+
+    def _group(self, start):
+        s = self.s
+        if s.startswith('*', self.i):
+            # Verbs and start of pattern options such as (*UTF8).
+            name = s[self.i + 1:s.find(')', self.i)]
+            self._skip_name(')')
+            if name == 'UCP':
+                self.ucp = True
+            return _RiskNode('empty', start, self.i)
+        if not s.startswith('?', self.i):
+            return self._body(start, 'capture')
+        self.i += 1
+        c, c2 = s[self.i:self.i + 1], s[self.i + 1:self.i + 2]
+        if c in ('#', 'C') or (c == 'P' and c2 in ('=', '>')) or c in ('R', '&') \
+                or c.isdigit() or (c in ('+', '-') and c2.isdigit()):
+            # Comments and callouts match nothing, backreferences and
+            # subroutine calls are not followed.
+            kind = 'empty' if c in ('#', 'C') else 'opaque'
+            self._skip_name(')')
+            return _RiskNode(kind, start, self.i)
+        if c in (':', '|', '>', '=', '!') or s.startswith('<=', self.i) or \
+                s.startswith('<!', self.i):
+            kind = {'>': 'atomic', '=': 'look', '!': 'look', '<': 'look'}.get(c, 'capture')
+            self.i += 2 if c == '<' else 1
+            return self._body(start, kind)
+        if c in ('<', '\'') or (c == 'P' and c2 == '<'):
+            self._skip_name('>' if c != '\'' else '\'')
+            return self._body(start, 'capture')
+        if c == '(':
+            # Conditional group, the condition is skipped.
+            if c2 in ('?', '*'):
+                self._atom()
+            else:
+                self._skip_name(')')
+            return self._body(start, 'capture')
+        # Option settings, either (?flags) or (?flags:...).
+        on = True
+        saved = self._flags()
+        while self.i < self.n and s[self.i] not in ':)':
+            c = s[self.i]
+            if c in '-^':
+                if c == '^':
+                    self.caseless = self.dotall = self.extended = False
+                on = c == '^'
+            elif c == 'i':
+                self.caseless = on
+            elif c == 's':
+                self.dotall = on
+            elif c == 'x':
+                self.extended = on
+            self.i += 1
+        if s.startswith(')', self.i):
+            self.i += 1
+            return _RiskNode('empty', start, self.i)
+        self.i += 1
+        node = self._body(start, 'capture')
+        self._set_flags(saved)
+        return node
+
+    def _flags(self):
+        return self.caseless, self.dotall, self.extended
+
+    def _set_flags(self, flags):
+        self.caseless, self.dotall, self.extended = flags
+
+    def _body(self, start, kind):
+        saved = self._flags()
+        body = self._alt()
+        self._set_flags(saved)
+        if self.i < self.n:
+            self.i += 1
+        return _RiskNode('group', start, self.i, group=kind, body=body)
+
+    def _quantifier(self, atom):
+        s = self.s
+        self._skip_extended()
+        c = s[self.i:self.i + 1]
+        if c == '*':
+            lo, hi, end = 0, None, self.i + 1
+        elif c == '+':
+            lo, hi, end = 1, None, self.i + 1
+        elif c == '?':
+            lo, hi, end = 0, 1, self.i + 1
+        elif c == '{':
+            end = s.find('}', self.i)
+            parts = s[self.i + 1:end].split(',')
+            if end < 0 or len(parts) > 2 or not parts[0].isdigit() or \
+                    not (parts[-1].isdigit() or len(parts) == 2 and not parts[1]):
+                return atom
+            lo = int(parts[0])
+            hi = int(parts[-1]) if parts[-1] else None
+            end += 1
+        else:
+            return atom
+        mode = {'+': 'possessive', '?': 'lazy'}.get(s[end:end + 1], 'greedy')
+        self.i = end if mode == 'greedy' else end + 1
+        return _RiskNode('rep', atom.start, self.i, body=atom, min=lo, max=hi,
+                         mode=mode, qend=end)
+
+def _nullable(node):
+    kind = node.kind
+    if kind in ('seq', 'alt'):
+        return (all if kind == 'seq' else any)(_nullable(x) for x in node.items)
+    if kind == 'group':
+        return node.group == 'look' or _nullable(node.body)
+    if kind == 'rep':
+        return node.min == 0 or _nullable(node.body)
+    return kind != 'char'
+
+def _chars(node, first=False):
+    # Characters node can match anywhere or, with first, at its start.
+    kind = node.kind
+    if kind == 'char':
+        return node.chars
+    if kind in ('seq', 'alt'):
+        chars = set()
+        for item in node.items:
+            chars.update(_chars(item, first))
+            if first and kind == 'seq' and not _nullable(item):
+                break
+        return chars
+    if kind == 'group' and node.group != 'look' or kind == 'rep' and node.max != 0:
+        return _chars(node.body, first)
+    return frozenset()
+
+def _flatten(node):
+    # Items of a sequence with groups that don't change backtracking
+    # expanded in place.
+    if node.kind == 'seq':
+        items = []
+        for item in node.items:
+            items.extend(_flatten(item))
+        return items
+    if node.kind == 'group' and node.group == 'capture' and node.body.kind != 'alt':
+        return _flatten(node.body)
+    return [node]
+
+def _unbounded(node):
+    return node.kind == 'rep' and node.max is None and node.mode != 'possessive'
+
+class _RiskAnalyzer(object):
+    def __init__(self, source):
+        self.source = source
+        self.risks = {}
+
+    def _add(self, severity, kind, span, message, suggestion=None):
+        self.risks.setdefault((kind, span), (severity, kind, span, message, suggestion))
+
+    def _quote(self, node):
+        return "'%s'" % self.source[node.start:node.end]
+
+    def walk(self, node, committed=False):
+        # Backtracking into a committed node never happens, such as into
+        # the tail of an atomic group.
+        kind = node.kind
+        if kind == 'seq':
+            for i, item in enumerate(node.items):
+                self.walk(item, committed and i == len(node.items) - 1)
+            self._adjacent(_flatten(node))
+        elif kind == 'alt':
+            for item in node.items:
+                self.walk(item, committed)
+        elif kind == 'group':
+            self.walk(node.body, committed or node.group != 'capture')
+        elif kind == 'rep':
+            if not committed and node.mode != 'possessive' and \
+                    (node.max is None or node.max > 1):
+                self._nested(node)
+                self._overlapping(node)
+            self.walk(node.body, node.mode == 'possessive')
+
+    def _nested(self, rep):
+        # An unbounded quantifier inside another one where everything else
+        # the outer one has to match can be matched by the inner one too.
+        body = _flatten(rep.body)
+        if len(body) == 1 and body[0].kind == 'group' and body[0].group == 'capture':
+            body = body[0].body
+        branches = body.items if not isinstance(body, list) and body.kind == 'alt' else [body]
+        severity = 'exponential' if rep.max is None else 'polynomial'
+        for branch in branches:
+            items = branch if isinstance(branch, list) else _flatten(branch)
+            for i, inner in enumerate(items):
+                if not _unbounded(inner):
+                    continue
+                chars = _chars(inner)
+                others = items[:i] + items[i + 1:]
+                if not chars or not all(_nullable(x) or _chars(x) & chars for x in others):
+                    continue
+                suggestion = None
+                if inner.mode == 'greedy' and \
+                        not any(_chars(x) & chars for x in items[i + 1:]):
+                    suggestion = self.source[:inner.qend] + '+' + self.source[inner.qend:]
+                self._add(severity, 'nested quantifier', (rep.start, rep.end),
+                          'quantifier %s nested in %s can match the same text in many ways' %
+                          (self._quote(inner), self._quote(rep)), suggestion)
+
+    def _overlapping(self, rep):
+        # Quantified alternation where one alternative can match what
+        # another one matches.
+        body = rep.body
+        while body.kind == 'group' and body.group == 'capture' or \
+                body.kind == 'seq' and len(body.items) == 1:
+            body = body.body if body.kind == 'group' else body.items[0]
+        if body.kind != 'alt':
+            return
+        branches = [x for x in body.items if not _nullable(x)]
+        for i, a in enumerate(branches):
+            for b in branches[i + 1:]:
+                chars_a, chars_b = _chars(a), _chars(b)
+                if _chars(a, True) & _chars(b, True) and \
+                        (chars_a <= chars_b or chars_b <= chars_a):
+                    self._add('exponential' if rep.max is None else 'polynomial',
+                              'overlapping alternation', (rep.start, rep.end),
+                              'alternatives %s and %s of %s can match the same text' %
+                              (self._quote(a), self._quote(b), self._quote(rep)))
+                    return
+
+    def _adjacent(self, items):
+        # Unbounded quantifiers separated by optional items only that can
+        # match the same characters split the text between them in
+        # polynomially many ways.
+        for i, a in enumerate(items):
+            if not _unbounded(a):
+                continue
+            chars = _chars(a)
+            for b in items[i + 1:]:
+                if _unbounded(b) and _chars(b) & chars:
+                    self._add('polynomial', 'adjacent quantifiers', (a.start, b.end),
+                              'quantifiers %s and %s can match the same text' %
+                              (self._quote(a), self._quote(b)))
+                    break
+                if not _nullable(b):
+                    break
+
+def _analyze(pattern, flags):
+    # Returns a list of BacktrackingRisk tuples, exponential ones first.
+    source = pattern.decode('latin-1') if isinstance(pattern, bytes) else pattern
+    analyzer = _RiskAnalyzer(source)
+    analyzer.walk(_RiskParser(source, flags).parse())
+    risks = []
+    for severity, kind, span, message, suggestion in sorted(
+            analyzer.risks.values(), key=lambda x: (x[0] != 'exponential', x[2])):
+        if isinstance(pattern, bytes):
+            if suggestion is not None:
+                suggestion = suggestion.encode('latin-1')
+            if str is bytes:
+                message = message.encode('latin-1')
+        risks.append(BacktrackingRisk(severity, kind, span, message, suggestion))
+    return risks
+
+def compile(pattern, flags=0, reject_redos=False, engine=None):
+    # With reject_redos, patterns that may backtrack exponentially
+    # (see Pattern.analyze()) raise PCREError.  With engine='auto', the
+    # pattern picks between JIT and the interpreter as it is used.
     if isinstance(pattern, _pcre.Pattern):
         if flags != 0:
             raise ValueError('cannot process flags argument with a compiled pattern')
-        return pattern
-    return Pattern(pattern, flags)
+    else:
+        pattern = Pattern(pattern, flags)
+    if reject_redos:
+        for risk in pattern.analyze():
+            if risk.severity == 'exponential':
+                raise PCREError(102, 'pattern may backtrack catastrophically at position %d' %
+                                risk.span[0])
+    if engine is not None:
+        pattern.set_engine(engine)
+    return pattern
+
+def compile_many(patterns, flags=0, study=_pcre.STUDY_JIT, workers=None):
+    # Compiles a rule set on native threads with the GIL released and
+    # studies the patterns unless study is None.  Patterns can be given as
+    # regexes or (regex, flags) tuples.  Returns the patterns, or the errors
+    # compile() would have raised, in order along with timing stats.
+    import time
+    if workers is None:
+        import multiprocessing
+        workers = multiprocessing.cpu_count()
+    items = []
+    for pattern in patterns:
+        items.append(pattern if isinstance(pattern, tuple) else (pattern, flags))
+    timer = getattr(time, 'perf_counter', time.time)
+    start = timer()
+    results, started = _pcre._compile_many(Pattern, items, -1 if study is None else study,
+                                           workers)
+    stats = {'patterns': len(results), 'errors': 0, 'workers': started,
+             'seconds': timer() - start}
+    for result in results:
+        if isinstance(result, Exception):
+            stats['errors'] += 1
+        elif study is not None:
+            result._study_options = study
+    return CompiledPatterns(results, stats)
 
 def match(pattern, string, flags=0):
     return compile(pattern, flags).match(string)
@@ -178,10 +1067,89 @@ def sub(pattern, repl, string, count=0, flags=0):
 def subn(pattern, repl, string, count=0, flags=0):
     return compile(pattern, flags).subn(repl, string, count)
 
+def _char_boundary(data, offset, utf8):
+    # Moves offset back to the start of a UTF-8 character.
+    while utf8 and 0 < offset < len(data) and \
+            0x80 <= bytearray(data[offset:offset + 1])[0] < 0xc0:
+        offset -= 1
+    return offset
+
+def _utf8_end(data):
+    # Returns the offset past the last complete UTF-8 character in data.
+    end = len(data)
+    start = _char_boundary(data, end - 1, True)
+    if start < 0:
+        return end
+    lead = bytearray(data[start:start + 1])[0]
+    size = 1 if lead < 0xc0 else 2 if lead < 0xe0 else 3 if lead < 0xf0 else 4
+    return start if start + size > end else end
+
+# Constructs letting a match depend on text outside of its line.
+_LINE_CONTEXT = ('(?=', '(?!', '(?<=', '(?<!', '(*', '\\A', '\\Z', '\\z', '\\G')
+
+def _sees_other_lines(pattern):
+    # Tells whether grep() has to search lines one by one.  Escaped
+    # backslashes may give false positives, which only cost speed.
+    if pattern is None:
+        return True
+    if isinstance(pattern, bytes):
+        return any(s.encode('ascii') in pattern for s in _LINE_CONTEXT)
+    return any(s in pattern for s in _LINE_CONTEXT)
+
+def _submit(pattern, string, pos, endpos, flags, limit, convert):
+    # Returns an asyncio future of convert(matches).
+    import asyncio
+    try:
+        loop = asyncio.get_running_loop()
+    except AttributeError:
+        # Python < 3.7.
+        loop = asyncio.get_event_loop()
+    future = loop.create_future()
+    if len(string) < ASYNC_INLINE_SIZE:
+        matches = []
+        for match in pattern.finditer(string, pos, endpos, flags):
+            matches.append(match)
+            if len(matches) == limit:
+                break
+        _set_future(future, convert, matches, None)
+    else:
+        def callback(matches, error):
+            # Called from the worker thread.
+            loop.call_soon_threadsafe(_set_future, future, convert, matches, error)
+        pattern._submit(Match, string, callback, pos, endpos, flags, limit)
+    return future
+
+def _set_future(future, convert, matches, error):
+    if future.cancelled():
+        return
+    if error is None:
+        try:
+            result = convert(matches)
+        except Exception as e:
+            error = e
+    if error is None:
+        future.set_result(result)
+    else:
+        future.set_exception(error)
+
 def loads(data):
     # Loads a pattern serialized with Pattern.dumps().
     return Pattern(None, loads=data)
 
+def _load_pattern(pattern, flags, code, study, study_data=None):
+    # Unpickles a pattern.  The code is used in place if the buffer allows.
+    # Patterns are studied again unless their study data was passed.
+    try:
+        result = Pattern(pattern, flags, buffer=code)
+    except ValueError:
+        result = Pattern(pattern, flags, bytes(code))
+    if study_data is not None:
+        result._load_study(study_data)
+        result._study_options = study
+    elif study is not None:
+        result.study(study)
+    return result
+
 def escape(pattern):
     # Escapes a regular expression.
     s = list(pattern)
@@ -206,6 +1174,10 @@ def convert_re_template(template):
         return '{%s}' % (index or group)
     return _REGEX_RE_TEMPLATE.sub(repl, escape_template(template))
 
+def memory_usage():
+    # Returns totals of memory currently allocated by PCRE.
+    return _pcre.get_memory_usage()
+
 def enable_re_template_mode():
     # Makes calls to sub() take re templates instead of str.format() templates.
     global Match
@@ -216,13 +1188,25 @@ error = PCREError = _pcre.PCREError
 NoMatch = _pcre.NoMatch
 MAXREPEAT = 65536
 
+# Subjects shorter than this are matched right away by *_async() methods.
+ASYNC_INLINE_SIZE = 64 * 1024
+
+# Worker threads must not call back into the interpreter once it's finalized.
+atexit.register(_pcre._cancel_jobs)
+
+# Initial size of the buffer Pattern.grep() reads files into.
+GREP_BUFFER_SIZE = 1024 * 1024
+
+# Size of chunks Pattern.sub_to() reads and writes.
+SUB_BUFFER_SIZE = 1024 * 1024
+
 # Provides PCRE build-time configuration.
 config = type('config', (), _pcre.get_config())
 
 # Pattern and/or match flags
 _FLAGS = ('IGNORECASE', 'MULTILINE', 'DOTALL', 'UNICODE', 'VERBOSE',
           'ANCHORED', 'NOTBOL', 'NOTEOL', 'NOTEMPTY', 'NOTEMPTY_ATSTART',
-          'UTF8', 'NO_UTF8_CHECK')
+          'UTF8', 'NO_UTF8_CHECK', 'LOCALE')
 
 # Copy flags from _pcre module
 ns = globals()
@@ -232,6 +1216,7 @@ del ns, name
 
 # Short versions
 I = IGNORECASE
+L = LOCALE
 M = MULTILINE
 S = DOTALL
 U = UNICODE
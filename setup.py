@@ -28,12 +28,20 @@ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 """
 
+import os
 from distutils.core import setup, Extension
 
 
-_pcre = Extension('_pcre', ['src/pcremodule.c'],
-                  libraries=['pcre'],
-                  extra_compile_args=['-fno-strict-aliasing'])
+# Set PYPCRE_PCRE2=1 in the environment to build against PCRE2.
+if os.environ.get('PYPCRE_PCRE2'):
+    _pcre = Extension('_pcre', ['src/pcremodule.c', 'src/pcre2compat.c'],
+                      libraries=['pcre2-8'],
+                      define_macros=[('PYPCRE_PCRE2', None)],
+                      extra_compile_args=['-fno-strict-aliasing'])
+else:
+    _pcre = Extension('_pcre', ['src/pcremodule.c'],
+                      libraries=['pcre'],
+                      extra_compile_args=['-fno-strict-aliasing'])
 
 
 setup(name='python-pcre',
@@ -0,0 +1,827 @@
+/* python-pcre
+
+Copyright (c) 2012-2015, Arkadiusz Wahlig
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcre2compat.h"
+
+#ifdef _MSC_VER
+#    include <intrin.h>
+#    define PYPCRE2_TLS __declspec(thread)
+#    define pypcre2_atomic_cas_ptr(p, old, v) \
+        _InterlockedCompareExchangePointer((void *volatile *)(p), (v), (old))
+#else
+#    define PYPCRE2_TLS __thread
+#    define pypcre2_atomic_cas_ptr(p, old, v) __sync_val_compare_and_swap((p), (old), (v))
+#endif
+
+/* Private pcre_extra flag set if pcre2_jit_compile() succeeded. */
+#define PYPCRE2_EXTRA_JIT       0x8000
+
+#define PYPCRE2_COMPILE_OPTIONS (PCRE_CASELESS | PCRE_MULTILINE | PCRE_DOTALL \
+        | PCRE_EXTENDED | PCRE_ANCHORED | PCRE_DOLLAR_ENDONLY | PCRE_EXTRA \
+        | PCRE_UNGREEDY | PCRE_UTF8 | PCRE_NO_AUTO_CAPTURE | PCRE_NO_UTF8_CHECK \
+        | PCRE_AUTO_CALLOUT | PCRE_NEVER_UTF | PCRE_NO_AUTO_POSSESS \
+        | PCRE_FIRSTLINE | PCRE_DUPNAMES | PCRE_NEWLINE_ANYCRLF | PCRE_NEWLINE_ANY \
+        | PCRE_BSR_ANYCRLF | PCRE_BSR_UNICODE | PCRE_JAVASCRIPT_COMPAT \
+        | PCRE_NO_START_OPTIMIZE | PCRE_UCP)
+
+#define PYPCRE2_EXEC_OPTIONS (PCRE_ANCHORED | PCRE_NOTBOL | PCRE_NOTEOL \
+        | PCRE_NOTEMPTY | PCRE_NOTEMPTY_ATSTART | PCRE_NO_UTF8_CHECK \
+        | PCRE_PARTIAL_SOFT | PCRE_PARTIAL_HARD | PCRE_NO_START_OPTIMIZE)
+
+/* Options pcre2_jit_match() can handle. */
+#define PYPCRE2_JIT_OPTIONS (PCRE_NOTBOL | PCRE_NOTEOL | PCRE_NOTEMPTY \
+        | PCRE_NOTEMPTY_ATSTART | PCRE_NO_UTF8_CHECK)
+
+void *(*pcre_malloc)(size_t) = malloc;
+void (*pcre_free)(void *) = free;
+
+/* All PCRE2 allocations go through the pcre_malloc/pcre_free hooks. */
+static void *
+_gcontext_malloc(size_t size, void *data)
+{
+    (void)data;
+    return pcre_malloc(size);
+}
+
+static void
+_gcontext_free(void *ptr, void *data)
+{
+    (void)data;
+    pcre_free(ptr);
+}
+
+/* Created by the first call from any thread.  Threads racing to do it
+ * keep the one published first.
+ */
+static pcre2_general_context *
+get_gcontext(void)
+{
+    static pcre2_general_context *volatile gcontext = NULL;
+    pcre2_general_context *created, *published;
+
+    if (gcontext)
+        return gcontext;
+
+    created = pcre2_general_context_create(_gcontext_malloc, _gcontext_free, NULL);
+    if (created == NULL)
+        return NULL;
+    published = pypcre2_atomic_cas_ptr(&gcontext, NULL, created);
+    if (published == NULL)
+        return created;
+    pcre2_general_context_free(created);
+    return published;
+}
+
+/* Per-thread match data and match context.  Reusing them removes
+ * the allocation pcre2_match() would otherwise need for every call.
+ */
+static PYPCRE2_TLS pcre2_match_data *tls_match_data = NULL;
+static PYPCRE2_TLS uint32_t tls_match_data_pairs = 0;
+static PYPCRE2_TLS pcre2_match_context *tls_mcontext = NULL;
+static PYPCRE2_TLS pcre2_compile_context *tls_ccontext = NULL;
+static PYPCRE2_TLS char tls_errbuf[256];
+
+static pcre2_match_data *
+get_match_data(uint32_t pairs)
+{
+    if (pairs == 0)
+        pairs = 1;
+
+    if (tls_match_data == NULL || tls_match_data_pairs < pairs) {
+        pcre2_match_data *md = pcre2_match_data_create(pairs, get_gcontext());
+        if (md == NULL)
+            return NULL;
+        if (tls_match_data)
+            pcre2_match_data_free(tls_match_data);
+        tls_match_data = md;
+        tls_match_data_pairs = pairs;
+    }
+    return tls_match_data;
+}
+
+/* Prepares the per-thread match context for a call using <extra>. */
+static pcre2_match_context *
+get_mcontext(const pcre_extra *extra)
+{
+    uint32_t limit;
+
+    if (tls_mcontext == NULL) {
+        tls_mcontext = pcre2_match_context_create(get_gcontext());
+        if (tls_mcontext == NULL)
+            return NULL;
+    }
+
+    pcre2_config(PCRE2_CONFIG_MATCHLIMIT, &limit);
+    if (extra && (extra->flags & PCRE_EXTRA_MATCH_LIMIT))
+        limit = (uint32_t)extra->match_limit;
+    pcre2_set_match_limit(tls_mcontext, limit);
+
+    pcre2_config(PCRE2_CONFIG_DEPTHLIMIT, &limit);
+    if (extra && (extra->flags & PCRE_EXTRA_MATCH_LIMIT_RECURSION))
+        limit = (uint32_t)extra->match_limit_recursion;
+    pcre2_set_depth_limit(tls_mcontext, limit);
+
+    if (extra)
+        pcre2_jit_stack_assign(tls_mcontext, extra->jit_callback, extra->jit_data);
+    else
+        pcre2_jit_stack_assign(tls_mcontext, NULL, NULL);
+
+    return tls_mcontext;
+}
+
+/* Translates PCRE 8.x option bits into PCRE2 option bits. */
+static uint32_t
+translate_options(int options)
+{
+    uint32_t result = 0;
+
+    if (options & PCRE_CASELESS)
+        result |= PCRE2_CASELESS;
+    if (options & PCRE_MULTILINE)
+        result |= PCRE2_MULTILINE;
+    if (options & PCRE_DOTALL)
+        result |= PCRE2_DOTALL;
+    if (options & PCRE_EXTENDED)
+        result |= PCRE2_EXTENDED;
+    if (options & PCRE_ANCHORED)
+        result |= PCRE2_ANCHORED;
+    if (options & PCRE_DOLLAR_ENDONLY)
+        result |= PCRE2_DOLLAR_ENDONLY;
+    if (options & PCRE_UNGREEDY)
+        result |= PCRE2_UNGREEDY;
+    if (options & PCRE_UTF8)
+        result |= PCRE2_UTF;
+    if (options & PCRE_NO_AUTO_CAPTURE)
+        result |= PCRE2_NO_AUTO_CAPTURE;
+    if (options & PCRE_NO_UTF8_CHECK)
+        result |= PCRE2_NO_UTF_CHECK;
+    if (options & PCRE_AUTO_CALLOUT)
+        result |= PCRE2_AUTO_CALLOUT;
+    if (options & PCRE_NEVER_UTF)
+        result |= PCRE2_NEVER_UTF;
+    if (options & PCRE_NO_AUTO_POSSESS)
+        result |= PCRE2_NO_AUTO_POSSESS;
+    if (options & PCRE_FIRSTLINE)
+        result |= PCRE2_FIRSTLINE;
+    if (options & PCRE_DUPNAMES)
+        result |= PCRE2_DUPNAMES;
+    if (options & PCRE_JAVASCRIPT_COMPAT)
+        result |= PCRE2_ALT_BSUX | PCRE2_MATCH_UNSET_BACKREF;
+    if (options & PCRE_NO_START_OPTIMIZE)
+        result |= PCRE2_NO_START_OPTIMIZE;
+    if (options & PCRE_UCP)
+        result |= PCRE2_UCP;
+    return result;
+}
+
+static uint32_t
+translate_exec_options(int options)
+{
+    uint32_t result = 0;
+
+    if (options & PCRE_ANCHORED)
+        result |= PCRE2_ANCHORED;
+    if (options & PCRE_NOTBOL)
+        result |= PCRE2_NOTBOL;
+    if (options & PCRE_NOTEOL)
+        result |= PCRE2_NOTEOL;
+    if (options & PCRE_NOTEMPTY)
+        result |= PCRE2_NOTEMPTY;
+    if (options & PCRE_NOTEMPTY_ATSTART)
+        result |= PCRE2_NOTEMPTY_ATSTART;
+    if (options & PCRE_NO_UTF8_CHECK)
+        result |= PCRE2_NO_UTF_CHECK;
+    if (options & PCRE_PARTIAL_SOFT)
+        result |= PCRE2_PARTIAL_SOFT;
+    if (options & PCRE_PARTIAL_HARD)
+        result |= PCRE2_PARTIAL_HARD;
+    if (options & PCRE_NO_START_OPTIMIZE)
+        result |= PCRE2_NO_START_OPTIMIZE;
+    return result;
+}
+
+/* Reverse of translate_options() for PCRE_INFO_OPTIONS. */
+static unsigned long
+untranslate_options(uint32_t options)
+{
+    unsigned long result = 0;
+
+    if (options & PCRE2_CASELESS)
+        result |= PCRE_CASELESS;
+    if (options & PCRE2_MULTILINE)
+        result |= PCRE_MULTILINE;
+    if (options & PCRE2_DOTALL)
+        result |= PCRE_DOTALL;
+    if (options & PCRE2_EXTENDED)
+        result |= PCRE_EXTENDED;
+    if (options & PCRE2_ANCHORED)
+        result |= PCRE_ANCHORED;
+    if (options & PCRE2_DOLLAR_ENDONLY)
+        result |= PCRE_DOLLAR_ENDONLY;
+    if (options & PCRE2_UNGREEDY)
+        result |= PCRE_UNGREEDY;
+    if (options & PCRE2_UTF)
+        result |= PCRE_UTF8;
+    if (options & PCRE2_NO_AUTO_CAPTURE)
+        result |= PCRE_NO_AUTO_CAPTURE;
+    if (options & PCRE2_NO_UTF_CHECK)
+        result |= PCRE_NO_UTF8_CHECK;
+    if (options & PCRE2_AUTO_CALLOUT)
+        result |= PCRE_AUTO_CALLOUT;
+    if (options & PCRE2_NEVER_UTF)
+        result |= PCRE_NEVER_UTF;
+    if (options & PCRE2_NO_AUTO_POSSESS)
+        result |= PCRE_NO_AUTO_POSSESS;
+    if (options & PCRE2_FIRSTLINE)
+        result |= PCRE_FIRSTLINE;
+    if (options & PCRE2_DUPNAMES)
+        result |= PCRE_DUPNAMES;
+    if (options & PCRE2_NO_START_OPTIMIZE)
+        result |= PCRE_NO_START_OPTIMIZE;
+    if (options & PCRE2_UCP)
+        result |= PCRE_UCP;
+    return result;
+}
+
+/* Maps PCRE2 match error codes onto their PCRE 8.x equivalents. */
+static int
+translate_error(int rc)
+{
+    if (rc >= 0)
+        return rc;
+    if (rc <= PCRE2_ERROR_UTF8_ERR1 && rc >= PCRE2_ERROR_UTF8_ERR21)
+        return PCRE_ERROR_BADUTF8;
+
+    switch (rc) {
+        case PCRE2_ERROR_NOMATCH:
+            return PCRE_ERROR_NOMATCH;
+        case PCRE2_ERROR_PARTIAL:
+            return PCRE_ERROR_PARTIAL;
+        case PCRE2_ERROR_NULL:
+            return PCRE_ERROR_NULL;
+        case PCRE2_ERROR_BADOPTION:
+            return PCRE_ERROR_BADOPTION;
+        case PCRE2_ERROR_BADMAGIC:
+            return PCRE_ERROR_BADMAGIC;
+        case PCRE2_ERROR_BADMODE:
+            return PCRE_ERROR_BADMODE;
+        case PCRE2_ERROR_NOMEMORY:
+            return PCRE_ERROR_NOMEMORY;
+        case PCRE2_ERROR_MATCHLIMIT:
+            return PCRE_ERROR_MATCHLIMIT;
+        case PCRE2_ERROR_DEPTHLIMIT:
+        case PCRE2_ERROR_HEAPLIMIT:
+            return PCRE_ERROR_RECURSIONLIMIT;
+        case PCRE2_ERROR_BADUTFOFFSET:
+            return PCRE_ERROR_BADUTF8_OFFSET;
+        case PCRE2_ERROR_BADOFFSET:
+            return PCRE_ERROR_BADOFFSET;
+        case PCRE2_ERROR_JIT_STACKLIMIT:
+            return PCRE_ERROR_JIT_STACKLIMIT;
+        case PCRE2_ERROR_DFA_UITEM:
+            return PCRE_ERROR_DFA_UITEM;
+        case PCRE2_ERROR_DFA_UCOND:
+            return PCRE_ERROR_DFA_UCOND;
+        case PCRE2_ERROR_DFA_WSSIZE:
+            return PCRE_ERROR_DFA_WSSIZE;
+        case PCRE2_ERROR_DFA_RECURSE:
+            return PCRE_ERROR_DFA_RECURSE;
+    }
+    return PCRE_ERROR_INTERNAL;
+}
+
+/* Copies PCRE2 ovector into a PCRE 8.x style int vector.  Groups that
+ * didn't match, including those past the returned count, are set to -1.
+ */
+static void
+copy_ovector(pcre2_match_data *md, int rc, int *ovector, int ovecsize)
+{
+    PCRE2_SIZE *src = pcre2_get_ovector_pointer(md);
+    int i, count = ovecsize / 3 * 2;
+
+    if (rc == 0)
+        rc = ovecsize / 3;
+    for (i = 0; i < count; ++i) {
+        if (i < rc * 2 && src[i] != PCRE2_UNSET)
+            ovector[i] = (int)src[i];
+        else
+            ovector[i] = -1;
+    }
+}
+
+pcre *
+pcre_compile2(const char *pattern, int options, int *errorcodeptr,
+              const char **errptr, int *erroroffset, const unsigned char *tables)
+{
+    pcre2_code *code;
+    int errorcode;
+    PCRE2_SIZE offset = 0;
+    uint32_t newline;
+
+    if (options & ~PYPCRE2_COMPILE_OPTIONS) {
+        if (errorcodeptr)
+            *errorcodeptr = 17;
+        *errptr = "unknown option bit(s) set";
+        *erroroffset = 0;
+        return NULL;
+    }
+
+    if (tls_ccontext == NULL) {
+        tls_ccontext = pcre2_compile_context_create(get_gcontext());
+        if (tls_ccontext == NULL) {
+            if (errorcodeptr)
+                *errorcodeptr = 21;
+            *errptr = "failed to get memory";
+            *erroroffset = 0;
+            return NULL;
+        }
+    }
+
+    switch (options & PCRE_NEWLINE_ANYCRLF) {
+        case PCRE_NEWLINE_CR: newline = PCRE2_NEWLINE_CR; break;
+        case PCRE_NEWLINE_LF: newline = PCRE2_NEWLINE_LF; break;
+        case PCRE_NEWLINE_CRLF: newline = PCRE2_NEWLINE_CRLF; break;
+        case PCRE_NEWLINE_ANY: newline = PCRE2_NEWLINE_ANY; break;
+        case PCRE_NEWLINE_ANYCRLF: newline = PCRE2_NEWLINE_ANYCRLF; break;
+        default: pcre2_config(PCRE2_CONFIG_NEWLINE, &newline); break;
+    }
+    pcre2_set_newline(tls_ccontext, newline);
+
+    if (options & PCRE_BSR_ANYCRLF)
+        pcre2_set_bsr(tls_ccontext, PCRE2_BSR_ANYCRLF);
+    else if (options & PCRE_BSR_UNICODE)
+        pcre2_set_bsr(tls_ccontext, PCRE2_BSR_UNICODE);
+    else {
+        uint32_t bsr;
+        pcre2_config(PCRE2_CONFIG_BSR, &bsr);
+        pcre2_set_bsr(tls_ccontext, bsr);
+    }
+
+    if (tables) {
+        pcre2_compile_context *ccontext = pcre2_compile_context_copy(tls_ccontext);
+        if (ccontext == NULL) {
+            if (errorcodeptr)
+                *errorcodeptr = 21;
+            *errptr = "failed to get memory";
+            *erroroffset = 0;
+            return NULL;
+        }
+        pcre2_set_character_tables(ccontext, tables);
+        code = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
+                translate_options(options), &errorcode, &offset, ccontext);
+        pcre2_compile_context_free(ccontext);
+    }
+    else
+        code = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
+                translate_options(options), &errorcode, &offset, tls_ccontext);
+
+    if (code == NULL) {
+        pcre2_get_error_message(errorcode, (PCRE2_UCHAR *)tls_errbuf, sizeof(tls_errbuf));
+        /* Compile error numbers start at 100 in PCRE2, most of them
+         * are otherwise the same as in PCRE 8.x.
+         */
+        if (errorcodeptr)
+            *errorcodeptr = errorcode > 100 ? errorcode - 100 : errorcode;
+        *errptr = tls_errbuf;
+        *erroroffset = (int)offset;
+    }
+    return code;
+}
+
+pcre_extra *
+pcre_study(const pcre *code, int options, const char **errptr)
+{
+    pcre_extra *extra;
+
+    *errptr = NULL;
+    if (options & ~(PCRE_STUDY_JIT_COMPILE | PCRE_STUDY_JIT_PARTIAL_SOFT_COMPILE
+            | PCRE_STUDY_JIT_PARTIAL_HARD_COMPILE | PCRE_STUDY_EXTRA_NEEDED)) {
+        *errptr = "unknown or incorrect option bit(s) set";
+        return NULL;
+    }
+
+    extra = (pcre_extra *)pcre_malloc(sizeof(pcre_extra));
+    if (extra == NULL) {
+        *errptr = "failed to get memory";
+        return NULL;
+    }
+    memset(extra, 0, sizeof(pcre_extra));
+    extra->flags = PCRE_EXTRA_STUDY_DATA;
+
+    /* PCRE2 always studies patterns at compile time.  Only JIT is left. */
+    if (options & (PCRE_STUDY_JIT_COMPILE | PCRE_STUDY_JIT_PARTIAL_SOFT_COMPILE
+            | PCRE_STUDY_JIT_PARTIAL_HARD_COMPILE)) {
+        uint32_t jitopts = 0;
+
+        if (options & PCRE_STUDY_JIT_COMPILE)
+            jitopts |= PCRE2_JIT_COMPLETE;
+        if (options & PCRE_STUDY_JIT_PARTIAL_SOFT_COMPILE)
+            jitopts |= PCRE2_JIT_PARTIAL_SOFT;
+        if (options & PCRE_STUDY_JIT_PARTIAL_HARD_COMPILE)
+            jitopts |= PCRE2_JIT_PARTIAL_HARD;
+
+        /* Failing to JIT is not an error, same as in PCRE 8.x. */
+        if (pcre2_jit_compile((pcre2_code *)code, jitopts) == 0) {
+            extra->flags |= PCRE_EXTRA_EXECUTABLE_JIT;
+            if (options & PCRE_STUDY_JIT_COMPILE)
+                extra->flags |= PYPCRE2_EXTRA_JIT;
+        }
+    }
+
+    return extra;
+}
+
+void
+pcre_free_study(pcre_extra *extra)
+{
+    if (extra)
+        pcre_free(extra);
+}
+
+int
+pcre_exec(const pcre *code, const pcre_extra *extra, const char *subject,
+          int length, int startoffset, int options, int *ovector, int ovecsize)
+{
+    pcre2_match_data *md;
+    pcre2_match_context *mcontext;
+    int rc;
+
+    if (code == NULL || subject == NULL || (ovector == NULL && ovecsize > 0))
+        return PCRE_ERROR_NULL;
+    if (ovecsize < 0 || options & ~PYPCRE2_EXEC_OPTIONS)
+        return PCRE_ERROR_BADOPTION;
+    if (startoffset < 0 || startoffset > length)
+        return PCRE_ERROR_BADOFFSET;
+
+    md = get_match_data(ovecsize / 3);
+    mcontext = get_mcontext(extra);
+    if (md == NULL || mcontext == NULL)
+        return PCRE_ERROR_NOMEMORY;
+
+    /* pcre2_jit_match() skips all the sanity checks, including UTF-8
+     * validation, so only use it if the caller allows that.  Callers
+     * clear PCRE_EXTRA_EXECUTABLE_JIT to run the interpreter.
+     */
+    if (extra && (extra->flags & PYPCRE2_EXTRA_JIT)
+            && (extra->flags & PCRE_EXTRA_EXECUTABLE_JIT)
+            && (options & PCRE_NO_UTF8_CHECK)
+            && !(options & ~PYPCRE2_JIT_OPTIONS))
+        rc = pcre2_jit_match(code, (PCRE2_SPTR)subject, length, startoffset,
+                translate_exec_options(options), md, mcontext);
+    else {
+        uint32_t opts = translate_exec_options(options);
+
+        /* Like PCRE 8.x, only use JIT if the extra block says so. */
+        if (extra && !(extra->flags & PCRE_EXTRA_EXECUTABLE_JIT))
+            opts |= PCRE2_NO_JIT;
+        rc = pcre2_match(code, (PCRE2_SPTR)subject, length, startoffset,
+                opts, md, mcontext);
+    }
+
+    if (extra && (extra->flags & PCRE_EXTRA_MARK) && extra->mark)
+        *extra->mark = (unsigned char *)pcre2_get_mark(md);
+
+    if (rc >= 0 && ovecsize >= 3)
+        copy_ovector(md, rc, ovector, ovecsize);
+
+    /* Like PCRE 8.x, report where the invalid UTF-8 character starts
+     * and why it's invalid.  The reason codes are the same.
+     */
+    else if (rc <= PCRE2_ERROR_UTF8_ERR1 && rc >= PCRE2_ERROR_UTF8_ERR21 && ovecsize >= 2) {
+        ovector[0] = (int)pcre2_get_startchar(md);
+        ovector[1] = PCRE2_ERROR_UTF8_ERR1 - rc + 1;
+    }
+    return translate_error(rc);
+}
+
+int
+pcre_dfa_exec(const pcre *code, const pcre_extra *extra, const char *subject,
+              int length, int startoffset, int options, int *ovector, int ovecsize,
+              int *workspace, int wscount)
+{
+    pcre2_match_data *md;
+    pcre2_match_context *mcontext;
+    uint32_t dfaopts;
+    int rc;
+
+    if (code == NULL || subject == NULL || (ovector == NULL && ovecsize > 0))
+        return PCRE_ERROR_NULL;
+    if (ovecsize < 0 || options & ~(PYPCRE2_EXEC_OPTIONS | PCRE_DFA_SHORTEST
+            | PCRE_DFA_RESTART))
+        return PCRE_ERROR_BADOPTION;
+    if (startoffset < 0 || startoffset > length)
+        return PCRE_ERROR_BADOFFSET;
+
+    md = get_match_data(ovecsize / 2);
+    mcontext = get_mcontext(extra);
+    if (md == NULL || mcontext == NULL)
+        return PCRE_ERROR_NOMEMORY;
+
+    dfaopts = translate_exec_options(options);
+    if (options & PCRE_DFA_SHORTEST)
+        dfaopts |= PCRE2_DFA_SHORTEST;
+    if (options & PCRE_DFA_RESTART)
+        dfaopts |= PCRE2_DFA_RESTART;
+
+    rc = pcre2_dfa_match(code, (PCRE2_SPTR)subject, length, startoffset,
+            dfaopts, md, mcontext, workspace, wscount);
+
+    /* DFA matches have no capturing groups, only alternative lengths
+     * which are returned as consecutive pairs.
+     */
+    if (rc >= 0) {
+        PCRE2_SIZE *src = pcre2_get_ovector_pointer(md);
+        int i, count = rc == 0 ? ovecsize / 2 : rc;
+
+        if (count > ovecsize / 2)
+            count = ovecsize / 2;
+        for (i = 0; i < count * 2; ++i)
+            ovector[i] = (int)src[i];
+    }
+    return translate_error(rc);
+}
+
+int
+pcre_fullinfo(const pcre *code, const pcre_extra *extra, int what, void *where)
+{
+    uint32_t value;
+    size_t size;
+    int rc;
+
+    if (code == NULL || where == NULL)
+        return PCRE_ERROR_NULL;
+
+    switch (what) {
+        case PCRE_INFO_OPTIONS:
+            rc = pcre2_pattern_info(code, PCRE2_INFO_ALLOPTIONS, &value);
+            if (rc == 0)
+                *(unsigned long *)where = untranslate_options(value);
+            break;
+
+        case PCRE_INFO_SIZE:
+            rc = pcre2_pattern_info(code, PCRE2_INFO_SIZE, where);
+            break;
+
+        case PCRE_INFO_STUDYSIZE:
+            *(size_t *)where = 0;
+            rc = 0;
+            break;
+
+        case PCRE_INFO_JITSIZE:
+            rc = pcre2_pattern_info(code, PCRE2_INFO_JITSIZE, where);
+            break;
+
+        case PCRE_INFO_JIT:
+            rc = pcre2_pattern_info(code, PCRE2_INFO_JITSIZE, &size);
+            if (rc == 0)
+                *(int *)where = size > 0;
+            break;
+
+        case PCRE_INFO_NAMETABLE:
+            rc = pcre2_pattern_info(code, PCRE2_INFO_NAMETABLE, where);
+            break;
+
+        case PCRE_INFO_FIRSTCHARACTER:
+        case PCRE_INFO_REQUIREDCHAR:
+            rc = pcre2_pattern_info(code, what == PCRE_INFO_FIRSTCHARACTER ?
+                    PCRE2_INFO_FIRSTCODEUNIT : PCRE2_INFO_LASTCODEUNIT, where);
+            break;
+
+        case PCRE_INFO_MATCHLIMIT:
+        case PCRE_INFO_RECURSIONLIMIT:
+            rc = pcre2_pattern_info(code, what == PCRE_INFO_MATCHLIMIT ?
+                    PCRE2_INFO_MATCHLIMIT : PCRE2_INFO_DEPTHLIMIT, where);
+            break;
+
+        case PCRE_INFO_CAPTURECOUNT:
+        case PCRE_INFO_BACKREFMAX:
+        case PCRE_INFO_NAMEENTRYSIZE:
+        case PCRE_INFO_NAMECOUNT:
+        case PCRE_INFO_JCHANGED:
+        case PCRE_INFO_HASCRORLF:
+        case PCRE_INFO_MINLENGTH:
+        case PCRE_INFO_MAXLOOKBEHIND:
+        case PCRE_INFO_FIRSTCHARACTERFLAGS:
+        case PCRE_INFO_REQUIREDCHARFLAGS:
+        case PCRE_INFO_MATCH_EMPTY:
+            switch (what) {
+                case PCRE_INFO_CAPTURECOUNT: what = PCRE2_INFO_CAPTURECOUNT; break;
+                case PCRE_INFO_BACKREFMAX: what = PCRE2_INFO_BACKREFMAX; break;
+                case PCRE_INFO_NAMEENTRYSIZE: what = PCRE2_INFO_NAMEENTRYSIZE; break;
+                case PCRE_INFO_NAMECOUNT: what = PCRE2_INFO_NAMECOUNT; break;
+                case PCRE_INFO_JCHANGED: what = PCRE2_INFO_JCHANGED; break;
+                case PCRE_INFO_HASCRORLF: what = PCRE2_INFO_HASCRORLF; break;
+                case PCRE_INFO_MINLENGTH: what = PCRE2_INFO_MINLENGTH; break;
+                case PCRE_INFO_MAXLOOKBEHIND: what = PCRE2_INFO_MAXLOOKBEHIND; break;
+                case PCRE_INFO_FIRSTCHARACTERFLAGS: what = PCRE2_INFO_FIRSTCODETYPE; break;
+                case PCRE_INFO_REQUIREDCHARFLAGS: what = PCRE2_INFO_LASTCODETYPE; break;
+                default: what = PCRE2_INFO_MATCHEMPTY; break;
+            }
+            rc = pcre2_pattern_info(code, what, &value);
+            if (rc == 0)
+                *(int *)where = (int)value;
+            break;
+
+        default:
+            return PCRE_ERROR_BADOPTION;
+    }
+
+    return rc == PCRE2_ERROR_UNSET ? -55 : translate_error(rc);
+}
+
+int
+pcre_config(int what, void *where)
+{
+    static char target[64];
+    uint32_t value;
+
+    switch (what) {
+        case PCRE_CONFIG_UTF8:
+        case PCRE_CONFIG_UNICODE_PROPERTIES:
+            pcre2_config(PCRE2_CONFIG_UNICODE, &value);
+            *(int *)where = (int)value;
+            return 0;
+
+        case PCRE_CONFIG_UTF16:
+        case PCRE_CONFIG_UTF32:
+        case PCRE_CONFIG_STACKRECURSE:
+            *(int *)where = 0;
+            return 0;
+
+        case PCRE_CONFIG_NEWLINE:
+            /* PCRE 8.x returns the newline character(s) instead. */
+            pcre2_config(PCRE2_CONFIG_NEWLINE, &value);
+            switch (value) {
+                case PCRE2_NEWLINE_CR: *(int *)where = 13; break;
+                case PCRE2_NEWLINE_CRLF: *(int *)where = 3338; break;
+                case PCRE2_NEWLINE_ANY: *(int *)where = -1; break;
+                case PCRE2_NEWLINE_ANYCRLF: *(int *)where = -2; break;
+                default: *(int *)where = 10; break;
+            }
+            return 0;
+
+        case PCRE_CONFIG_BSR:
+            pcre2_config(PCRE2_CONFIG_BSR, &value);
+            *(int *)where = value == PCRE2_BSR_ANYCRLF;
+            return 0;
+
+        case PCRE_CONFIG_LINK_SIZE:
+            pcre2_config(PCRE2_CONFIG_LINKSIZE, &value);
+            *(int *)where = (int)value;
+            return 0;
+
+        case PCRE_CONFIG_JIT:
+            pcre2_config(PCRE2_CONFIG_JIT, &value);
+            *(int *)where = (int)value;
+            return 0;
+
+        case PCRE_CONFIG_JITTARGET:
+            if (pcre2_config(PCRE2_CONFIG_JITTARGET, target) < 0)
+                *(const char **)where = NULL;
+            else
+                *(const char **)where = target;
+            return 0;
+
+        case PCRE_CONFIG_MATCH_LIMIT:
+        case PCRE_CONFIG_MATCH_LIMIT_RECURSION:
+        case PCRE_CONFIG_PARENS_LIMIT:
+            pcre2_config(what == PCRE_CONFIG_MATCH_LIMIT ? PCRE2_CONFIG_MATCHLIMIT :
+                    what == PCRE_CONFIG_PARENS_LIMIT ? PCRE2_CONFIG_PARENSLIMIT :
+                    PCRE2_CONFIG_DEPTHLIMIT, &value);
+            *(unsigned long *)where = value;
+            return 0;
+    }
+
+    return PCRE_ERROR_BADOPTION;
+}
+
+const char *
+pcre_version(void)
+{
+    static char version[64];
+
+    if (version[0] == 0)
+        pcre2_config(PCRE2_CONFIG_VERSION, version);
+    return version;
+}
+
+const unsigned char *
+pcre_maketables(void)
+{
+    return pcre2_maketables(get_gcontext());
+}
+
+pcre_jit_stack *
+pcre_jit_stack_alloc(int startsize, int maxsize)
+{
+    return pcre2_jit_stack_create(startsize, maxsize, get_gcontext());
+}
+
+void
+pcre_jit_stack_free(pcre_jit_stack *stack)
+{
+    pcre2_jit_stack_free(stack);
+}
+
+void
+pcre_assign_jit_stack(pcre_extra *extra, pcre_jit_callback callback, void *data)
+{
+    if (extra) {
+        extra->jit_callback = callback;
+        extra->jit_data = data;
+    }
+}
+
+int
+pypcre2_dumps(const pcre *code, unsigned char **data, size_t *size)
+{
+    int32_t rc;
+    PCRE2_SIZE length;
+
+    rc = pcre2_serialize_encode((const pcre2_code **)&code, 1, data, &length,
+            get_gcontext());
+    if (rc < 0)
+        return translate_error(rc);
+    *size = length;
+    return 0;
+}
+
+void
+pypcre2_dumps_free(unsigned char *data)
+{
+    pcre2_serialize_free(data);
+}
+
+pcre *
+pypcre2_loads(const unsigned char *data, size_t size, int *rcptr)
+{
+    pcre2_code *code = NULL;
+    int32_t rc;
+
+    /* Header is 4 uint32 fields followed by character tables. */
+    if (size < 4 * sizeof(uint32_t) + 1088) {
+        *rcptr = PCRE_ERROR_BADMAGIC;
+        return NULL;
+    }
+
+    rc = pcre2_serialize_decode(&code, 1, data, get_gcontext());
+    if (rc < 0) {
+        *rcptr = rc == PCRE2_ERROR_BADMAGIC || rc == PCRE2_ERROR_BADMODE ?
+                PCRE_ERROR_BADMAGIC : translate_error(rc);
+        return NULL;
+    }
+    *rcptr = 0;
+    return code;
+}
+
+void
+pypcre2_code_free(pcre *code)
+{
+    pcre2_code_free(code);
+}
+
+void
+pypcre2_thread_cleanup(void)
+{
+    if (tls_match_data) {
+        pcre2_match_data_free(tls_match_data);
+        tls_match_data = NULL;
+        tls_match_data_pairs = 0;
+    }
+    if (tls_mcontext) {
+        pcre2_match_context_free(tls_mcontext);
+        tls_mcontext = NULL;
+    }
+    if (tls_ccontext) {
+        pcre2_compile_context_free(tls_ccontext);
+        tls_ccontext = NULL;
+    }
+}
@@ -0,0 +1,209 @@
+/* python-pcre
+
+Copyright (c) 2012-2015, Arkadiusz Wahlig
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Implements the subset of the PCRE 8.x API used by pcremodule.c on top
+ * of PCRE2.  Option bits, error codes and info/config keys keep their
+ * PCRE 8.x values so that flags visible from Python don't change
+ * between the two backends.
+ */
+
+#ifndef PCRE2COMPAT_H
+#define PCRE2COMPAT_H
+
+#include <stddef.h>
+
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+
+/* pcre_compile2() options */
+#define PCRE_CASELESS           0x00000001
+#define PCRE_MULTILINE          0x00000002
+#define PCRE_DOTALL             0x00000004
+#define PCRE_EXTENDED           0x00000008
+#define PCRE_ANCHORED           0x00000010
+#define PCRE_DOLLAR_ENDONLY     0x00000020
+#define PCRE_EXTRA              0x00000040
+#define PCRE_UNGREEDY           0x00000200
+#define PCRE_UTF8               0x00000800
+#define PCRE_NO_AUTO_CAPTURE    0x00001000
+#define PCRE_NO_UTF8_CHECK      0x00002000
+#define PCRE_AUTO_CALLOUT       0x00004000
+#define PCRE_NEVER_UTF          0x00010000
+#define PCRE_NO_AUTO_POSSESS    0x00020000
+#define PCRE_FIRSTLINE          0x00040000
+#define PCRE_DUPNAMES           0x00080000
+#define PCRE_NEWLINE_CR         0x00100000
+#define PCRE_NEWLINE_LF         0x00200000
+#define PCRE_NEWLINE_CRLF       0x00300000
+#define PCRE_NEWLINE_ANY        0x00400000
+#define PCRE_NEWLINE_ANYCRLF    0x00500000
+#define PCRE_BSR_ANYCRLF        0x00800000
+#define PCRE_BSR_UNICODE        0x01000000
+#define PCRE_JAVASCRIPT_COMPAT  0x02000000
+#define PCRE_NO_START_OPTIMIZE  0x04000000
+#define PCRE_UCP                0x20000000
+
+/* pcre_exec() options */
+#define PCRE_NOTBOL             0x00000080
+#define PCRE_NOTEOL             0x00000100
+#define PCRE_NOTEMPTY           0x00000400
+#define PCRE_PARTIAL_SOFT       0x00008000
+#define PCRE_DFA_SHORTEST       0x00010000
+#define PCRE_DFA_RESTART        0x00020000
+#define PCRE_PARTIAL_HARD       0x08000000
+#define PCRE_NOTEMPTY_ATSTART   0x10000000
+#define PCRE_PARTIAL            PCRE_PARTIAL_SOFT
+
+/* pcre_exec() error codes */
+#define PCRE_ERROR_NOMATCH          (-1)
+#define PCRE_ERROR_NULL             (-2)
+#define PCRE_ERROR_BADOPTION        (-3)
+#define PCRE_ERROR_BADMAGIC         (-4)
+#define PCRE_ERROR_NOMEMORY         (-6)
+#define PCRE_ERROR_MATCHLIMIT       (-8)
+#define PCRE_ERROR_BADUTF8          (-10)
+#define PCRE_ERROR_BADUTF8_OFFSET   (-11)
+#define PCRE_ERROR_PARTIAL          (-12)
+#define PCRE_ERROR_INTERNAL         (-14)
+#define PCRE_ERROR_DFA_UITEM        (-16)
+#define PCRE_ERROR_DFA_UCOND        (-17)
+#define PCRE_ERROR_DFA_WSSIZE       (-19)
+#define PCRE_ERROR_DFA_RECURSE      (-20)
+#define PCRE_ERROR_RECURSIONLIMIT   (-21)
+#define PCRE_ERROR_BADOFFSET        (-24)
+#define PCRE_ERROR_JIT_STACKLIMIT   (-27)
+#define PCRE_ERROR_BADMODE          (-28)
+
+/* pcre_fullinfo() keys */
+#define PCRE_INFO_OPTIONS               0
+#define PCRE_INFO_SIZE                  1
+#define PCRE_INFO_CAPTURECOUNT          2
+#define PCRE_INFO_BACKREFMAX            3
+#define PCRE_INFO_NAMEENTRYSIZE         7
+#define PCRE_INFO_NAMECOUNT             8
+#define PCRE_INFO_NAMETABLE             9
+#define PCRE_INFO_STUDYSIZE             10
+#define PCRE_INFO_JCHANGED              13
+#define PCRE_INFO_HASCRORLF             14
+#define PCRE_INFO_MINLENGTH             15
+#define PCRE_INFO_JIT                   16
+#define PCRE_INFO_JITSIZE               17
+#define PCRE_INFO_MAXLOOKBEHIND         18
+#define PCRE_INFO_FIRSTCHARACTER        19
+#define PCRE_INFO_FIRSTCHARACTERFLAGS   20
+#define PCRE_INFO_REQUIREDCHAR          21
+#define PCRE_INFO_REQUIREDCHARFLAGS     22
+#define PCRE_INFO_MATCHLIMIT            23
+#define PCRE_INFO_RECURSIONLIMIT        24
+#define PCRE_INFO_MATCH_EMPTY           25
+
+/* pcre_config() keys */
+#define PCRE_CONFIG_UTF8                    0
+#define PCRE_CONFIG_NEWLINE                 1
+#define PCRE_CONFIG_LINK_SIZE               2
+#define PCRE_CONFIG_POSIX_MALLOC_THRESHOLD  3
+#define PCRE_CONFIG_MATCH_LIMIT             4
+#define PCRE_CONFIG_STACKRECURSE            5
+#define PCRE_CONFIG_UNICODE_PROPERTIES      6
+#define PCRE_CONFIG_MATCH_LIMIT_RECURSION   7
+#define PCRE_CONFIG_BSR                     8
+#define PCRE_CONFIG_JIT                     9
+#define PCRE_CONFIG_UTF16                   10
+#define PCRE_CONFIG_JITTARGET               11
+#define PCRE_CONFIG_UTF32                   12
+#define PCRE_CONFIG_PARENS_LIMIT            13
+
+/* pcre_study() options */
+#define PCRE_STUDY_JIT_COMPILE                  0x0001
+#define PCRE_STUDY_JIT_PARTIAL_SOFT_COMPILE     0x0002
+#define PCRE_STUDY_JIT_PARTIAL_HARD_COMPILE     0x0004
+#define PCRE_STUDY_EXTRA_NEEDED                 0x0008
+
+/* pcre_extra flags */
+#define PCRE_EXTRA_STUDY_DATA               0x0001
+#define PCRE_EXTRA_MATCH_LIMIT              0x0002
+#define PCRE_EXTRA_CALLOUT_DATA             0x0004
+#define PCRE_EXTRA_TABLES                   0x0008
+#define PCRE_EXTRA_MATCH_LIMIT_RECURSION    0x0010
+#define PCRE_EXTRA_MARK                     0x0020
+#define PCRE_EXTRA_EXECUTABLE_JIT           0x0040
+
+typedef pcre2_code pcre;
+typedef pcre2_jit_stack pcre_jit_stack;
+typedef pcre_jit_stack *(*pcre_jit_callback)(void *);
+
+/* Same public fields as in PCRE 8.x.  The JIT stack assigned with
+ * pcre_assign_jit_stack() is kept here because PCRE2 attaches it to
+ * a match context rather than to the pattern.
+ */
+typedef struct {
+    unsigned long flags;
+    void *study_data;
+    unsigned long match_limit;
+    void *callout_data;
+    const unsigned char *tables;
+    unsigned long match_limit_recursion;
+    unsigned char **mark;
+    void *executable_jit;
+    pcre_jit_callback jit_callback;
+    void *jit_data;
+} pcre_extra;
+
+extern void *(*pcre_malloc)(size_t);
+extern void (*pcre_free)(void *);
+
+pcre *pcre_compile2(const char *, int, int *, const char **, int *,
+                    const unsigned char *);
+pcre_extra *pcre_study(const pcre *, int, const char **);
+void pcre_free_study(pcre_extra *);
+int pcre_exec(const pcre *, const pcre_extra *, const char *, int, int, int,
+              int *, int);
+int pcre_dfa_exec(const pcre *, const pcre_extra *, const char *, int, int,
+                  int, int *, int, int *, int);
+int pcre_fullinfo(const pcre *, const pcre_extra *, int, void *);
+int pcre_config(int, void *);
+const char *pcre_version(void);
+const unsigned char *pcre_maketables(void);
+pcre_jit_stack *pcre_jit_stack_alloc(int, int);
+void pcre_jit_stack_free(pcre_jit_stack *);
+void pcre_assign_jit_stack(pcre_extra *, pcre_jit_callback, void *);
+
+/* Compiled PCRE2 patterns are not relocatable so they are serialized
+ * with pcre2_serialize_encode() instead of being copied as-is.
+ */
+int pypcre2_dumps(const pcre *, unsigned char **, size_t *);
+void pypcre2_dumps_free(unsigned char *);
+pcre *pypcre2_loads(const unsigned char *, size_t, int *);
+void pypcre2_code_free(pcre *);
+
+/* Frees per-thread match data of the calling thread.  Must be called by
+ * native threads doing matches before they exit.
+ */
+void pypcre2_thread_cleanup(void);
+
+#endif /* PCRE2COMPAT_H */
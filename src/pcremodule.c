@@ -28,22 +28,71 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <Python.h>
 #include <structmember.h>
+#include <pythread.h>
+#include <locale.h>
+#ifdef _WIN32
+#    include <windows.h>
+#else
+#    include <time.h>
+#    include <pthread.h>
+#endif
+
+/* Sizes of allocated blocks, see pypcre_block_size(). */
+#if defined(_WIN32)
+#    include <malloc.h>
+#    define pypcre_block_size(p)    _msize(p)
+#elif defined(__APPLE__)
+#    include <malloc/malloc.h>
+#    define pypcre_block_size(p)    malloc_size(p)
+#elif defined(__FreeBSD__)
+#    include <malloc_np.h>
+#    define pypcre_block_size(p)    malloc_usable_size(p)
+#elif defined(__linux__)
+#    include <malloc.h>
+#    define pypcre_block_size(p)    malloc_usable_size(p)
+#else
+#    define pypcre_block_size(p)    ((size_t)0)
+#endif
 
-#include <pcre.h>
+/* PCRE2 is used through a layer implementing the PCRE 8.x API. */
+#ifdef PYPCRE_PCRE2
+#    include "pcre2compat.h"
+#    define pypcre_code_free        pypcre2_code_free
+#else
+#    include <pcre.h>
+#    define pypcre_code_free        pcre_free
+#endif
 
 #if PY_MAJOR_VERSION >= 3
 #    define PY3
 #    define PyInt_FromLong PyLong_FromLong
+#    define PyInt_AsLong PyLong_AsLong
+#    define PyInt_FromSsize_t PyLong_FromSsize_t
 #    if PY_VERSION_HEX >= 0x03030000
 #        define PY3_NEW_UNICODE
 #    endif
 #endif
 
+/* With PCRE 8.x patterns export their code through the buffer interface
+ * so pickles can pass it without a copy.  PCRE2 code has to be serialized.
+ */
+#if defined(PY3) && !defined(PYPCRE_PCRE2)
+#    define PYPCRE_CODE_BUFFER
+#endif
+
+/* Size of ovector matches use without allocating it, enough for 9 groups. */
+#define PYPCRE_STATIC_OVECSIZE  (30)
+
 /* Custom errors/configs. */
 #define PYPCRE_ERROR_STUDY      (-50)
 #define PYPCRE_CONFIG_NONE      (1000)
 #define PYPCRE_CONFIG_VERSION   (1001)
 
+/* Pseudo compile option selecting character tables built for the
+ * LC_CTYPE locale current at compile time.  Never passed to PCRE.
+ */
+#define PYPCRE_LOCALE           (0x40000000)
+
 /* JIT was added in PCRE 8.20. */
 #ifdef PCRE_STUDY_JIT_COMPILE
 #    define PYPCRE_HAS_JIT_API
@@ -59,19 +108,244 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #    define PCRE_CONFIG_PARENS_LIMIT    PYPCRE_CONFIG_NONE
 #endif
 
-static PyObject *PyExc_PCREError;
-static PyObject *PyExc_NoMatch;
+/* Added in Python 3.2. */
+#if PY_VERSION_HEX < 0x03020000
+typedef long Py_hash_t;
+#endif
+
+/* Match accessors take arguments as an array in 3.7+ (METH_FASTCALL).
+ * Older versions pass a tuple which is unpacked into the same form.
+ */
+#if PY_VERSION_HEX >= 0x03070000
+#    define PYPCRE_METH_FASTCALL    METH_FASTCALL
+#    define PYPCRE_FASTCALL_ARGS    PyObject *const *args, Py_ssize_t nargs
+#    define PYPCRE_FASTCALL_UNPACK
+#else
+#    define PYPCRE_METH_FASTCALL    METH_VARARGS
+#    define PYPCRE_FASTCALL_ARGS    PyObject *argtuple
+#    define PYPCRE_FASTCALL_UNPACK  PyObject **args = &PyTuple_GET_ITEM(argtuple, 0); \
+                                    Py_ssize_t nargs = PyTuple_GET_SIZE(argtuple);
+#endif
+
+/* Returned by PyThread_start_new_thread() on failure.  Defined in 3.7+. */
+#ifndef PYTHREAD_INVALID_THREAD_ID
+#    define PYTHREAD_INVALID_THREAD_ID  (-1)
+#endif
+
+/* Python 3.11+ uses multi-phase init, heap types and per-module state so
+ * that the module can be loaded in subinterpreters with their own GIL
+ * and in free-threaded builds.  Older versions use static types and a
+ * single static state.
+ */
+#if PY_VERSION_HEX >= 0x030B0000
+#    define PYPCRE_MODULE_STATE
+#endif
+
+typedef struct {
+    PyTypeObject *Pattern_Type;
+    PyTypeObject *Match_Type;
+    PyTypeObject *MatchIter_Type;
+    PyObject *PCREError;
+    PyObject *NoMatch;
+    int closed; /* no more background searches, see cancel_jobs() */
+} pypcre_state_t;
+
+#ifdef PYPCRE_MODULE_STATE
+static PyModuleDef pypcre_module;
+
+#define get_module_state(m)     ((pypcre_state_t *)PyModule_GetState(m))
+
+/* Returns state of the module defining <type> or its base. */
+static pypcre_state_t *
+get_state_by_type(PyTypeObject *type)
+{
+    return get_module_state(PyType_GetModuleByDef(type, &pypcre_module));
+}
+#else
+static pypcre_state_t pypcre_state;
+
+#define get_module_state(m)     (&pypcre_state)
+#define get_state_by_type(type) (&pypcre_state)
+#endif
+
+/* State of the module <op> (a Pattern or Match) comes from. */
+#define get_state(op)           get_state_by_type(Py_TYPE(op))
+
+#ifdef _MSC_VER
+#    include <intrin.h>
+#    define pypcre_atomic_swap(p, v)    _InterlockedExchange((volatile long *)(p), (v))
+#    define pypcre_atomic_add(p, v)     _InterlockedExchangeAdd((volatile long *)(p), (v))
+#    ifdef _WIN64
+#        define pypcre_atomic_add_ssize(p, v) \
+            _InterlockedExchangeAdd64((volatile __int64 *)(p), (v))
+#    else
+#        define pypcre_atomic_add_ssize(p, v) \
+            _InterlockedExchangeAdd((volatile long *)(p), (v))
+#    endif
+#else
+#    define pypcre_atomic_swap(p, v)    __sync_lock_test_and_set((p), (v))
+#    define pypcre_atomic_add(p, v)     __sync_fetch_and_add((p), (v))
+#    define pypcre_atomic_add_ssize(p, v) __sync_fetch_and_add((p), (v))
+#endif
+
+/* Process-wide data, like the worker threads, is
+ * used by all interpreters.  With one GIL per interpreter, or none, it's
+ * guarded by a spinlock.  The critical sections are short.
+ */
+#ifdef PYPCRE_MODULE_STATE
+static volatile long global_lock = 0;
+#    define PYPCRE_GLOBAL_LOCK()    while (pypcre_atomic_swap(&global_lock, 1)) {}
+#    define PYPCRE_GLOBAL_UNLOCK()  pypcre_atomic_swap(&global_lock, 0)
+#else
+#    define PYPCRE_GLOBAL_LOCK()
+#    define PYPCRE_GLOBAL_UNLOCK()
+#endif
+
+/* Patterns are shared between threads running in parallel only in
+ * free-threaded builds.
+ */
+#ifdef Py_GIL_DISABLED
+#    define PYPCRE_BUSY_INC(op)     pypcre_atomic_add(&(op)->busy, 1)
+#    define PYPCRE_BUSY_DEC(op)     pypcre_atomic_add(&(op)->busy, -1)
+#else
+#    define PYPCRE_BUSY_INC(op)     (++(op)->busy)
+#    define PYPCRE_BUSY_DEC(op)     (--(op)->busy)
+#endif
+
+#if PY_VERSION_HEX >= 0x03040000
+#    define pypcre_raw_malloc   PyMem_RawMalloc
+#    define pypcre_raw_realloc  PyMem_RawRealloc
+#    define pypcre_raw_free     PyMem_RawFree
+#else
+#    define pypcre_raw_malloc   PyMem_Malloc
+#    define pypcre_raw_realloc  PyMem_Realloc
+#    define pypcre_raw_free     PyMem_Free
+#endif
+
+/* The hooks are process-wide and may free blocks allocated by anything
+ * else using the library, so they use plain malloc() blocks and ask the
+ * allocator for their sizes.  Totals are approximate because of that.
+ */
+static volatile Py_ssize_t pcre_allocated = 0; /* bytes */
+static volatile Py_ssize_t pcre_blocks = 0;
+
+static void *
+pypcre_malloc_hook(size_t size)
+{
+    void *block = malloc(size);
+
+    if (block == NULL)
+        return NULL;
+    pypcre_atomic_add_ssize(&pcre_allocated, (Py_ssize_t)pypcre_block_size(block));
+    pypcre_atomic_add_ssize(&pcre_blocks, 1);
+    return block;
+}
+
+static void
+pypcre_free_hook(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+    pypcre_atomic_add_ssize(&pcre_allocated, -(Py_ssize_t)pypcre_block_size(ptr));
+    pypcre_atomic_add_ssize(&pcre_blocks, -1);
+    free(ptr);
+}
 
 /* Used to hold UTF-8 data extracted from any of the supported
  * input objects in a most efficient way.
  */
+typedef struct {
+    char *data;
+    Py_ssize_t size;
+} pypcre_scratch_t;
+
 typedef struct {
     const char *string;
     int length;
     PyObject *op;
     Py_buffer *buffer;
+    pypcre_scratch_t *scratch;
 } pypcre_string_t;
 
+/* Strings encoded internally are written into a scratch buffer cached
+ * per thread instead of new bytes objects.  A buffer is held by a
+ * string until it is released, which normally happens right after a
+ * failed match, or until its data is moved into a bytes object by
+ * pypcre_string_own().  Between calls a thread keeps one buffer of up
+ * to PYPCRE_SCRATCH_KEEP bytes, bigger ones are freed.  The cache is
+ * freed when the thread exits, without the GIL, so buffers come from
+ * the raw allocator.  Bigger strings use bytes objects straight away.
+ */
+#define PYPCRE_SCRATCH_MAX      (1024 * 1024)
+#define PYPCRE_SCRATCH_KEEP     (64 * 1024)
+
+static int scratch_key_created = 0;
+
+static void
+scratch_free(pypcre_scratch_t *scratch)
+{
+    if (scratch) {
+        pypcre_raw_free(scratch->data);
+        pypcre_raw_free(scratch);
+    }
+}
+
+#ifdef _WIN32
+static DWORD scratch_key;
+
+static void WINAPI
+scratch_destroy(void *scratch)
+{
+    scratch_free((pypcre_scratch_t *)scratch);
+}
+
+#    define scratch_key_create()    \
+        ((scratch_key = FlsAlloc(scratch_destroy)) != FLS_OUT_OF_INDEXES)
+#    define scratch_get()           ((pypcre_scratch_t *)FlsGetValue(scratch_key))
+#    define scratch_set(scratch)    (FlsSetValue(scratch_key, (scratch)) != 0)
+#else
+static pthread_key_t scratch_key;
+
+static void
+scratch_destroy(void *scratch)
+{
+    scratch_free((pypcre_scratch_t *)scratch);
+}
+
+#    define scratch_key_create()    (pthread_key_create(&scratch_key, scratch_destroy) == 0)
+#    define scratch_get()           ((pypcre_scratch_t *)pthread_getspecific(scratch_key))
+#    define scratch_set(scratch)    (pthread_setspecific(scratch_key, (scratch)) == 0)
+#endif
+
+/* Creates the key of the per-thread cache if it doesn't exist yet.
+ * Returns 0 if successful or -1 otherwise.
+ */
+static int
+pypcre_scratch_init(void)
+{
+    int rv = 0;
+
+    PYPCRE_GLOBAL_LOCK();
+    if (!scratch_key_created) {
+        if (scratch_key_create())
+            scratch_key_created = 1;
+        else
+            rv = -1;
+    }
+    PYPCRE_GLOBAL_UNLOCK();
+    return rv;
+}
+
+/* Returns scratch buffer to the thread's cache or frees it. */
+static void
+pypcre_scratch_release(pypcre_scratch_t *scratch)
+{
+    if (scratch->size <= PYPCRE_SCRATCH_KEEP && scratch_get() == NULL
+            && scratch_set(scratch))
+        return;
+    scratch_free(scratch);
+}
+
 /* Release buffer created by pypcre_buffer_get(). */
 static void
 pypcre_buffer_release(Py_buffer *buffer)
@@ -110,10 +384,309 @@ pypcre_string_release(pypcre_string_t *str)
     if (str) {
         pypcre_buffer_release(str->buffer);
         Py_XDECREF(str->op);
+        if (str->scratch)
+            pypcre_scratch_release(str->scratch);
         memset(str, 0, sizeof(pypcre_string_t));
     }
 }
 
+/* Moves data of <str> out of a scratch buffer into a new bytes object
+ * so it can outlive the call.  Returns 0 if successful or sets an
+ * exception and returns -1 in case of an error.
+ */
+static int
+pypcre_string_own(pypcre_string_t *str)
+{
+    PyObject *op;
+
+    if (str->scratch == NULL)
+        return 0;
+
+    op = PyBytes_FromStringAndSize(str->string, str->length);
+    if (op == NULL)
+        return -1;
+
+    pypcre_scratch_release(str->scratch);
+    str->scratch = NULL;
+    str->string = PyBytes_AS_STRING(op);
+    str->op = op;
+    return 0;
+}
+
+/* Makes <dst> share UTF-8 data of <src> created by pypcre_string_get().
+ * The data is moved out of a scratch buffer first if needed.  Both
+ * strings have to be released separately.  Returns 0 if successful
+ * or sets an exception and returns -1 in case of an error.
+ */
+static int
+pypcre_string_copy(pypcre_string_t *dst, pypcre_string_t *src)
+{
+    if (pypcre_string_own(src) < 0)
+        return -1;
+
+    memcpy(dst, src, sizeof(pypcre_string_t));
+
+    /* Buffers can only be released once so get a new one. */
+    if (src->buffer) {
+        dst->buffer = pypcre_buffer_get(src->op, PyBUF_ND);
+        if (dst->buffer == NULL) {
+            memset(dst, 0, sizeof(pypcre_string_t));
+            return -1;
+        }
+        dst->string = (const char *)dst->buffer->buf;
+    }
+
+    Py_XINCREF(dst->op);
+    return 0;
+}
+
+/* Allocates room for <size> bytes of encoded data for <str>, either in
+ * a scratch buffer or in a new bytes object.  Returns pointer to the
+ * room or sets an exception and returns NULL in case of an error.
+ * _string_set_length() must be called once the data is written.
+ */
+static char *
+_string_alloc(pypcre_string_t *str, Py_ssize_t size)
+{
+    pypcre_scratch_t *scratch;
+
+    if (size > PYPCRE_SCRATCH_MAX) {
+        str->op = PyBytes_FromStringAndSize(NULL, size);
+        if (str->op == NULL)
+            return NULL;
+        return PyBytes_AS_STRING(str->op);
+    }
+
+    scratch = scratch_get();
+    if (scratch)
+        (void)scratch_set(NULL);
+    else {
+        scratch = (pypcre_scratch_t *)pypcre_raw_malloc(sizeof(pypcre_scratch_t));
+        if (scratch == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        scratch->data = NULL;
+        scratch->size = 0;
+    }
+
+    /* Like in bytes objects, data is followed by a NUL byte. */
+    if (scratch->size <= size) {
+        /* Grow in 4KB steps. */
+        Py_ssize_t newsize = (size + 4096) & ~(Py_ssize_t)4095;
+        char *data = (char *)pypcre_raw_realloc(scratch->data, newsize);
+        if (data == NULL) {
+            pypcre_scratch_release(scratch);
+            PyErr_NoMemory();
+            return NULL;
+        }
+        scratch->data = data;
+        scratch->size = newsize;
+    }
+
+    str->scratch = scratch;
+    return scratch->data;
+}
+
+/* Sets the final length of data written into room returned by
+ * _string_alloc().  Returns 0 if successful or sets an exception
+ * and returns -1 in case of an error.
+ */
+static int
+_string_set_length(pypcre_string_t *str, Py_ssize_t length)
+{
+    if (str->op && PyBytes_GET_SIZE(str->op) != length) {
+        if (_PyBytes_Resize(&str->op, length) < 0)
+            return -1;
+    }
+    if (str->scratch)
+        str->scratch->data[length] = '\0';
+    str->string = str->op ? PyBytes_AS_STRING(str->op) : str->scratch->data;
+    str->length = (int)length;
+    return 0;
+}
+
+/* Encodes <length> Latin-1 characters into UTF-8 at <q> which must have
+ * room for two bytes per character.  Returns end of the output.
+ */
+static unsigned char *
+_encode_ucs1(const unsigned char *p, Py_ssize_t length, unsigned char *q)
+{
+    const unsigned char *end = p + length;
+    unsigned char c;
+
+    for (; p < end; ++p) {
+        if ((c = *p) > 127) {
+            *q++ = 0xc0 | (c >> 6);
+            *q++ = 0x80 | (c & 0x3f);
+        }
+        else
+            *q++ = c;
+    }
+    return q;
+}
+
+#ifdef PY3_NEW_UNICODE
+/* Same as _encode_ucs1() for 2-byte characters and room for three bytes
+ * per character.  Returns NULL if a surrogate is found.
+ */
+static unsigned char *
+_encode_ucs2(const Py_UCS2 *p, Py_ssize_t length, unsigned char *q)
+{
+    const Py_UCS2 *end = p + length;
+    Py_UCS2 c;
+
+    for (; p < end; ++p) {
+        if ((c = *p) < 0x80)
+            *q++ = (unsigned char)c;
+        else if (c < 0x800) {
+            *q++ = 0xc0 | (c >> 6);
+            *q++ = 0x80 | (c & 0x3f);
+        }
+        else if (Py_UNICODE_IS_SURROGATE(c))
+            return NULL;
+        else {
+            *q++ = 0xe0 | (c >> 12);
+            *q++ = 0x80 | ((c >> 6) & 0x3f);
+            *q++ = 0x80 | (c & 0x3f);
+        }
+    }
+    return q;
+}
+
+/* Same as _encode_ucs1() for 4-byte characters and room for four bytes
+ * per character.  Returns NULL if a surrogate or an invalid character
+ * is found.
+ */
+static unsigned char *
+_encode_ucs4(const Py_UCS4 *p, Py_ssize_t length, unsigned char *q)
+{
+    const Py_UCS4 *end = p + length;
+    Py_UCS4 c;
+
+    for (; p < end; ++p) {
+        if ((c = *p) < 0x80)
+            *q++ = (unsigned char)c;
+        else if (c < 0x800) {
+            *q++ = 0xc0 | (c >> 6);
+            *q++ = 0x80 | (c & 0x3f);
+        }
+        else if (c < 0x10000) {
+            if (Py_UNICODE_IS_SURROGATE(c))
+                return NULL;
+            *q++ = 0xe0 | (c >> 12);
+            *q++ = 0x80 | ((c >> 6) & 0x3f);
+            *q++ = 0x80 | (c & 0x3f);
+        }
+        else if (c <= 0x10ffff) {
+            *q++ = 0xf0 | (c >> 18);
+            *q++ = 0x80 | ((c >> 12) & 0x3f);
+            *q++ = 0x80 | ((c >> 6) & 0x3f);
+            *q++ = 0x80 | (c & 0x3f);
+        }
+        else
+            return NULL;
+    }
+    return q;
+}
+
+/* Helper function encoding <length> characters of given <kind> into
+ * UTF-8.  Returns 0 if successful, 1 if the data can't be encoded
+ * or sets an exception and returns -1 in case of an error.
+ */
+static int
+_string_get_from_kind(pypcre_string_t *str, int kind, const void *data,
+                      Py_ssize_t length)
+{
+    unsigned char *start, *q;
+
+    /* Every character takes at most one byte more than its kind size. */
+    start = (unsigned char *)_string_alloc(str,
+            length * (kind == PyUnicode_4BYTE_KIND ? 4 : kind + 1));
+    if (start == NULL)
+        return -1;
+
+    switch (kind) {
+        case PyUnicode_1BYTE_KIND:
+            q = _encode_ucs1((const unsigned char *)data, length, start);
+            break;
+        case PyUnicode_2BYTE_KIND:
+            q = _encode_ucs2((const Py_UCS2 *)data, length, start);
+            break;
+        default:
+            q = _encode_ucs4((const Py_UCS4 *)data, length, start);
+    }
+
+    if (q == NULL) {
+        pypcre_string_release(str);
+        return 1;
+    }
+    return _string_set_length(str, q - start);
+}
+#endif
+
+/* Bytes of a word with the high bit set. */
+#define PYPCRE_HIGH_BITS    ((size_t)-1 / 0xFF * 0x80)
+
+/* Returns pointer to the first non-ascii byte in [p, end) or <end>.
+ * Checks a word at a time.
+ */
+static const unsigned char *
+_skip_ascii(const unsigned char *p, const unsigned char *end)
+{
+    size_t word;
+
+    while (p + sizeof(size_t) <= end) {
+        memcpy(&word, p, sizeof(size_t));
+        if (word & PYPCRE_HIGH_BITS)
+            break;
+        p += sizeof(size_t);
+    }
+    while (p < end && *p < 0x80)
+        ++p;
+    return p;
+}
+
+/* Returns 1 if [p, end) is valid UTF-8 by the same rules PCRE uses
+ * (no overlong forms, surrogates or code points above U+10FFFF) or 0
+ * if it's not.  PCRE is left to report the error in that case.
+ */
+static int
+_utf8_check(const unsigned char *p, const unsigned char *end)
+{
+    unsigned char lo, hi;
+    int i, n;
+
+    while ((p = _skip_ascii(p, end)) < end) {
+        if (*p < 0xC2 || *p > 0xF4)
+            return 0;
+        n = (*p < 0xE0) ? 1 : (*p < 0xF0) ? 2 : 3;
+        if (end - p <= n)
+            return 0;
+
+        /* Range of the first continuation byte. */
+        lo = 0x80;
+        hi = 0xBF;
+        if (*p == 0xE0)
+            lo = 0xA0;
+        else if (*p == 0xED)
+            hi = 0x9F;
+        else if (*p == 0xF0)
+            lo = 0x90;
+        else if (*p == 0xF4)
+            hi = 0x8F;
+        if (p[1] < lo || p[1] > hi)
+            return 0;
+
+        for (i = 2; i <= n; ++i) {
+            if ((p[i] & 0xC0) != 0x80)
+                return 0;
+        }
+        p += n + 1;
+    }
+    return 1;
+}
+
 /* Helper function handling buffers containing bytes. */
 static int
 _string_get_from_bytes(pypcre_string_t *str, PyObject *op, int *options,
@@ -121,18 +694,22 @@ _string_get_from_bytes(pypcre_string_t *str, PyObject *op, int *options,
 {
     const unsigned char *start = (const unsigned char *)view->buf;
     const unsigned char *p, *end = start + view->len;
-    unsigned char c, *q;
+    unsigned char *q;
     Py_ssize_t count = 0;
 
     if (!(*options & PCRE_UTF8)) {
         *options |= PCRE_NO_UTF8_CHECK;
 
         /* Count non-ascii bytes. */
-        for (p = start; p < end; ++p) {
+        for (p = _skip_ascii(start, end); p < end; ++p) {
             if (*p > 127)
                 ++count;
         }
     }
+    else if (_utf8_check(start, end)) {
+        /* Checked once here instead of by every pcre_exec() call. */
+        *options |= PCRE_NO_UTF8_CHECK;
+    }
 
     /* As-is if ascii or declared UTF-8 by caller. */
     if (count == 0) {
@@ -148,31 +725,18 @@ _string_get_from_bytes(pypcre_string_t *str, PyObject *op, int *options,
 
     /* Non-ascii characters will take two bytes. */
     count += view->len;
-    op = PyBytes_FromStringAndSize(NULL, count);
-    if (op == NULL) {
+    q = (unsigned char *)_string_alloc(str, count);
+    if (q == NULL) {
         if (viewrel)
             pypcre_buffer_release(view);
         return -1;
     }
 
-    q = (unsigned char *)PyBytes_AS_STRING(op);
-    str->string = (const char *)q;
-    str->length = count;
-    str->op = op;
-
-    /* Inline Latin1 -> UTF-8 conversion. */
-    for (p = start; p < end; ++p) {
-        if ((c = *p) > 127) {
-            *q++ = 0xc0 | (c >> 6);
-            *q++ = 0x80 | (c & 0x3f);
-        }
-        else
-            *q++ = c;
-    }
+    _encode_ucs1(start, view->len, q);
 
     if (viewrel)
         pypcre_buffer_release(view);
-    return 0;
+    return _string_set_length(str, count);
 }
 
 #ifndef PY3_NEW_UNICODE
@@ -200,7 +764,8 @@ _string_get_from_pyunicode(pypcre_string_t *str, int *options, Py_buffer *view,
 /* Extract UTF-8 data from <op>.
  * Sets str->string and str->length to UTF-8 data buffer.
  * Sets str->op to <op> if no encoding was required or to a bytes object
- * owning str->string if encoded internally to UTF-8.
+ * owning str->string if encoded internally to UTF-8.  Leaves it NULL if
+ * the data is in a scratch buffer or is the UTF-8 cached in <op>.
  * If PCRE_UTF8 option is set, bytes-like objects are assumed to be UTF-8.
  * Sets PCRE_NO_UTF8_CHECK option if encoded internally or ascii.
  * Returns 0 if successful or sets an exception and returns -1 in case
@@ -223,6 +788,10 @@ pypcre_string_get(pypcre_string_t *str, PyObject *op, int *options)
     }
 
     if (PyUnicode_Check(op)) {
+#ifdef PY3_NEW_UNICODE
+        Py_ssize_t size;
+#endif
+
         *options |= PCRE_NO_UTF8_CHECK;
 
 #ifdef PY3_NEW_UNICODE
@@ -237,8 +806,17 @@ pypcre_string_get(pypcre_string_t *str, PyObject *op, int *options)
             Py_INCREF(op);
             return 0;
         }
-#endif
 
+        /* Use the UTF-8 cached in the object, creating it the first time,
+         * so that following matches, like the ones done by finditer, don't
+         * encode the string again.  The codec raises errors for surrogates.
+         */
+        str->string = PyUnicode_AsUTF8AndSize(op, &size);
+        if (str->string == NULL)
+            return -1;
+        str->length = size;
+        return 0;
+#else
         /* Encode into UTF-8 bytes object. */
         op = PyUnicode_AsUTF8String(op);
         if (op == NULL)
@@ -248,6 +826,7 @@ pypcre_string_get(pypcre_string_t *str, PyObject *op, int *options)
         str->length = PyBytes_GET_SIZE(op);
         str->op = op;
         return 0;
+#endif
     }
 
     /* Try the new buffer interface, */
@@ -265,26 +844,32 @@ pypcre_string_get(pypcre_string_t *str, PyObject *op, int *options)
 #ifdef PY3_NEW_UNICODE
         else if ((view->itemsize == 2 || view->itemsize == 4) && view->ndim == 1) {
             /* Buffer contains 2-byte or 4-byte values. */
-            PyObject *unicode;
-
-            /* Convert to unicode object. */
-            unicode = PyUnicode_FromKindAndData((view->itemsize == 2 ? PyUnicode_2BYTE_KIND :
-                    PyUnicode_4BYTE_KIND), view->buf, view->shape[0]);
+            int kind = (view->itemsize == 2 ? PyUnicode_2BYTE_KIND : PyUnicode_4BYTE_KIND);
+            int rv;
+
+            rv = _string_get_from_kind(str, kind, view->buf, view->shape[0]);
+            if (rv == 1) {
+                /* Invalid data.  Let unicode raise the error. */
+                PyObject *unicode = PyUnicode_FromKindAndData(kind, view->buf,
+                        view->shape[0]);
+                if (unicode) {
+                    op = PyUnicode_AsUTF8String(unicode);
+                    Py_DECREF(unicode);
+                    if (op) {
+                        str->string = PyBytes_AS_STRING(op);
+                        str->length = PyBytes_GET_SIZE(op);
+                        str->op = op;
+                        rv = 0;
+                    }
+                    else
+                        rv = -1;
+                }
+                else
+                    rv = -1;
+            }
             pypcre_buffer_release(view);
-            if (unicode == NULL)
-                return -1;
-
-            /* Encode into UTF-8 bytes object. */
-            op = PyUnicode_AsUTF8String(unicode);
-            Py_DECREF(unicode);
-            if (op == NULL)
-                return -1;
-
-            str->string = PyBytes_AS_STRING(op);
-            str->length = PyBytes_GET_SIZE(op);
-            str->op = op;
             *options |= PCRE_NO_UTF8_CHECK;
-            return 0;
+            return rv;
         }
 #else
         /* Buffer contains Py_UNICODE values. */
@@ -394,9 +979,24 @@ pypcre_string_char_to_byte_offsets(const pypcre_string_t *str, int *pos, int *en
     }
 }
 
-/* Sets an exception from PCRE error code and error string. */
-static void
-set_pcre_error(int rc, const char *s)
+/* Returns <options> without PCRE_NO_UTF8_CHECK if byte offset <pos> or
+ * <endpos> splits a character of <str>, so that PCRE reports it.  This
+ * can only happen with UTF-8 data and offsets from the caller.
+ */
+static int
+pypcre_string_check_offsets(const pypcre_string_t *str, int options, int pos, int endpos)
+{
+    const char *s = str->string;
+
+    if ((pos < str->length && !ISUTF8(s[pos]))
+            || (endpos < str->length && !ISUTF8(s[endpos])))
+        options &= ~PCRE_NO_UTF8_CHECK;
+    return options;
+}
+
+/* Sets an exception from PCRE error code and error string. */
+static void
+set_pcre_error(pypcre_state_t *state, int rc, const char *s)
 {
     PyObject *op;
 
@@ -406,7 +1006,7 @@ set_pcre_error(int rc, const char *s)
             break;
 
         case PCRE_ERROR_NOMATCH:
-            PyErr_SetNone(PyExc_NoMatch);
+            PyErr_SetNone(state->NoMatch);
             break;
 
         case 5: /* number too big in {} quantifier */
@@ -416,27 +1016,202 @@ set_pcre_error(int rc, const char *s)
         default:
             op = Py_BuildValue("(is)", rc, s);
             if (op) {
-                PyErr_SetObject(PyExc_PCREError, op);
+                PyErr_SetObject(state->PCREError, op);
                 Py_DECREF(op);
             }
     }
 }
 
+/*
+ * Locale tables
+ */
+
+/* Character tables built by pcre_maketables() for a LC_CTYPE locale.
+ * Compiled code points at the tables it has been compiled with, so they
+ * are shared by all patterns compiled under the locale and stay around
+ * while referenced.
+ */
+typedef struct pypcre_locale {
+    struct pypcre_locale *next;
+    char *name;
+    const unsigned char *tables;
+    long refs;
+} pypcre_locale_t;
+
+/* Max number of unreferenced tables kept for later patterns. */
+#define PYPCRE_LOCALE_CACHE     (8)
+
+/* Process-wide, most recently built first.  Protected by the GIL or
+ * the global lock.
+ */
+static pypcre_locale_t *locales = NULL;
+
+static void
+free_locale(pypcre_locale_t *locale)
+{
+    pcre_free((void *)locale->tables);
+    pypcre_raw_free(locale->name);
+    pypcre_raw_free(locale);
+}
+
+/* Returns new reference to tables for the current LC_CTYPE locale,
+ * building them if they are not cached, or sets an exception and
+ * returns NULL.
+ */
+static pypcre_locale_t *
+locale_acquire(void)
+{
+    pypcre_locale_t *locale, *evict = NULL, **link;
+    const char *name;
+    size_t size;
+    int unused = 0;
+
+    PYPCRE_GLOBAL_LOCK();
+    name = setlocale(LC_CTYPE, NULL);
+    if (name == NULL)
+        name = "C";
+
+    for (locale = locales; locale; locale = locale->next) {
+        if (strcmp(locale->name, name) == 0) {
+            ++locale->refs;
+            PYPCRE_GLOBAL_UNLOCK();
+            return locale;
+        }
+    }
+
+    /* Not cached yet.  pcre_maketables() uses the current locale. */
+    size = strlen(name) + 1;
+    locale = pypcre_raw_malloc(sizeof(pypcre_locale_t));
+    if (locale) {
+        locale->name = pypcre_raw_malloc(size);
+        locale->tables = pcre_maketables();
+        if (locale->name == NULL || locale->tables == NULL) {
+            pypcre_raw_free(locale->name);
+            pcre_free((void *)locale->tables);
+            pypcre_raw_free(locale);
+            locale = NULL;
+        }
+    }
+    if (locale == NULL) {
+        PYPCRE_GLOBAL_UNLOCK();
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memcpy(locale->name, name, size);
+    locale->refs = 1;
+    locale->next = locales;
+    locales = locale;
+
+    /* Drop the least recently built unreferenced tables if there are
+     * too many.
+     */
+    for (link = &locales; *link; link = &(*link)->next) {
+        if ((*link)->refs == 0 && ++unused > PYPCRE_LOCALE_CACHE) {
+            evict = *link;
+            *link = evict->next;
+            break;
+        }
+    }
+    PYPCRE_GLOBAL_UNLOCK();
+
+    if (evict)
+        free_locale(evict);
+    return locale;
+}
+
+/* Releases reference returned by locale_acquire().  Accepts NULL. */
+static void
+locale_release(pypcre_locale_t *locale)
+{
+    if (locale) {
+        PYPCRE_GLOBAL_LOCK();
+        --locale->refs;
+        PYPCRE_GLOBAL_UNLOCK();
+    }
+}
+
 /*
  * Pattern
  */
 
+/* Entry of the flat copy of groupindex. */
+typedef struct {
+    PyObject *name;
+    int index;
+} pypcre_groupname_t;
+
+/* Engines pcre_exec() can run a studied pattern with. */
+#define PYPCRE_ENGINE_INTERPRETER   (0)
+#define PYPCRE_ENGINE_JIT           (1)
+
+/* In engine='auto' mode decisions are made every PYPCRE_AUTO_EPOCH
+ * matches.  Once there is JIT code, every PYPCRE_AUTO_PROBE-th match
+ * runs on the other engine for comparison.
+ */
+#define PYPCRE_AUTO_EPOCH       (64)
+#define PYPCRE_AUTO_PROBE       (8)
+
+/* Estimated cost of JIT compilation, in nanoseconds per byte of code.
+ * Patterns are JIT-compiled once they have run that long interpreted.
+ */
+#define PYPCRE_AUTO_JIT_COST    (100)
+
+#define PYPCRE_AUTO_BUCKETS     (32)
+#define PYPCRE_AUTO_HISTORY     (16)
+
+typedef struct {
+    long long calls; /* matches done before the decision */
+    int engine;
+    const char *reason;
+} pypcre_decision_t;
+
+/* State of engine='auto' mode.  Histograms count values by their
+ * power of two.
+ */
+typedef struct {
+    int engine; /* used for all but the probing matches */
+    int jit; /* 1 if there is JIT code, 0 if not compiled yet, -1 if it can't be */
+    int epoch; /* matches in the current epoch */
+    long long calls;
+    long long interpreted; /* ns spent interpreted while there was no JIT code */
+    long long jit_compile; /* ns JIT compilation took or -1 */
+    long long time[2]; /* ns per engine in the current epoch */
+    int count[2]; /* matches per engine in the current epoch */
+    long long lengths[PYPCRE_AUTO_BUCKETS]; /* subject bytes */
+    long long latencies[2][PYPCRE_AUTO_BUCKETS]; /* ns per engine */
+    pypcre_decision_t decisions[PYPCRE_AUTO_HISTORY]; /* ring */
+    int decided; /* number of decisions */
+} pypcre_auto_t;
+
 typedef struct {
     PyObject_HEAD
     PyObject *pattern; /* as passed in */
     PyObject *groupindex; /* name->index dict */
+    PyObject *groupnames; /* index->name tuple, None for unnamed groups */
+    pypcre_groupname_t *names; /* groupindex items */
+    int namecount; /* number of names */
     pcre *code; /* compiled pattern */
+    Py_buffer *view; /* holds the code if it's not owned */
     pcre_extra *extra; /* pcre_study result */
+    pypcre_locale_t *locale; /* tables the code uses with LOCALE */
+    pypcre_auto_t *autoengine; /* engine='auto' state or NULL */
 #ifdef PYPCRE_HAS_JIT_API
     pcre_jit_stack *jit_stack; /* user-allocated jit stack */
+    int jit_stack_size; /* its maximum size */
 #endif
     int flags; /* as passed in */
     int groups; /* capturing groups count */
+    int busy; /* native threads using code/extra */
+    Py_hash_t hash; /* of compiled pattern */
+    int minlength; /* minimum match length in characters, 0 if not known */
+    int firstchar; /* ascii character every match starts with or -1 */
+    int anchored; /* matches can only start at the start offset */
+#ifdef PYPCRE_PCRE2
+    PyObject *loads; /* as passed in */
+#endif
+#ifdef PYPCRE_CODE_BUFFER
+    int exports; /* buffers exporting the code */
+#endif
 } PyPatternObject;
 
 /* Returns 0 if Pattern.__init__ has been called or sets an exception
@@ -453,6 +1228,20 @@ assert_pattern_ready(PyPatternObject *op)
     return -1;
 }
 
+/* Returns 0 if compiled code and study data of the pattern can be
+ * replaced or sets an exception and returns -1 if they are being used
+ * by native threads running with the GIL released.
+ */
+static int
+assert_pattern_idle(PyPatternObject *op)
+{
+    if (op->busy == 0)
+        return 0;
+
+    PyErr_SetString(PyExc_AssertionError, "pattern in use");
+    return -1;
+}
+
 /* Converts an object into group index or sets an exception and returns -1
  * if object is of bad type or value is out of range.
  * Supports int/long group indexes and str/unicode group names.
@@ -495,7 +1284,7 @@ get_index(PyPatternObject *op, PyObject *index)
 
 /* Create a mapping from group names to group indexes. */
 static PyObject *
-make_groupindex(pcre *code, int unicode)
+make_groupindex(pypcre_state_t *state, pcre *code, int unicode)
 {
     PyObject *dict;
     int rc, index, count, size;
@@ -505,7 +1294,7 @@ make_groupindex(pcre *code, int unicode)
     if ((rc = pcre_fullinfo(code, NULL, PCRE_INFO_NAMECOUNT, &count)) != 0
             || (rc = pcre_fullinfo(code, NULL, PCRE_INFO_NAMEENTRYSIZE, &size)) != 0
             || (rc = pcre_fullinfo(code, NULL, PCRE_INFO_NAMETABLE, &table)) != 0) {
-        set_pcre_error(rc, "failed to query nametable properties");
+        set_pcre_error(state, rc, "failed to query nametable properties");
         return NULL;
     }
 
@@ -517,7 +1306,7 @@ make_groupindex(pcre *code, int unicode)
         /* Group name starts from the third byte.  Must not be empty. */
         if (table[2] == 0) {
             Py_DECREF(dict);
-            set_pcre_error(84, "group name must not be empty");
+            set_pcre_error(state, 84, "group name must not be empty");
             return NULL;
         }
 
@@ -558,791 +1347,4885 @@ make_groupindex(pcre *code, int unicode)
     return dict;
 }
 
-static int
-pattern_init(PyPatternObject *self, PyObject *args, PyObject *kwds)
+/* Releases the tables created by make_grouptables(). */
+static void
+free_grouptables(PyObject *groupnames, pypcre_groupname_t *names, int count)
 {
-    PyObject *pattern, *loads = NULL, *groupindex;
-    int rc, groups, flags = 0;
-    pcre *code;
-
-    static const char *const kwlist[] = {"pattern", "flags", "loads", NULL};
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iS:__init__", (char **)kwlist,
-            &pattern, &flags, &loads))
-        return -1;
+    int i;
 
-    /* Patterns can be serialized using dumps() and then unserialized
-     * using the "loads" argument.
-     */
-    if (loads) {
-        Py_ssize_t size;
+    for (i = 0; i < count; ++i)
+        Py_DECREF(names[i].name);
+    PyMem_Free(names);
+    Py_XDECREF(groupnames);
+}
 
-        size = PyBytes_GET_SIZE(loads);
-        code = pcre_malloc(size);
-        if (code == NULL) {
-            PyErr_NoMemory();
-            return -1;
-        }
+/* Creates a tuple mapping group indexes to names and a flat copy of
+ * groupindex so that Match objects don't have to search the dict.
+ * Returns 0 if successful or sets an exception and returns -1.
+ */
+static int
+make_grouptables(pypcre_state_t *state, PyObject *groupindex, int groups,
+                 PyObject **groupnames, pypcre_groupname_t **names, int *count)
+{
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    long index;
+    int i;
 
-        memcpy(code, PyBytes_AS_STRING(loads), size);
+    *groupnames = PyTuple_New(groups + 1);
+    if (*groupnames == NULL)
+        return -1;
+    for (i = 0; i <= groups; ++i) {
+        Py_INCREF(Py_None);
+        PyTuple_SET_ITEM(*groupnames, i, Py_None);
     }
-    else {
-        pypcre_string_t str;
-        const char *err = NULL;
-        int o, options = flags;
-
-        /* Extract UTF-8 string from the pattern object.  Encode if needed. */
-        if (pypcre_string_get(&str, pattern, &options) < 0)
-            return -1;
-
-        /* Compile the regex. */
-        code = pcre_compile2(str.string, options | PCRE_UTF8, &rc, &err, &o, NULL);
-        if (code == NULL) {
-            PyObject *op;
 
-            /* Convert byte offset into character offset if needed. */
-            if (str.op != pattern)
-                pypcre_string_byte_to_char_offsets(&str, &o, NULL);
-            pypcre_string_release(&str);
+    *count = 0;
+    *names = PyMem_Malloc((PyDict_Size(groupindex) + 1) * sizeof(pypcre_groupname_t));
+    if (*names == NULL) {
+        Py_CLEAR(*groupnames);
+        PyErr_NoMemory();
+        return -1;
+    }
 
-            op = PyBytes_FromFormat("%.200s at position %d", err, o);
-            if (op) {
-                /* Note.  Compilation error codes are positive. */
-                set_pcre_error(rc, PyBytes_AS_STRING(op));
-                Py_DECREF(op);
-            }
+    while (PyDict_Next(groupindex, &pos, &key, &value)) {
+        index = PyInt_AsLong(value);
+        if (index < 0 || index > groups) {
+            free_grouptables(*groupnames, *names, *count);
+            *groupnames = NULL;
+            if (!PyErr_Occurred())
+                set_pcre_error(state, PCRE_ERROR_INTERNAL, "bad group index");
             return -1;
         }
-        pypcre_string_release(&str);
-    }
 
-    /* Get number of capturing groups. */
-    if ((rc = pcre_fullinfo(code, NULL, PCRE_INFO_CAPTURECOUNT, &groups)) != 0) {
-        pcre_free(code);
-        set_pcre_error(rc, "failed to query number of capturing groups");
-        return -1;
-    }
+        Py_INCREF(key);
+        (*names)[*count].name = key;
+        (*names)[*count].index = (int)index;
+        ++*count;
 
-    /* Create a dict mapping named group names to their indexes. */
-    groupindex = make_groupindex(code, PyUnicode_Check(pattern));
-    if (groupindex == NULL) {
-        pcre_free(code);
-        return -1;
+        Py_INCREF(key);
+        Py_DECREF(PyTuple_GET_ITEM(*groupnames, index));
+        PyTuple_SET_ITEM(*groupnames, index, key);
     }
 
-    pcre_free(self->code);
-    self->code = code;
+    return 0;
+}
 
-    Py_CLEAR(self->pattern);
-    self->pattern = pattern;
-    Py_INCREF(pattern);
+/* Computes 64-bit FNV-1a hash of <size> bytes at <data>. */
+static Py_hash_t
+hash_bytes(const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *)data, *end = p + size;
+    unsigned long long h = 14695981039346656037ULL;
+    Py_hash_t hash;
 
-    Py_CLEAR(self->groupindex);
-    self->groupindex = groupindex;
+    for (; p < end; ++p) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
 
-    self->flags = flags;
-    self->groups = groups;
+    /* -1 is reserved for errors. */
+    hash = (Py_hash_t)h;
+    return hash == -1 ? -2 : hash;
+}
+
+/* Computes hash of compiled pattern <code> from the same data that
+ * pattern_richcompare() compares.  Returns 0 if successful or PCRE error
+ * code in case of an error.
+ */
+static int
+hash_code(const pcre *code, Py_hash_t *hash)
+{
+    size_t size;
+    int rc;
+#ifdef PYPCRE_PCRE2
+    unsigned char *data;
 
+    if ((rc = pypcre2_dumps(code, &data, &size)) != 0)
+        return rc;
+    *hash = hash_bytes(data, size);
+    pypcre2_dumps_free(data);
+#else
+    if ((rc = pcre_fullinfo(code, NULL, PCRE_INFO_SIZE, &size)) != 0)
+        return rc;
+    *hash = hash_bytes(code, size);
+#endif
     return 0;
 }
 
+/* Frees compiled code or releases the buffer holding it. */
 static void
-pattern_dealloc(PyPatternObject *self)
+free_code(pcre *code, Py_buffer *view)
 {
-    Py_XDECREF(self->pattern);
-    Py_XDECREF(self->groupindex);
-    pcre_free(self->code);
-    pcre_free_study(self->extra);
-#ifdef PYPCRE_HAS_JIT_API
-    if (self->jit_stack)
-        pcre_jit_stack_free(self->jit_stack);
-#endif
-    Py_TYPE(self)->tp_free(self);
+    if (view)
+        pypcre_buffer_release(view);
+    else
+        pypcre_code_free(code);
 }
 
-static PyObject *
-pattern_study(PyPatternObject *self, PyObject *args)
+/* Gets a read-only buffer from <op>.  Supports the old buffer
+ * interface in Python 2.x so that mmap objects can be used.
+ */
+static Py_buffer *
+get_code_buffer(PyObject *op)
 {
-    int options = 0;
-    const char *err = NULL;
-    pcre_extra *extra;
-
-    if (!PyArg_ParseTuple(args, "|i:study", &options))
-        return NULL;
+#ifndef PY3
+    if (!PyObject_CheckBuffer(op)) {
+        Py_buffer *view;
+        const void *buf;
+        Py_ssize_t len;
 
-    if (assert_pattern_ready(self) < 0)
-        return NULL;
+        if (PyObject_AsReadBuffer(op, &buf, &len) < 0)
+            return NULL;
 
-    /* Study the pattern. */
-    extra = pcre_study(self->code, options, &err);
-    if (err) {
-        set_pcre_error(PYPCRE_ERROR_STUDY, err);
-        return NULL;
+        view = (Py_buffer *)PyMem_Malloc(sizeof(Py_buffer));
+        if (view == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        memset(view, 0, sizeof(Py_buffer));
+        view->buf = (void *)buf;
+        view->len = len;
+        view->readonly = 1;
+        view->obj = op;
+        Py_INCREF(op);
+        return view;
     }
+#endif
+    return pypcre_buffer_get(op, PyBUF_SIMPLE);
+}
 
-    /* Replace previous study results. */
-    pcre_free_study(self->extra);
-    self->extra = extra;
+/* Caches pattern information used by pattern_cannot_match().  With
+ * PCRE 8.x the minimum length is only known after studying.
+ */
+static void
+set_match_hints(PyPatternObject *self, pcre_extra *extra)
+{
+    unsigned long options;
+    int minlength;
+#ifdef PCRE_INFO_FIRSTCHARACTERFLAGS
+    unsigned int firstchar;
+    int firstflags;
+#elif defined(PCRE_INFO_FIRSTBYTE)
+    int firstbyte;
+#endif
 
-    /* Return True if studying the pattern produced additional
-     * information that will help speed up matching.
+    self->minlength = 0;
+    self->firstchar = -1;
+    self->anchored = 0;
+
+    /* PCRE doesn't use the information either with this option. */
+    if (pcre_fullinfo(self->code, extra, PCRE_INFO_OPTIONS, &options) != 0
+            || (options & PCRE_NO_START_OPTIMIZE))
+        return;
+    self->anchored = (options & PCRE_ANCHORED) != 0;
+
+    if (pcre_fullinfo(self->code, extra, PCRE_INFO_MINLENGTH, &minlength) == 0
+            && minlength > 0)
+        self->minlength = minlength;
+
+    /* Only ascii characters are used because they are the same in every
+     * subject encoding.
      */
-    return PyBool_FromLong(extra != NULL);
+#ifdef PCRE_INFO_FIRSTCHARACTERFLAGS
+    if (pcre_fullinfo(self->code, extra, PCRE_INFO_FIRSTCHARACTERFLAGS, &firstflags) == 0
+            && firstflags == 1
+            && pcre_fullinfo(self->code, extra, PCRE_INFO_FIRSTCHARACTER, &firstchar) == 0
+            && firstchar < 128)
+        self->firstchar = (int)firstchar;
+#elif defined(PCRE_INFO_FIRSTBYTE)
+    if (pcre_fullinfo(self->code, extra, PCRE_INFO_FIRSTBYTE, &firstbyte) == 0
+            && firstbyte >= 0 && firstbyte < 128)
+        self->firstchar = firstbyte;
+#endif
 }
 
-static PyObject *
-pattern_set_jit_stack(PyPatternObject *self, PyObject *args)
+/* Returns 1 if the pattern can't match <subject> between <pos> and <endpos>
+ * because the window is shorter than the minimum match length or, for
+ * anchored matches, doesn't start with the first character.  Only bytes
+ * and unicode subjects are checked, before they are encoded.  Returns 0
+ * if pcre_exec() has to be called.
+ */
+static int
+pattern_cannot_match(PyPatternObject *self, PyObject *subject, int pos, int endpos,
+                     int flags)
 {
-    int startsize, maxsize;
-#ifdef PYPCRE_HAS_JIT_API
-    int rc, jit;
-    pcre_jit_stack *stack;
-#endif
+    Py_ssize_t length;
+    unsigned int c, first;
 
-    if (!PyArg_ParseTuple(args, "ii", &startsize, &maxsize))
-        return NULL;
+    if (self->minlength == 0 && self->firstchar < 0)
+        return 0;
 
-#ifdef PYPCRE_HAS_JIT_API
-    /* Check whether PCRE library has been built with JIT support. */
-    if ((rc = pcre_config(PCRE_CONFIG_JIT, &jit)) != 0) {
-        set_pcre_error(rc, "failed to query JIT support");
-        return NULL;
-    }
+    /* Invalid UTF-8 subjects have to raise errors, partial matches may be
+     * shorter.
+     */
+    if ((flags & (PCRE_UTF8 | PCRE_NO_UTF8_CHECK)) == PCRE_UTF8
+            || (flags & (PCRE_PARTIAL_SOFT | PCRE_PARTIAL_HARD | PCRE_NO_START_OPTIMIZE)))
+        return 0;
 
-    /* Error if no JIT support. */
-    if (!jit) {
-        PyErr_SetString(PyExc_AssertionError, "PCRE library built without JIT support");
-        return NULL;
+    if (PyBytes_Check(subject))
+        length = PyBytes_GET_SIZE(subject);
+    else if (PyUnicode_Check(subject)) {
+#ifdef PY3_NEW_UNICODE
+        if (PyUnicode_READY(subject) < 0) {
+            PyErr_Clear();
+            return 0;
+        }
+        length = PyUnicode_GET_LENGTH(subject);
+#else
+        length = PyUnicode_GET_SIZE(subject);
+#endif
     }
+    else
+        return 0;
 
-    /* Assigning a new JIT stack requires a studied pattern. */
-    if (self->extra == NULL) {
-        PyErr_SetString(PyExc_AssertionError, "pattern must be studied first");
-        return NULL;
-    }
+    /* Same bounds as Match.__init__. */
+    if (pos < 0)
+        pos = 0;
+    if (endpos < 0 || endpos > length)
+        endpos = (int)length;
+    if (pos > endpos)
+        return 0;
 
-    /* Allocate new JIT stack. */
-    stack = pcre_jit_stack_alloc(startsize, maxsize);
-    if (stack == NULL) {
-        PyErr_NoMemory();
-        return NULL;
-    }
+    if (endpos - pos < self->minlength)
+        return 1;
 
-    /* Release old stack and assign the new one. */
-    if (self->jit_stack)
-        pcre_jit_stack_free(self->jit_stack);
-    self->jit_stack = stack;
-    pcre_assign_jit_stack(self->extra, NULL, stack);
+    if (self->firstchar < 0 || !(self->anchored || (flags & PCRE_ANCHORED)))
+        return 0;
+    if (pos == endpos)
+        return 1;
 
-    Py_RETURN_NONE;
+    if (PyBytes_Check(subject))
+        c = ((unsigned char *)PyBytes_AS_STRING(subject))[pos];
+    else
+#ifdef PY3_NEW_UNICODE
+        c = PyUnicode_READ_CHAR(subject, pos);
+#else
+        c = PyUnicode_AS_UNICODE(subject)[pos];
+#endif
+
+    /* The pattern may be caseless.  Other characters may fold to ascii ones,
+     * like the Kelvin sign to "k", so they are never rejected.
+     */
+    first = (unsigned int)self->firstchar;
+    if (c >= 128 || c == first)
+        return 0;
+    if (((first | 0x20) >= 'a' && (first | 0x20) <= 'z') && c == (first ^ 0x20))
+        return 0;
+    return 1;
+}
 
+/* Returns monotonic time in nanoseconds. */
+static long long
+pypcre_clock(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (long long)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
 #else
-    /* JIT API not supported. */
-    PyErr_SetString(PyExc_AssertionError, "PCRE library too old");
-    return NULL;
+    struct timespec ts;
 
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
 #endif
 }
 
-/* Serializes a pattern into a string.
- * Pattern can be unserialized using the "loads" argument of __init__.
- */
-static PyObject *
-pattern_dumps(PyPatternObject *self)
+/* Returns histogram bucket of <value>, its power of two. */
+static int
+auto_bucket(long long value)
 {
-    size_t size;
-    int rc;
-
-    if (assert_pattern_ready(self) < 0)
-        return NULL;
+    int i = 0;
 
-    rc = pcre_fullinfo(self->code, NULL, PCRE_INFO_SIZE, &size);
-    if (rc != 0) {
-        set_pcre_error(rc, "failed to query pattern size");
-        return NULL;
+    while (value > 1 && i < PYPCRE_AUTO_BUCKETS - 1) {
+        value >>= 1;
+        ++i;
     }
-    return PyBytes_FromStringAndSize((char *)self->code, size);
+    return i;
 }
 
-static PyObject *
-pattern_richcompare(PyPatternObject *self, PyObject *other, int op);
-
-static const PyMethodDef pattern_methods[] = {
-    {"study",           (PyCFunction)pattern_study,             METH_VARARGS},
-    {"set_jit_stack",   (PyCFunction)pattern_set_jit_stack,     METH_VARARGS},
-    {"dumps",           (PyCFunction)pattern_dumps,             METH_NOARGS},
-    {NULL}      /* sentinel */
-};
+/* Switches to <engine>, recording why. */
+static void
+auto_decide(pypcre_auto_t *state, int engine, const char *reason)
+{
+    pypcre_decision_t *decision;
 
-static const PyMemberDef pattern_members[] = {
-    {"pattern",     T_OBJECT,   offsetof(PyPatternObject, pattern),     READONLY},
-    {"flags",       T_INT,      offsetof(PyPatternObject, flags),       READONLY},
-    {"groups",      T_INT,      offsetof(PyPatternObject, groups),      READONLY},
-    {"groupindex",  T_OBJECT,   offsetof(PyPatternObject, groupindex),  READONLY},
-    {NULL}      /* sentinel */
-};
+    decision = &state->decisions[state->decided++ % PYPCRE_AUTO_HISTORY];
+    decision->calls = state->calls;
+    decision->engine = engine;
+    decision->reason = reason;
+    state->engine = engine;
+}
 
-static PyTypeObject PyPattern_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "_pcre.Pattern",                    /* tp_name */
-    sizeof(PyPatternObject),            /* tp_basicsize */
-    0,                                  /* tp_itemsize */
-    (destructor)pattern_dealloc,        /* tp_dealloc */
-    0,                                  /* tp_print */
-    0,                                  /* tp_getattr */
-    0,                                  /* tp_setattr */
-    0,                                  /* tp_compare */
-    0,                                  /* tp_repr */
-    0,                                  /* tp_as_number */
-    0,                                  /* tp_as_sequence */
-    0,                                  /* tp_as_mapping */
-    0,                                  /* tp_hash */
-    0,                                  /* tp_call */
-    0,                                  /* tp_str */
-    0,                                  /* tp_getattro */
-    0,                                  /* tp_setattro */
-    0,                                  /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* tp_flags */
-    0,                                  /* tp_doc */
-    0,                                  /* tp_traverse */
-    0,                                  /* tp_clear */
-    (richcmpfunc)pattern_richcompare,   /* tp_richcompare */
-    0,                                  /* tp_weaklistoffset */
-    0,                                  /* tp_iter */
-    0,                                  /* tp_iternext */
-    (PyMethodDef *)pattern_methods,     /* tp_methods */
-    (PyMemberDef *)pattern_members,     /* tp_members */
-    0,                                  /* tp_getset */
-    0,                                  /* tp_base */
-    0,                                  /* tp_dict */
-    0,                                  /* tp_descr_get */
-    0,                                  /* tp_descr_set */
-    0,                                  /* tp_dictoffset */
-    (initproc)pattern_init,             /* tp_init */
-    0,                                  /* tp_alloc */
-    0,                                  /* tp_new */
-    0,                                  /* tp_free */
-};
+/* Starts over from the current study data, which runs JIT code if
+ * there is some.
+ */
+static void
+auto_reset(PyPatternObject *self, const char *reason)
+{
+    pypcre_auto_t *state = self->autoengine;
+    int jit = self->extra && (self->extra->flags & PCRE_EXTRA_EXECUTABLE_JIT);
+
+    state->jit = jit;
+    state->epoch = 0;
+    state->interpreted = 0;
+    state->jit_compile = -1;
+    memset(state->time, 0, sizeof(state->time));
+    memset(state->count, 0, sizeof(state->count));
+    auto_decide(state, jit ? PYPCRE_ENGINE_JIT : PYPCRE_ENGINE_INTERPRETER, reason);
+}
 
-static PyObject *
-pattern_richcompare(PyPatternObject *self, PyObject *otherobj, int op)
+/* JIT-compiles the pattern and switches to JIT if it worked. */
+static void
+auto_compile_jit(PyPatternObject *self)
 {
-    PyPatternObject *other;
-    int equal, rc;
-    size_t size, other_size;
+    pypcre_auto_t *state = self->autoengine;
+    long long started = pypcre_clock();
+    const char *err = NULL;
+    pcre_extra *extra;
 
-    /* Only == and != comparisons to another pattern supported. */
-    if (!PyObject_TypeCheck(otherobj, &PyPattern_Type) || (op != Py_EQ && op != Py_NE)) {
-        Py_INCREF(Py_NotImplemented);
-        return Py_NotImplemented;
+    extra = pcre_study(self->code, PCRE_STUDY_JIT_COMPILE, &err);
+    if (extra == NULL || !(extra->flags & PCRE_EXTRA_EXECUTABLE_JIT)) {
+        pcre_free_study(extra);
+        state->jit = -1;
+        auto_decide(state, PYPCRE_ENGINE_INTERPRETER, "JIT not available");
+        return;
     }
 
-    other = (PyPatternObject *)otherobj;
-    if (self->code == other->code)
-        equal = 1;
-    else if (self->code == NULL || other->code == NULL)
-        equal = 0;
-    else if ((rc = pcre_fullinfo(self->code, NULL, PCRE_INFO_SIZE, &size)) != 0
-            || (rc = pcre_fullinfo(other->code, NULL, PCRE_INFO_SIZE, &other_size)) != 0) {
-        set_pcre_error(rc, "failed to query pattern size");
-        return NULL;
-    }
-    else if (size != other_size)
-        equal = 0;
-    else
-        equal = (memcmp(self->code, other->code, size) == 0);
+#ifdef PYPCRE_HAS_JIT_API
+    if (self->jit_stack)
+        pcre_assign_jit_stack(extra, NULL, self->jit_stack);
+#endif
+    pcre_free_study(self->extra);
+    self->extra = extra;
+    set_match_hints(self, extra);
 
-    return PyBool_FromLong(op == Py_EQ ? equal : !equal);
+    state->jit = 1;
+    state->jit_compile = pypcre_clock() - started;
+    auto_decide(state, PYPCRE_ENGINE_JIT, "interpreted time exceeded JIT compilation cost");
 }
 
-/*
- * Match
+/* Makes a decision at the end of an epoch.  Like study(), it changes
+ * study data so native threads must not be using it.
  */
+static void
+auto_epoch(PyPatternObject *self)
+{
+    pypcre_auto_t *state = self->autoengine;
+    int current = state->engine, other = !state->engine;
+    size_t size;
 
-typedef struct {
-    PyObject_HEAD
-    PyPatternObject *pattern; /* pattern instance */
-    PyObject *subject; /* as passed in */
-    pypcre_string_t str; /* UTF-8 string */
-    int *ovector; /* matched spans */
-    int startpos; /* after boundary checks */
-    int endpos; /* after boundary checks */
-    int flags; /* as passed in */
-    int lastindex; /* returned by pcre_exec */
-} PyMatchObject;
+    if (state->jit == 0) {
+        if (pcre_fullinfo(self->code, NULL, PCRE_INFO_SIZE, &size) == 0
+                && state->interpreted >= (long long)size * PYPCRE_AUTO_JIT_COST) {
+            auto_compile_jit(self);
+        }
+    }
 
-/* Returns 0 if Match.__init__ has been called or sets an exception
- * and returns -1 if not.  Match.__init__ sets all fields in one go
- * so 0 means they can all be safely used.
+    /* Compare average latencies of the epoch.  The other engine has to
+     * be clearly faster to avoid flipping back and forth.
+     */
+    else if (state->jit == 1 && state->count[current] > 0 && state->count[other] > 0) {
+        long long mean = state->time[current] / state->count[current];
+        long long other_mean = state->time[other] / state->count[other];
+
+        if (other_mean * 10 < mean * 9) {
+            self->extra->flags ^= PCRE_EXTRA_EXECUTABLE_JIT;
+            auto_decide(state, other, (other == PYPCRE_ENGINE_JIT) ?
+                    "JIT was faster" : "interpreter was faster");
+        }
+    }
+}
+
+/* Same as pcre_exec() with code and study data of the pattern but in
+ * engine='auto' mode the engine is picked and the match is recorded.
  */
 static int
-assert_match_ready(PyMatchObject *op)
+pattern_exec(PyPatternObject *self, const char *subject, int length, int startoffset,
+             int options, int *ovector, int ovecsize)
 {
-    if (op && op->ovector)
-        return 0;
+    pypcre_auto_t *state = self->autoengine;
+    const pcre_extra *extra = self->extra;
+    pcre_extra probe;
+    long long started, elapsed;
+    int engine, rc;
+
+    if (state == NULL)
+        return pcre_exec(self->code, extra, subject, length, startoffset, options,
+                ovector, ovecsize);
+
+    /* Study data of a pattern with JIT code has the JIT flag set only
+     * if it's the current engine.  Probes flip it in a copy.
+     */
+    engine = state->engine;
+    if (state->jit == 1 && state->epoch % PYPCRE_AUTO_PROBE == PYPCRE_AUTO_PROBE - 1) {
+        memcpy(&probe, extra, sizeof(pcre_extra));
+        probe.flags ^= PCRE_EXTRA_EXECUTABLE_JIT;
+        extra = &probe;
+        engine = !engine;
+    }
 
-    PyErr_SetString(PyExc_AssertionError, "match not ready");
-    return -1;
+    started = pypcre_clock();
+    rc = pcre_exec(self->code, extra, subject, length, startoffset, options,
+            ovector, ovecsize);
+
+    /* JIT code has a limited stack the interpreter doesn't have, so the
+     * match is run again interpreted and the time counted against JIT.
+     */
+    if (rc == PCRE_ERROR_JIT_STACKLIMIT && engine == PYPCRE_ENGINE_JIT) {
+        if (extra != &probe)
+            memcpy(&probe, extra, sizeof(pcre_extra));
+        probe.flags &= ~PCRE_EXTRA_EXECUTABLE_JIT;
+        rc = pcre_exec(self->code, &probe, subject, length, startoffset, options,
+                ovector, ovecsize);
+        if (state->engine == PYPCRE_ENGINE_JIT && self->busy == 0) {
+            self->extra->flags &= ~PCRE_EXTRA_EXECUTABLE_JIT;
+            auto_decide(state, PYPCRE_ENGINE_INTERPRETER, "JIT stack limit exceeded");
+        }
+    }
+    elapsed = pypcre_clock() - started;
+
+    ++state->calls;
+    ++state->lengths[auto_bucket(length - startoffset)];
+    ++state->latencies[engine][auto_bucket(elapsed)];
+    state->time[engine] += elapsed;
+    ++state->count[engine];
+    if (state->jit == 0)
+        state->interpreted += elapsed;
+
+    if (++state->epoch == PYPCRE_AUTO_EPOCH) {
+        if (self->busy == 0)
+            auto_epoch(self);
+        state->epoch = 0;
+        memset(state->time, 0, sizeof(state->time));
+        memset(state->count, 0, sizeof(state->count));
+    }
+    return rc;
 }
 
-/* Retrieves offsets into the subject object for given group.  Both
- * pos and endpos can be NULL if not used.  Returns 0 if successful
- * or sets an exception and returns -1 in case of an error.
+/* Sets an exception for pcre_compile2() error <rc> with message <err> at
+ * byte <offset> of <str> extracted from <pattern>.
+ */
+static void
+set_compile_error(pypcre_state_t *state, pypcre_string_t *str, PyObject *pattern,
+                  int rc, const char *err, int offset)
+{
+    PyObject *op;
+
+    /* Convert byte offset into character offset if needed. */
+    if (str->op != pattern)
+        pypcre_string_byte_to_char_offsets(str, &offset, NULL);
+
+    op = PyBytes_FromFormat("%.200s at position %d", err, offset);
+    if (op) {
+        /* Note.  Compilation error codes are positive. */
+        set_pcre_error(state, rc, PyBytes_AS_STRING(op));
+        Py_DECREF(op);
+    }
+}
+
+/* Sets up the pattern from compiled <code>, either owned by the pattern
+ * from now on or held by <view>.  <loads> is the serialized code it has
+ * been loaded from, if any.  Returns 0 if successful or frees the code,
+ * sets an exception and returns -1.
  */
 static int
-get_span(PyMatchObject *op, Py_ssize_t index, int *pos, int *endpos)
+pattern_setup_code(PyPatternObject *self, PyObject *pattern, int flags, pcre *code,
+                   PyObject *loads, Py_buffer *view)
 {
-    if (index < 0 || index > op->pattern->groups) {
-        PyErr_SetString(PyExc_IndexError, "no such group");
+    PyObject *groupindex, *groupnames;
+    pypcre_groupname_t *names;
+    int rc, groups, namecount;
+    Py_hash_t hash;
+
+    /* Get number of capturing groups. */
+    if ((rc = pcre_fullinfo(code, NULL, PCRE_INFO_CAPTURECOUNT, &groups)) != 0) {
+        free_code(code, view);
+        set_pcre_error(get_state(self), rc, "failed to query number of capturing groups");
         return -1;
     }
 
-    if (pos)
-        *pos = op->ovector[index * 2];
-    if (endpos)
-        *endpos = op->ovector[index * 2 + 1];
+    /* Hash it once for __hash__ and comparisons. */
+#ifdef PYPCRE_PCRE2
+    if (loads)
+        hash = hash_bytes(PyBytes_AS_STRING(loads), PyBytes_GET_SIZE(loads));
+    else
+#endif
+    if ((rc = hash_code(code, &hash)) != 0) {
+        free_code(code, view);
+        set_pcre_error(get_state(self), rc, "failed to hash pattern");
+        return -1;
+    }
 
-    /* Sanity check. */
-    if (pos && endpos && (*pos > *endpos) && (*endpos >= 0)) {
-        PyErr_SetString(PyExc_RuntimeError, "bad span");
+    /* Create a dict mapping named group names to their indexes. */
+    groupindex = make_groupindex(get_state(self), code, PyUnicode_Check(pattern));
+    if (groupindex == NULL) {
+        free_code(code, view);
         return -1;
     }
 
-    /* If subject has been encoded internally to UTF-8,
-     * convert byte offsets into character offsets.
-     */
-    if (op->subject != op->str.op)
-        pypcre_string_byte_to_char_offsets(&op->str, pos, endpos);
+    /* And the reverse mapping and a flat copy used by Match objects. */
+    if (make_grouptables(get_state(self), groupindex, groups, &groupnames, &names, &namecount) < 0) {
+        Py_DECREF(groupindex);
+        free_code(code, view);
+        return -1;
+    }
+
+    free_code(self->code, self->view);
+    self->code = code;
+    self->view = view;
+
+    Py_CLEAR(self->pattern);
+    self->pattern = pattern;
+    Py_INCREF(pattern);
+
+    Py_CLEAR(self->groupindex);
+    self->groupindex = groupindex;
+
+    free_grouptables(self->groupnames, self->names, self->namecount);
+    self->groupnames = groupnames;
+    self->names = names;
+    self->namecount = namecount;
+
+#ifdef PYPCRE_PCRE2
+    Py_CLEAR(self->loads);
+    self->loads = loads;
+    Py_XINCREF(loads);
+#endif
+
+    self->flags = flags;
+    self->groups = groups;
+    self->hash = hash;
+    set_match_hints(self, NULL);
 
     return 0;
 }
 
-/* Slices the subject string using offsets from given group.  If group
- * has no match, returns the default object.  Returns new reference.
+/* Sets up the pattern from a regex, serialized code in <loads> or code
+ * in <view> which is then owned by the pattern.  Returns 0 if successful
+ * or sets an exception and returns -1.
  */
-static PyObject *
-get_slice(PyMatchObject *op, Py_ssize_t index, PyObject *def)
+static int
+pattern_setup(PyPatternObject *self, PyObject *pattern, int flags, PyObject *loads,
+              Py_buffer *view)
 {
-    int pos, endpos;
+    pypcre_locale_t *locale = NULL;
+    int rc;
+    pcre *code;
 
-    if (get_span(op, index, &pos, &endpos) < 0)
-        return NULL;
+    /* Code in a buffer is used in place. */
+    if (view) {
+        size_t size;
 
-    if (pos >= 0 && endpos >= 0)
-        return PySequence_GetSlice(op->subject, pos, endpos);
+        code = (pcre *)view->buf;
+        if ((size_t)view->buf % sizeof(void *) != 0 || view->len < (Py_ssize_t)sizeof(int) * 4) {
+            pypcre_buffer_release(view);
+            PyErr_SetString(PyExc_ValueError, "bad pattern buffer");
+            return -1;
+        }
+        if ((rc = pcre_fullinfo(code, NULL, PCRE_INFO_SIZE, &size)) != 0
+                || size > (size_t)view->len) {
+            pypcre_buffer_release(view);
+            set_pcre_error(get_state(self), rc ? rc : PCRE_ERROR_BADMAGIC, "failed to load pattern");
+            return -1;
+        }
+    }
 
-    Py_INCREF(def);
-    return def;
+    /* Patterns can be serialized using dumps() and then unserialized
+     * using the "loads" argument.
+     */
+    else if (loads) {
+#ifdef PYPCRE_PCRE2
+        code = pypcre2_loads((const unsigned char *)PyBytes_AS_STRING(loads),
+                PyBytes_GET_SIZE(loads), &rc);
+        if (code == NULL) {
+            set_pcre_error(get_state(self), rc, "failed to load pattern");
+            return -1;
+        }
+#else
+        Py_ssize_t size;
+
+        size = PyBytes_GET_SIZE(loads);
+        code = pcre_malloc(size);
+        if (code == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+
+        memcpy(code, PyBytes_AS_STRING(loads), size);
+#endif
+    }
+    else {
+        pypcre_string_t str;
+        const char *err = NULL;
+        int o, options = flags & ~PYPCRE_LOCALE;
+
+        /* Extract UTF-8 string from the pattern object.  Encode if needed. */
+        if (pypcre_string_get(&str, pattern, &options) < 0)
+            return -1;
+
+        if ((flags & PYPCRE_LOCALE) && (locale = locale_acquire()) == NULL) {
+            pypcre_string_release(&str);
+            return -1;
+        }
+
+        /* Compile the regex. */
+        code = pcre_compile2(str.string, options | PCRE_UTF8, &rc, &err, &o,
+                locale ? locale->tables : NULL);
+        if (code == NULL) {
+            set_compile_error(get_state(self), &str, pattern, rc, err, o);
+            pypcre_string_release(&str);
+            locale_release(locale);
+            return -1;
+        }
+        pypcre_string_release(&str);
+    }
+
+    if (pattern_setup_code(self, pattern, flags, code, loads, view) < 0) {
+        locale_release(locale);
+        return -1;
+    }
+
+    /* The previous code has been freed so its tables can be released. */
+    locale_release(self->locale);
+    self->locale = locale;
+    return 0;
 }
 
-/* Same as get_slice() but takes PyObject group index. */
+static int
+pattern_init(PyPatternObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *pattern, *loads = NULL, *buffer = NULL, *data = NULL;
+    Py_buffer *view = NULL;
+    int rv, flags = 0;
+
+    static const char *const kwlist[] = {"pattern", "flags", "loads", "buffer", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iSO:__init__", (char **)kwlist,
+            &pattern, &flags, &loads, &buffer))
+        return -1;
+
+    if (assert_pattern_idle(self) < 0)
+        return -1;
+
+#ifdef PYPCRE_CODE_BUFFER
+    if (self->exports) {
+        PyErr_SetString(PyExc_BufferError, "pattern code is exported");
+        return -1;
+    }
+#endif
+
+    /* Same as "loads" but the code is used in place from an object
+     * supporting the buffer interface, like a shared mmap.  PCRE2 code
+     * is not relocatable so it's unserialized from a copy instead.
+     */
+    if (buffer && !loads) {
+        view = get_code_buffer(buffer);
+        if (view == NULL)
+            return -1;
+#ifdef PYPCRE_PCRE2
+        loads = data = PyBytes_FromStringAndSize((const char *)view->buf, view->len);
+        pypcre_buffer_release(view);
+        view = NULL;
+        if (data == NULL)
+            return -1;
+#endif
+    }
+
+    rv = pattern_setup(self, pattern, flags, loads, view);
+    Py_XDECREF(data);
+    return rv;
+}
+
+static void
+pattern_dealloc(PyPatternObject *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    Py_XDECREF(self->pattern);
+    Py_XDECREF(self->groupindex);
+    free_grouptables(self->groupnames, self->names, self->namecount);
+#ifdef PYPCRE_PCRE2
+    Py_XDECREF(self->loads);
+#endif
+    free_code(self->code, self->view);
+    pcre_free_study(self->extra);
+    locale_release(self->locale);
+    PyMem_Free(self->autoengine);
+#ifdef PYPCRE_HAS_JIT_API
+    if (self->jit_stack)
+        pcre_jit_stack_free(self->jit_stack);
+#endif
+    type->tp_free(self);
+#ifdef PYPCRE_MODULE_STATE
+    /* Instances of heap types own a reference to them. */
+    Py_DECREF(type);
+#endif
+}
+
+static PyObject *
+pattern_study(PyPatternObject *self, PyObject *args)
+{
+    int options = 0;
+    const char *err = NULL;
+    pcre_extra *extra;
+
+    if (!PyArg_ParseTuple(args, "|i:study", &options))
+        return NULL;
+
+    if (assert_pattern_ready(self) < 0 || assert_pattern_idle(self) < 0)
+        return NULL;
+
+    /* Study the pattern. */
+    extra = pcre_study(self->code, options, &err);
+    if (err) {
+        set_pcre_error(get_state(self), PYPCRE_ERROR_STUDY, err);
+        return NULL;
+    }
+
+    /* Replace previous study results. */
+    pcre_free_study(self->extra);
+    self->extra = extra;
+    set_match_hints(self, extra);
+    if (self->autoengine)
+        auto_reset(self, "pattern studied");
+
+    /* Return True if studying the pattern produced additional
+     * information that will help speed up matching.
+     */
+    return PyBool_FromLong(extra != NULL);
+}
+
+static PyObject *
+pattern_set_jit_stack(PyPatternObject *self, PyObject *args)
+{
+    int startsize, maxsize;
+#ifdef PYPCRE_HAS_JIT_API
+    int rc, jit;
+    pcre_jit_stack *stack;
+#endif
+
+    if (!PyArg_ParseTuple(args, "ii", &startsize, &maxsize))
+        return NULL;
+
+    if (assert_pattern_idle(self) < 0)
+        return NULL;
+
+#ifdef PYPCRE_HAS_JIT_API
+    /* Check whether PCRE library has been built with JIT support. */
+    if ((rc = pcre_config(PCRE_CONFIG_JIT, &jit)) != 0) {
+        set_pcre_error(get_state(self), rc, "failed to query JIT support");
+        return NULL;
+    }
+
+    /* Error if no JIT support. */
+    if (!jit) {
+        PyErr_SetString(PyExc_AssertionError, "PCRE library built without JIT support");
+        return NULL;
+    }
+
+    /* Assigning a new JIT stack requires a studied pattern. */
+    if (self->extra == NULL) {
+        PyErr_SetString(PyExc_AssertionError, "pattern must be studied first");
+        return NULL;
+    }
+
+    /* Allocate new JIT stack. */
+    stack = pcre_jit_stack_alloc(startsize, maxsize);
+    if (stack == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    /* Release old stack and assign the new one. */
+    if (self->jit_stack)
+        pcre_jit_stack_free(self->jit_stack);
+    self->jit_stack = stack;
+    self->jit_stack_size = maxsize;
+    pcre_assign_jit_stack(self->extra, NULL, stack);
+
+    Py_RETURN_NONE;
+
+#else
+    /* JIT API not supported. */
+    PyErr_SetString(PyExc_AssertionError, "PCRE library too old");
+    return NULL;
+
+#endif
+}
+
+/* Turns engine='auto' mode on with "auto" or off with None. */
+static PyObject *
+pattern_set_engine(PyPatternObject *self, PyObject *args)
+{
+    const char *engine;
+
+    if (!PyArg_ParseTuple(args, "z:set_engine", &engine))
+        return NULL;
+
+    if (assert_pattern_ready(self) < 0 || assert_pattern_idle(self) < 0)
+        return NULL;
+
+    if (engine && strcmp(engine, "auto") != 0) {
+        PyErr_SetString(PyExc_ValueError, "engine must be 'auto' or None");
+        return NULL;
+    }
+
+#ifdef Py_GIL_DISABLED
+    /* The state is updated by every match and would need a lock. */
+    if (engine) {
+        PyErr_SetString(PyExc_NotImplementedError,
+                "engine='auto' is not supported by free-threaded builds");
+        return NULL;
+    }
+#endif
+
+    /* Off.  JIT code is used again if there is some. */
+    if (engine == NULL) {
+        if (self->autoengine && self->autoengine->jit == 1)
+            self->extra->flags |= PCRE_EXTRA_EXECUTABLE_JIT;
+        PyMem_Free(self->autoengine);
+        self->autoengine = NULL;
+        Py_RETURN_NONE;
+    }
+
+    if (self->autoengine == NULL) {
+        self->autoengine = PyMem_Malloc(sizeof(pypcre_auto_t));
+        if (self->autoengine == NULL)
+            return PyErr_NoMemory();
+        memset(self->autoengine, 0, sizeof(pypcre_auto_t));
+        auto_reset(self, "auto mode enabled");
+    }
+
+    Py_RETURN_NONE;
+}
+
+static const char *const engine_names[] = {"interpreter", "jit"};
+
+static PyObject *
+make_histogram(const long long *counts)
+{
+    PyObject *result, *item;
+    int i;
+
+    result = PyTuple_New(PYPCRE_AUTO_BUCKETS);
+    if (result == NULL)
+        return NULL;
+
+    for (i = 0; i < PYPCRE_AUTO_BUCKETS; ++i) {
+        item = PyLong_FromLongLong(counts[i]);
+        if (item == NULL) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(result, i, item);
+    }
+    return result;
+}
+
+/* Returns a dict describing the engine in use and, in engine='auto'
+ * mode, the recorded matches and the decisions made.
+ */
+static PyObject *
+pattern_engine_info(PyPatternObject *self)
+{
+    pypcre_auto_t *state = self->autoengine;
+    PyObject *decisions, *compile_time, *item;
+    int i, first;
+
+    if (assert_pattern_ready(self) < 0)
+        return NULL;
+
+    if (state == NULL) {
+        int jit = self->extra && (self->extra->flags & PCRE_EXTRA_EXECUTABLE_JIT);
+        return Py_BuildValue("{s:O,s:s}", "mode", Py_None, "engine", engine_names[jit]);
+    }
+
+    /* Oldest first. */
+    first = (state->decided > PYPCRE_AUTO_HISTORY) ? state->decided - PYPCRE_AUTO_HISTORY : 0;
+    decisions = PyList_New(0);
+    if (decisions == NULL)
+        return NULL;
+    for (i = first; i < state->decided; ++i) {
+        pypcre_decision_t *decision = &state->decisions[i % PYPCRE_AUTO_HISTORY];
+
+        item = Py_BuildValue("(Lss)", decision->calls, engine_names[decision->engine],
+                decision->reason);
+        if (item == NULL || PyList_Append(decisions, item) < 0) {
+            Py_XDECREF(item);
+            Py_DECREF(decisions);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+
+    if (state->jit_compile < 0) {
+        compile_time = Py_None;
+        Py_INCREF(compile_time);
+    }
+    else
+        compile_time = PyFloat_FromDouble(state->jit_compile / 1e9);
+
+    return Py_BuildValue("{s:s,s:s,s:L,s:N,s:N,s:{s:N,s:N},s:N}",
+            "mode", "auto",
+            "engine", engine_names[state->engine],
+            "calls", state->calls,
+            "jit_compile_time", compile_time,
+            "lengths", make_histogram(state->lengths),
+            "latencies",
+                "interpreter", make_histogram(state->latencies[PYPCRE_ENGINE_INTERPRETER]),
+                "jit", make_histogram(state->latencies[PYPCRE_ENGINE_JIT]),
+            "decisions", decisions);
+}
+
+/* Serializes compiled code of a ready pattern into a string. */
+static PyObject *
+dump_code(PyPatternObject *self)
+{
+    size_t size;
+    int rc;
+#ifdef PYPCRE_PCRE2
+    unsigned char *data;
+    PyObject *result;
+#endif
+
+#ifdef PYPCRE_PCRE2
+    /* Unserialized PCRE2 patterns are marked internally and would
+     * serialize differently so return the data they were loaded from.
+     */
+    if (self->loads) {
+        Py_INCREF(self->loads);
+        return self->loads;
+    }
+
+    rc = pypcre2_dumps(self->code, &data, &size);
+    if (rc != 0) {
+        set_pcre_error(get_state(self), rc, "failed to serialize pattern");
+        return NULL;
+    }
+    result = PyBytes_FromStringAndSize((char *)data, size);
+    pypcre2_dumps_free(data);
+    return result;
+#else
+    rc = pcre_fullinfo(self->code, NULL, PCRE_INFO_SIZE, &size);
+    if (rc != 0) {
+        set_pcre_error(get_state(self), rc, "failed to query pattern size");
+        return NULL;
+    }
+    return PyBytes_FromStringAndSize((char *)self->code, size);
+#endif
+}
+
+/* Serializes a pattern into a string.
+ * Pattern can be unserialized using the "loads" argument of __init__.
+ */
+static PyObject *
+pattern_dumps(PyPatternObject *self)
+{
+    if (assert_pattern_ready(self) < 0)
+        return NULL;
+
+    /* The code points at tables which only exist in this process. */
+    if (self->locale) {
+        PyErr_SetString(PyExc_ValueError, "cannot serialize a LOCALE pattern");
+        return NULL;
+    }
+
+    return dump_code(self);
+}
+
+/* Returns the compiled code for pickling, a memoryview over the code
+ * itself if possible.
+ */
+static PyObject *
+pattern_code(PyPatternObject *self)
+{
+#ifdef PYPCRE_CODE_BUFFER
+    return PyMemoryView_FromObject((PyObject *)self);
+#else
+    return pattern_dumps(self);
+#endif
+}
+
+/* Returns a copy of the study data, which is relocatable with PCRE 8.x,
+ * or None if there is none or JIT code has to be built by studying the
+ * pattern again.
+ */
+static PyObject *
+pattern_study_data(PyPatternObject *self)
+{
+#ifndef PYPCRE_PCRE2
+    size_t size;
+    int rc;
+#endif
+
+    if (assert_pattern_ready(self) < 0)
+        return NULL;
+
+#ifndef PYPCRE_PCRE2
+    if (self->extra == NULL || !(self->extra->flags & PCRE_EXTRA_STUDY_DATA))
+        Py_RETURN_NONE;
+#ifdef PYPCRE_HAS_JIT_API
+    if (self->extra->executable_jit)
+        Py_RETURN_NONE;
+#endif
+
+    rc = pcre_fullinfo(self->code, self->extra, PCRE_INFO_STUDYSIZE, &size);
+    if (rc != 0) {
+        set_pcre_error(get_state(self), rc, "failed to query study size");
+        return NULL;
+    }
+    return PyBytes_FromStringAndSize((const char *)self->extra->study_data, size);
+#else
+    /* PCRE2 has no study data apart from the code. */
+    Py_RETURN_NONE;
+#endif
+}
+
+/* Replaces study results with data returned by _study_data(). */
+static PyObject *
+pattern_load_study(PyPatternObject *self, PyObject *args)
+{
+    PyObject *data;
+#ifndef PYPCRE_PCRE2
+    pcre_extra *extra;
+    unsigned int stored;
+    Py_ssize_t size;
+#endif
+
+    if (!PyArg_ParseTuple(args, "S:_load_study", &data))
+        return NULL;
+
+    if (assert_pattern_ready(self) < 0 || assert_pattern_idle(self) < 0)
+        return NULL;
+
+#ifndef PYPCRE_PCRE2
+    /* The data starts with its size. */
+    size = PyBytes_GET_SIZE(data);
+    if (size >= (Py_ssize_t)sizeof(stored))
+        memcpy(&stored, PyBytes_AS_STRING(data), sizeof(stored));
+    if (size < (Py_ssize_t)sizeof(stored) || stored != (size_t)size) {
+        PyErr_SetString(PyExc_ValueError, "invalid study data");
+        return NULL;
+    }
+
+    /* Laid out the same way pcre_study() does so that pcre_free_study()
+     * can free it.
+     */
+    extra = pcre_malloc(sizeof(pcre_extra) + size);
+    if (extra == NULL)
+        return PyErr_NoMemory();
+    memset(extra, 0, sizeof(pcre_extra));
+    extra->flags = PCRE_EXTRA_STUDY_DATA;
+    extra->study_data = (char *)extra + sizeof(pcre_extra);
+    memcpy(extra->study_data, PyBytes_AS_STRING(data), size);
+
+    pcre_free_study(self->extra);
+    self->extra = extra;
+    set_match_hints(self, extra);
+    if (self->autoengine)
+        auto_reset(self, "pattern studied");
+
+    Py_RETURN_NONE;
+#else
+    PyErr_SetString(PyExc_NotImplementedError, "PCRE2 patterns have no study data");
+    return NULL;
+#endif
+}
+
+/* Sizes of memory blocks used by a pattern, in bytes. */
+typedef struct {
+    size_t code; /* compiled pattern */
+    size_t study; /* pcre_study data */
+    size_t jit; /* JIT-compiled code */
+    size_t jit_stack; /* user-allocated jit stack */
+    size_t names; /* flat copy of groupindex */
+} pypcre_usage_t;
+
+/* Fills <usage> with sizes of memory blocks used by a pattern.
+ * Returns 0 if successful or sets an exception and returns -1.
+ */
+static int
+get_pattern_usage(PyPatternObject *self, pypcre_usage_t *usage)
+{
+    int rc;
+
+    memset(usage, 0, sizeof(pypcre_usage_t));
+
+    if ((rc = pcre_fullinfo(self->code, self->extra, PCRE_INFO_SIZE, &usage->code)) != 0
+            || (rc = pcre_fullinfo(self->code, self->extra, PCRE_INFO_STUDYSIZE,
+                    &usage->study)) != 0) {
+        set_pcre_error(get_state(self), rc, "failed to query pattern size");
+        return -1;
+    }
+
+#ifdef PYPCRE_HAS_JIT_API
+    if ((rc = pcre_fullinfo(self->code, self->extra, PCRE_INFO_JITSIZE, &usage->jit)) != 0) {
+        set_pcre_error(get_state(self), rc, "failed to query JIT size");
+        return -1;
+    }
+    if (self->jit_stack)
+        usage->jit_stack = self->jit_stack_size;
+#endif
+
+    usage->names = self->namecount * sizeof(pypcre_groupname_t);
+    return 0;
+}
+
+/* Returns __sizeof__() of <op> or -1 with an exception set. */
+static Py_ssize_t
+get_object_size(PyObject *op)
+{
+    PyObject *result;
+    Py_ssize_t size;
+
+    if (op == NULL)
+        return 0;
+
+    result = PyObject_CallMethod(op, "__sizeof__", NULL);
+    if (result == NULL)
+        return -1;
+    size = PyNumber_AsSsize_t(result, PyExc_OverflowError);
+    Py_DECREF(result);
+    return size;
+}
+
+/* Returns a dict with sizes of memory blocks used by a pattern.
+ * Group names include the groupindex dict.
+ */
+static PyObject *
+pattern_memory_usage(PyPatternObject *self)
+{
+    pypcre_usage_t usage;
+    Py_ssize_t dict_size, tuple_size;
+
+    if (assert_pattern_ready(self) < 0 || get_pattern_usage(self, &usage) < 0)
+        return NULL;
+
+    if ((dict_size = get_object_size(self->groupindex)) < 0
+            || (tuple_size = get_object_size(self->groupnames)) < 0)
+        return NULL;
+
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n}",
+            "code", (Py_ssize_t)usage.code,
+            "study", (Py_ssize_t)usage.study,
+            "jit", (Py_ssize_t)usage.jit,
+            "jit_stack", (Py_ssize_t)usage.jit_stack,
+            "groupindex", (Py_ssize_t)usage.names + dict_size + tuple_size);
+}
+
+/* Includes memory owned by the pattern but not the Python objects it
+ * references.  Code of patterns loaded from a buffer isn't owned.
+ */
+static PyObject *
+pattern_sizeof(PyPatternObject *self)
+{
+    pypcre_usage_t usage;
+    size_t size = Py_TYPE(self)->tp_basicsize;
+
+    if (self->code) {
+        if (get_pattern_usage(self, &usage) < 0)
+            return NULL;
+        if (self->view == NULL)
+            size += usage.code;
+        size += usage.study + usage.jit + usage.jit_stack + usage.names;
+    }
+
+    return PyInt_FromSsize_t((Py_ssize_t)size);
+}
+
+/* Counts matches of the pattern in <subject> the way finditer() would
+ * find them, stopping after <limit> matches if it's positive.  Only the
+ * overall match offsets are retrieved and no objects are created.
+ * Returns the count or sets an exception and returns -1.
+ */
+static int
+count_matches(PyPatternObject *self, PyObject *subject, int pos, int endpos,
+              int flags, int limit)
+{
+    pypcre_string_t str;
+    int options, offset, size, ovector[3], rc, count = 0;
+
+    if (assert_pattern_ready(self) < 0)
+        return -1;
+
+    if (pattern_cannot_match(self, subject, pos, endpos, flags))
+        return 0;
+
+    /* Extract UTF-8 string from the subject object.  Encode if needed. */
+    options = flags;
+    if (pypcre_string_get(&str, subject, &options) < 0)
+        return -1;
+    options &= ~PCRE_UTF8;
+
+    /* Check bounds, same as Match.__init__. */
+    if (endpos > str.length)
+        endpos = -1;
+    if (pos > ((endpos >= 0) ? endpos : str.length)) {
+        pypcre_string_release(&str);
+        return 0;
+    }
+
+    /* Offsets are only converted if they have been specified. */
+    offset = (pos > 0) ? pos : 0;
+    size = endpos;
+    if (str.op != subject)
+        pypcre_string_char_to_byte_offsets(&str, (pos > 0) ? &offset : NULL,
+                (endpos >= 0) ? &size : NULL);
+    if (size < 0 || size > str.length)
+        size = str.length;
+    options = pypcre_string_check_offsets(&str, options, offset, size);
+
+    while (offset <= size) {
+        rc = pattern_exec(self, str.string, size, offset, options, ovector, 3);
+        if (rc < 0) {
+            if (rc != PCRE_ERROR_NOMATCH) {
+                set_pcre_error(get_state(self), rc, "failed to match pattern");
+                count = -1;
+            }
+            break;
+        }
+
+        /* The first call has checked the whole subject. */
+        options |= PCRE_NO_UTF8_CHECK;
+
+        if (++count == limit)
+            break;
+
+        /* Continue after the match or after the next character if it's empty. */
+        offset = ovector[1];
+        if (ovector[0] == ovector[1]) {
+            ++offset;
+            while (offset < size && !ISUTF8(str.string[offset]))
+                ++offset;
+        }
+    }
+
+    pypcre_string_release(&str);
+    return count;
+}
+
+/* Returns True if the pattern matches anywhere in the subject. */
+static PyObject *
+pattern_contains(PyPatternObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *subject;
+    int pos = -1, endpos = -1, flags = 0, count;
+
+    static const char *const kwlist[] = {"string", "pos", "endpos", "flags", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iii:contains", (char **)kwlist,
+            &subject, &pos, &endpos, &flags))
+        return NULL;
+
+    count = count_matches(self, subject, pos, endpos, flags, 1);
+    if (count < 0)
+        return NULL;
+    return PyBool_FromLong(count);
+}
+
+/* Returns the number of matches finditer() would return. */
+static PyObject *
+pattern_count(PyPatternObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *subject;
+    int pos = -1, endpos = -1, flags = 0, count;
+
+    static const char *const kwlist[] = {"string", "pos", "endpos", "flags", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iii:count", (char **)kwlist,
+            &subject, &pos, &endpos, &flags))
+        return NULL;
+
+    count = count_matches(self, subject, pos, endpos, flags, 0);
+    if (count < 0)
+        return NULL;
+    return PyInt_FromLong(count);
+}
+
+/* How extract() converts a named group. */
+#define PYPCRE_FIELD_STR        (0)
+#define PYPCRE_FIELD_INT        (1)
+#define PYPCRE_FIELD_FLOAT      (2)
+#define PYPCRE_FIELD_CALL       (3)
+
+/* What extract() returns for a match. */
+#define PYPCRE_RECORD_DICT      (0)
+#define PYPCRE_RECORD_TUPLE     (1)
+#define PYPCRE_RECORD_ARGS      (2) /* record(*values) in order of record._fields */
+#define PYPCRE_RECORD_KWARGS    (3) /* record(**values) */
+
+typedef struct {
+    PyObject *name;
+    int index;
+    int kind;
+    PyObject *convert; /* the type or callable from <types> */
+} pypcre_field_t;
+
+typedef struct {
+    PyPatternObject *pattern;
+    pypcre_field_t *fields;
+    int count;
+    int mode;
+    PyObject *record;
+    PyObject *names; /* record._fields */
+    int *ovector;
+    int ovecsize;
+} pypcre_extractor_t;
+
+static void
+extractor_release(pypcre_extractor_t *ex)
+{
+    int i;
+
+    for (i = 0; i < ex->count; ++i)
+        Py_XDECREF(ex->fields[i].convert);
+    PyMem_Free(ex->fields);
+    PyMem_Free(ex->ovector);
+    Py_XDECREF(ex->names);
+}
+
+/* Adds a field for group <name> converted as <types> says. */
+static int
+extractor_add(pypcre_extractor_t *ex, PyObject *name, PyObject *types)
+{
+    pypcre_field_t *field = &ex->fields[ex->count];
+    PyObject *index, *convert = NULL;
+
+    index = PyDict_GetItem(ex->pattern->groupindex, name);
+    if (index == NULL) {
+        PyErr_SetString(PyExc_IndexError, "no such group");
+        return -1;
+    }
+
+    if (types) {
+        convert = PyDict_GetItem(types, name);
+        if (convert == Py_None)
+            convert = NULL;
+    }
+
+    field->name = name;
+    field->index = (int)PyInt_AsLong(index);
+    field->convert = convert;
+    if (convert == NULL)
+        field->kind = PYPCRE_FIELD_STR;
+#ifdef PY3
+    else if (convert == (PyObject *)&PyLong_Type)
+#else
+    else if (convert == (PyObject *)&PyInt_Type)
+#endif
+        field->kind = PYPCRE_FIELD_INT;
+    else if (convert == (PyObject *)&PyFloat_Type)
+        field->kind = PYPCRE_FIELD_FLOAT;
+    else if (PyCallable_Check(convert))
+        field->kind = PYPCRE_FIELD_CALL;
+    else {
+        PyErr_SetString(PyExc_TypeError, "types must map group names to callables");
+        return -1;
+    }
+
+    /* <types> may be changed by the callables. */
+    Py_XINCREF(convert);
+    ++ex->count;
+    return 0;
+}
+
+/* Prepares extraction of named groups.  <types> maps group names to
+ * int, float or another callable and <record> is None for dicts, tuple,
+ * a class with _fields (like namedtuple) or a class taking keyword
+ * arguments.  Returns 0 if successful or sets an exception and
+ * returns -1.
+ */
+static int
+extractor_init(pypcre_extractor_t *ex, PyPatternObject *self, PyObject *types,
+               PyObject *record)
+{
+    PyObject *key, *value;
+    Py_ssize_t pos = 0, count;
+    int i;
+
+    memset(ex, 0, sizeof(pypcre_extractor_t));
+    ex->pattern = self;
+    ex->record = record;
+
+    if (assert_pattern_ready(self) < 0)
+        return -1;
+
+    if (types == Py_None)
+        types = NULL;
+    if (types && !PyDict_Check(types)) {
+        PyErr_SetString(PyExc_TypeError, "types must be a dict");
+        return -1;
+    }
+
+    /* Unknown names are most likely typos. */
+    while (types && PyDict_Next(types, &pos, &key, &value)) {
+        if (PyDict_GetItem(self->groupindex, key) == NULL) {
+            PyErr_SetString(PyExc_IndexError, "no such group");
+            return -1;
+        }
+    }
+
+    if (record == Py_None || record == (PyObject *)&PyDict_Type)
+        ex->mode = PYPCRE_RECORD_DICT;
+    else if (record == (PyObject *)&PyTuple_Type)
+        ex->mode = PYPCRE_RECORD_TUPLE;
+    else {
+        value = PyObject_GetAttrString(record, "_fields");
+        if (value) {
+            ex->names = PySequence_Tuple(value);
+            Py_DECREF(value);
+            if (ex->names == NULL)
+                return -1;
+            ex->mode = PYPCRE_RECORD_ARGS;
+        }
+        else if (PyErr_ExceptionMatches(PyExc_AttributeError)) {
+            PyErr_Clear();
+            ex->mode = PYPCRE_RECORD_KWARGS;
+        }
+        else
+            return -1;
+    }
+
+    count = ex->names ? PyTuple_GET_SIZE(ex->names) : self->namecount;
+    ex->fields = PyMem_Malloc((count + 1) * sizeof(pypcre_field_t));
+    ex->ovecsize = (self->groups + 1) * 3;
+    ex->ovector = PyMem_Malloc(ex->ovecsize * sizeof(int));
+    if (ex->fields == NULL || ex->ovector == NULL) {
+        extractor_release(ex);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    /* Tuples and dicts follow group order, like groupdict(), keyword
+     * arguments can go in any order.
+     */
+    if (ex->mode == PYPCRE_RECORD_TUPLE || ex->mode == PYPCRE_RECORD_DICT) {
+        for (i = 1; i <= self->groups; ++i) {
+            key = PyTuple_GET_ITEM(self->groupnames, i);
+            if (key != Py_None && extractor_add(ex, key, types) < 0)
+                break;
+        }
+    }
+    else if (ex->mode == PYPCRE_RECORD_ARGS) {
+        for (i = 0; i < count; ++i) {
+            if (extractor_add(ex, PyTuple_GET_ITEM(ex->names, i), types) < 0)
+                break;
+        }
+    }
+    else {
+        for (i = 0; i < count; ++i) {
+            if (extractor_add(ex, self->names[i].name, types) < 0)
+                break;
+        }
+    }
+
+    if (PyErr_Occurred()) {
+        extractor_release(ex);
+        return -1;
+    }
+    return 0;
+}
+
+/* Converts <size> bytes at <s> with int() or float() without creating
+ * a string first.  Returns NULL without an exception if the text has
+ * to be converted by calling the type, e.g. because it's not valid.
+ */
+static PyObject *
+parse_number(const char *s, int size, int kind)
+{
+    char buffer[64], *text = buffer;
+    PyObject *result = NULL;
+    int i;
+
+    /* Only plain ascii is parsed here. */
+    for (i = 0; i < size; ++i) {
+        if (s[i] == 0 || (s[i] & 0x80))
+            return NULL;
+    }
+
+    if (size >= (int)sizeof(buffer)) {
+        text = PyMem_Malloc(size + 1);
+        if (text == NULL)
+            return NULL;
+    }
+    memcpy(text, s, size);
+    text[size] = 0;
+
+    if (kind == PYPCRE_FIELD_INT) {
+#ifdef PY3
+        result = PyLong_FromString(text, NULL, 10);
+#else
+        result = PyInt_FromString(text, NULL, 10);
+#endif
+    }
+#if PY_VERSION_HEX >= 0x02070000
+    else {
+        /* float() also strips whitespace and accepts underscores which
+         * are left for it.
+         */
+        double value;
+
+        value = PyOS_string_to_double(text, NULL, NULL);
+        if (value != -1.0 || !PyErr_Occurred())
+            result = PyFloat_FromDouble(value);
+    }
+#endif
+
+    if (text != buffer)
+        PyMem_Free(text);
+    if (result == NULL)
+        PyErr_Clear();
+    return result;
+}
+
+/* Returns value of <field> from ovector of a match of <str>. */
+static PyObject *
+extract_field(pypcre_extractor_t *ex, pypcre_field_t *field, PyObject *subject,
+              const pypcre_string_t *str, int rc)
+{
+    PyObject *text, *result;
+    int pos = -1, endpos = -1;
+
+    if (field->index < rc) {
+        pos = ex->ovector[field->index * 2];
+        endpos = ex->ovector[field->index * 2 + 1];
+    }
+    if (pos < 0 || endpos < 0)
+        Py_RETURN_NONE;
+
+    if (field->kind == PYPCRE_FIELD_INT || field->kind == PYPCRE_FIELD_FLOAT) {
+        result = parse_number(str->string + pos, endpos - pos, field->kind);
+        if (result)
+            return result;
+    }
+
+    /* Slice the subject like Match.group() does. */
+    if (subject != str->op)
+        pypcre_string_byte_to_char_offsets(str, &pos, &endpos);
+    text = PySequence_GetSlice(subject, pos, endpos);
+    if (text == NULL || field->kind == PYPCRE_FIELD_STR)
+        return text;
+
+    result = PyObject_CallFunctionObjArgs(field->convert, text, NULL);
+    Py_DECREF(text);
+    return result;
+}
+
+/* Searches <subject> and returns the record with converted named groups
+ * or None if there is no match.
+ */
+static PyObject *
+extract_one(pypcre_extractor_t *ex, PyObject *subject)
+{
+    PyPatternObject *self = ex->pattern;
+    PyObject *result, *value, *args;
+    pypcre_string_t str;
+    int options = 0, rc, err, i, dict;
+
+    if (pattern_cannot_match(self, subject, -1, -1, 0))
+        Py_RETURN_NONE;
+
+    if (pypcre_string_get(&str, subject, &options) < 0)
+        return NULL;
+    options &= ~PCRE_UTF8;
+    options = pypcre_string_check_offsets(&str, options, 0, str.length);
+
+    rc = pattern_exec(self, str.string, str.length, 0, options, ex->ovector,
+            ex->ovecsize);
+    if (rc < 0) {
+        pypcre_string_release(&str);
+        if (rc == PCRE_ERROR_NOMATCH)
+            Py_RETURN_NONE;
+        set_pcre_error(get_state(self), rc, "failed to match pattern");
+        return NULL;
+    }
+    if (rc == 0)
+        rc = ex->ovecsize / 3;
+
+    dict = (ex->mode == PYPCRE_RECORD_DICT || ex->mode == PYPCRE_RECORD_KWARGS);
+    result = dict ? PyDict_New() : PyTuple_New(ex->count);
+    if (result == NULL) {
+        pypcre_string_release(&str);
+        return NULL;
+    }
+
+    for (i = 0; i < ex->count; ++i) {
+        value = extract_field(ex, &ex->fields[i], subject, &str, rc);
+        if (value == NULL) {
+            Py_CLEAR(result);
+            break;
+        }
+        if (!dict)
+            PyTuple_SET_ITEM(result, i, value);
+        else {
+            err = PyDict_SetItem(result, ex->fields[i].name, value);
+            Py_DECREF(value);
+            if (err < 0) {
+                Py_CLEAR(result);
+                break;
+            }
+        }
+    }
+    pypcre_string_release(&str);
+
+    if (result == NULL || ex->mode == PYPCRE_RECORD_DICT || ex->mode == PYPCRE_RECORD_TUPLE)
+        return result;
+
+    /* Build the record from values or keyword arguments. */
+    if (dict) {
+        args = PyTuple_New(0);
+        value = args ? PyObject_Call(ex->record, args, result) : NULL;
+        Py_XDECREF(args);
+    }
+    else
+        value = PyObject_Call(ex->record, result, NULL);
+    Py_DECREF(result);
+    return value;
+}
+
+/* Returns named groups of the first match converted to types given
+ * by name, in a dict, a tuple or a record class.  Numbers are parsed
+ * straight from the matched text.
+ */
+static PyObject *
+pattern_extract(PyPatternObject *self, PyObject *args, PyObject *kwds)
+{
+    pypcre_extractor_t ex;
+    PyObject *subject, *types = Py_None, *record = Py_None, *result;
+
+    static const char *const kwlist[] = {"string", "types", "record", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OO:extract", (char **)kwlist,
+            &subject, &types, &record))
+        return NULL;
+
+    if (extractor_init(&ex, self, types, record) < 0)
+        return NULL;
+    result = extract_one(&ex, subject);
+    extractor_release(&ex);
+    return result;
+}
+
+/* Same as extract() for every string of an iterable.  Returns a list
+ * with None for strings that don't match.
+ */
+static PyObject *
+pattern_extract_many(PyPatternObject *self, PyObject *args, PyObject *kwds)
+{
+    pypcre_extractor_t ex;
+    PyObject *lines, *types = Py_None, *record = Py_None, *iter, *line, *item;
+    PyObject *result;
+
+    static const char *const kwlist[] = {"lines", "types", "record", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OO:extract_many", (char **)kwlist,
+            &lines, &types, &record))
+        return NULL;
+
+    if (extractor_init(&ex, self, types, record) < 0)
+        return NULL;
+
+    iter = PyObject_GetIter(lines);
+    result = PyList_New(0);
+    if (iter == NULL || result == NULL) {
+        Py_XDECREF(iter);
+        Py_XDECREF(result);
+        extractor_release(&ex);
+        return NULL;
+    }
+
+    while ((line = PyIter_Next(iter)) != NULL) {
+        item = extract_one(&ex, line);
+        Py_DECREF(line);
+        if (item == NULL || PyList_Append(result, item) < 0) {
+            Py_XDECREF(item);
+            break;
+        }
+        Py_DECREF(item);
+    }
+    Py_DECREF(iter);
+    extractor_release(&ex);
+
+    if (PyErr_Occurred())
+        Py_CLEAR(result);
+    return result;
+}
+
+static PyObject *
+pattern_richcompare(PyPatternObject *self, PyObject *other, int op);
+
+static Py_hash_t
+pattern_hash(PyPatternObject *self)
+{
+    if (assert_pattern_ready(self) < 0)
+        return -1;
+    return self->hash;
+}
+
+#ifdef PYPCRE_CODE_BUFFER
+/* Exports the compiled code, read-only.  The pattern can't be initialized
+ * again while it's exported.
+ */
+static int
+pattern_getbuffer(PyPatternObject *self, Py_buffer *view, int flags)
+{
+    size_t size;
+    int rc;
+
+    if (assert_pattern_ready(self) < 0)
+        return -1;
+
+    /* The code points at tables which only exist in this process. */
+    if (self->locale) {
+        PyErr_SetString(PyExc_BufferError, "cannot export a LOCALE pattern");
+        return -1;
+    }
+
+    rc = pcre_fullinfo(self->code, NULL, PCRE_INFO_SIZE, &size);
+    if (rc != 0) {
+        set_pcre_error(get_state(self), rc, "failed to query pattern size");
+        return -1;
+    }
+
+    if (PyBuffer_FillInfo(view, (PyObject *)self, (void *)self->code,
+            (Py_ssize_t)size, 1, flags) < 0)
+        return -1;
+    ++self->exports;
+    return 0;
+}
+
+static void
+pattern_releasebuffer(PyPatternObject *self, Py_buffer *view)
+{
+    --self->exports;
+}
+
+#ifndef PYPCRE_MODULE_STATE
+static PyBufferProcs pattern_as_buffer = {
+    (getbufferproc)pattern_getbuffer,
+    (releasebufferproc)pattern_releasebuffer,
+};
+#endif
+#endif
+
+static PyObject *
+pattern_finditer_parallel(PyPatternObject *self, PyObject *args, PyObject *kwds);
+
+static PyObject *
+pattern_submit(PyPatternObject *self, PyObject *args, PyObject *kwds);
+
+static PyObject *
+pattern_scan(PyPatternObject *self, PyObject *args, PyObject *kwds);
+
+static PyObject *
+pattern_finditer(PyPatternObject *self, PyObject *args, PyObject *kwds);
+
+static PyObject *
+pattern_search(PyPatternObject *self, PyObject *args, PyObject *kwds);
+
+static PyObject *
+pattern_grep(PyPatternObject *self, PyObject *args, PyObject *kwds);
+
+static PyObject *
+pattern_mask_inplace(PyPatternObject *self, PyObject *args, PyObject *kwds);
+
+static const PyMethodDef pattern_methods[] = {
+    {"study",           (PyCFunction)pattern_study,             METH_VARARGS},
+    {"set_jit_stack",   (PyCFunction)pattern_set_jit_stack,     METH_VARARGS},
+    {"set_engine",      (PyCFunction)pattern_set_engine,        METH_VARARGS},
+    {"engine_info",     (PyCFunction)pattern_engine_info,       METH_NOARGS},
+    {"dumps",           (PyCFunction)pattern_dumps,             METH_NOARGS},
+    {"_code",           (PyCFunction)pattern_code,              METH_NOARGS},
+    {"_study_data",     (PyCFunction)pattern_study_data,        METH_NOARGS},
+    {"_load_study",     (PyCFunction)pattern_load_study,        METH_VARARGS},
+    {"memory_usage",    (PyCFunction)pattern_memory_usage,      METH_NOARGS},
+    {"contains",        (PyCFunction)pattern_contains,          METH_VARARGS | METH_KEYWORDS},
+    {"count",           (PyCFunction)pattern_count,             METH_VARARGS | METH_KEYWORDS},
+    {"extract",         (PyCFunction)pattern_extract,           METH_VARARGS | METH_KEYWORDS},
+    {"extract_many",    (PyCFunction)pattern_extract_many,      METH_VARARGS | METH_KEYWORDS},
+    {"mask_inplace",    (PyCFunction)pattern_mask_inplace,      METH_VARARGS | METH_KEYWORDS},
+    {"__sizeof__",      (PyCFunction)pattern_sizeof,            METH_NOARGS},
+    {"_finditer_parallel", (PyCFunction)pattern_finditer_parallel, METH_VARARGS | METH_KEYWORDS},
+    {"_submit",         (PyCFunction)pattern_submit,            METH_VARARGS | METH_KEYWORDS},
+    {"_scan",           (PyCFunction)pattern_scan,              METH_VARARGS | METH_KEYWORDS},
+    {"_finditer",       (PyCFunction)pattern_finditer,          METH_VARARGS | METH_KEYWORDS},
+    {"_search",         (PyCFunction)pattern_search,            METH_VARARGS | METH_KEYWORDS},
+    {"_grep",           (PyCFunction)pattern_grep,              METH_VARARGS | METH_KEYWORDS},
+    {NULL}      /* sentinel */
+};
+
+static const PyMemberDef pattern_members[] = {
+    {"pattern",     T_OBJECT,   offsetof(PyPatternObject, pattern),     READONLY},
+    {"flags",       T_INT,      offsetof(PyPatternObject, flags),       READONLY},
+    {"groups",      T_INT,      offsetof(PyPatternObject, groups),      READONLY},
+    {"groupindex",  T_OBJECT,   offsetof(PyPatternObject, groupindex),  READONLY},
+    {NULL}      /* sentinel */
+};
+
+#ifdef PYPCRE_MODULE_STATE
+static PyType_Slot pattern_slots[] = {
+    {Py_tp_dealloc, pattern_dealloc},
+    {Py_tp_hash, pattern_hash},
+    {Py_tp_richcompare, pattern_richcompare},
+    {Py_tp_methods, (void *)pattern_methods},
+    {Py_tp_members, (void *)pattern_members},
+    {Py_tp_init, pattern_init},
+    {Py_tp_new, PyType_GenericNew},
+#ifdef PYPCRE_CODE_BUFFER
+    {Py_bf_getbuffer, pattern_getbuffer},
+    {Py_bf_releasebuffer, pattern_releasebuffer},
+#endif
+    {0, NULL}
+};
+
+static PyType_Spec pattern_spec = {
+    "_pcre.Pattern",
+    sizeof(PyPatternObject),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    pattern_slots
+};
+#else
+static PyTypeObject PyPattern_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_pcre.Pattern",                    /* tp_name */
+    sizeof(PyPatternObject),            /* tp_basicsize */
+    0,                                  /* tp_itemsize */
+    (destructor)pattern_dealloc,        /* tp_dealloc */
+    0,                                  /* tp_print */
+    0,                                  /* tp_getattr */
+    0,                                  /* tp_setattr */
+    0,                                  /* tp_compare */
+    0,                                  /* tp_repr */
+    0,                                  /* tp_as_number */
+    0,                                  /* tp_as_sequence */
+    0,                                  /* tp_as_mapping */
+    (hashfunc)pattern_hash,             /* tp_hash */
+    0,                                  /* tp_call */
+    0,                                  /* tp_str */
+    0,                                  /* tp_getattro */
+    0,                                  /* tp_setattro */
+#ifdef PYPCRE_CODE_BUFFER
+    &pattern_as_buffer,                 /* tp_as_buffer */
+#else
+    0,                                  /* tp_as_buffer */
+#endif
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* tp_flags */
+    0,                                  /* tp_doc */
+    0,                                  /* tp_traverse */
+    0,                                  /* tp_clear */
+    (richcmpfunc)pattern_richcompare,   /* tp_richcompare */
+    0,                                  /* tp_weaklistoffset */
+    0,                                  /* tp_iter */
+    0,                                  /* tp_iternext */
+    (PyMethodDef *)pattern_methods,     /* tp_methods */
+    (PyMemberDef *)pattern_members,     /* tp_members */
+    0,                                  /* tp_getset */
+    0,                                  /* tp_base */
+    0,                                  /* tp_dict */
+    0,                                  /* tp_descr_get */
+    0,                                  /* tp_descr_set */
+    0,                                  /* tp_dictoffset */
+    (initproc)pattern_init,             /* tp_init */
+    0,                                  /* tp_alloc */
+    0,                                  /* tp_new */
+    0,                                  /* tp_free */
+};
+#endif
+
+static PyObject *
+pattern_richcompare(PyPatternObject *self, PyObject *otherobj, int op)
+{
+    PyPatternObject *other;
+    int equal;
+#ifndef PYPCRE_PCRE2
+    int rc;
+    size_t size, other_size;
+#endif
+
+    /* Only == and != comparisons to another pattern supported. */
+    if (!PyObject_TypeCheck(otherobj, get_state(self)->Pattern_Type)
+            || (op != Py_EQ && op != Py_NE)) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+
+    other = (PyPatternObject *)otherobj;
+    if (self->code == other->code)
+        equal = 1;
+    else if (self->code == NULL || other->code == NULL || self->hash != other->hash)
+        equal = 0;
+#ifdef PYPCRE_PCRE2
+    /* PCRE2 patterns contain pointers so compare them serialized. */
+    else {
+        PyObject *data, *other_data = NULL, *result = NULL;
+
+        data = dump_code(self);
+        if (data)
+            other_data = dump_code(other);
+        if (other_data)
+            result = PyObject_RichCompare(data, other_data, op);
+        Py_XDECREF(data);
+        Py_XDECREF(other_data);
+        return result;
+    }
+#else
+    else if ((rc = pcre_fullinfo(self->code, NULL, PCRE_INFO_SIZE, &size)) != 0
+            || (rc = pcre_fullinfo(other->code, NULL, PCRE_INFO_SIZE, &other_size)) != 0) {
+        set_pcre_error(get_state(self), rc, "failed to query pattern size");
+        return NULL;
+    }
+    else if (size != other_size)
+        equal = 0;
+    else
+        equal = (memcmp(self->code, other->code, size) == 0);
+#endif
+
+    return PyBool_FromLong(op == Py_EQ ? equal : !equal);
+}
+
+/*
+ * Match
+ */
+
+typedef struct {
+    PyObject_HEAD
+    PyPatternObject *pattern; /* pattern instance */
+    PyObject *subject; /* as passed in or its matched part if detached */
+    pypcre_string_t str; /* UTF-8 string */
+    int *ovector; /* matched spans */
+    int startpos; /* after boundary checks */
+    int endpos; /* after boundary checks */
+    int flags; /* as passed in */
+    int lastindex; /* returned by pcre_exec */
+    int detached; /* subject has been replaced by its matched part */
+    int base; /* character offset of the matched part in the original subject */
+    int basebyte; /* same in bytes of the original UTF-8 string */
+} PyMatchObject;
+
+/* Returns 0 if Match.__init__ has been called or sets an exception
+ * and returns -1 if not.  Match.__init__ sets all fields in one go
+ * so 0 means they can all be safely used.
+ */
+static int
+assert_match_ready(PyMatchObject *op)
+{
+    if (op && op->ovector)
+        return 0;
+
+    PyErr_SetString(PyExc_AssertionError, "match not ready");
+    return -1;
+}
+
+/* Retrieves offsets into the subject object for given group.  Both
+ * pos and endpos can be NULL if not used.  Returns 0 if successful
+ * or sets an exception and returns -1 in case of an error.
+ */
+static int
+get_span(PyMatchObject *op, Py_ssize_t index, int *pos, int *endpos)
+{
+    if (index < 0 || index > op->pattern->groups) {
+        PyErr_SetString(PyExc_IndexError, "no such group");
+        return -1;
+    }
+
+    if (pos)
+        *pos = op->ovector[index * 2];
+    if (endpos)
+        *endpos = op->ovector[index * 2 + 1];
+
+    /* Sanity check. */
+    if (pos && endpos && (*pos > *endpos) && (*endpos >= 0)) {
+        PyErr_SetString(PyExc_RuntimeError, "bad span");
+        return -1;
+    }
+
+    /* If subject has been encoded internally to UTF-8,
+     * convert byte offsets into character offsets.
+     */
+    if (op->subject != op->str.op)
+        pypcre_string_byte_to_char_offsets(&op->str, pos, endpos);
+
+    /* Offsets of detached matches are relative to the matched part. */
+    if (pos && *pos >= 0)
+        *pos += op->base;
+    if (endpos && *endpos >= 0)
+        *endpos += op->base;
+
+    return 0;
+}
+
+/* Slices the subject string using offsets from given group.  If group
+ * has no match, returns the default object.  Returns new reference.
+ */
+static PyObject *
+get_slice(PyMatchObject *op, Py_ssize_t index, PyObject *def)
+{
+    int pos, endpos;
+
+    if (get_span(op, index, &pos, &endpos) < 0)
+        return NULL;
+
+    if (pos >= 0 && endpos >= 0)
+        return PySequence_GetSlice(op->subject, pos - op->base, endpos - op->base);
+
+    Py_INCREF(def);
+    return def;
+}
+
+/* Same as get_slice() but takes PyObject group index. */
+static PyObject *
+get_slice_o(PyMatchObject *op, PyObject *index, PyObject *def)
+{
+    Py_ssize_t i = get_index(op->pattern, index);
+    if (i < 0)
+        return NULL;
+
+    return get_slice(op, i, def);
+}
+
+/* Fills <ovector> with <count> offset pairs saved by Match._ovector() in
+ * <saved>, checking that they are valid offsets into <str>.  Returns the
+ * value pcre_exec() would have returned or sets an exception and returns -1.
+ */
+static int
+load_ovector(PyObject *saved, const pypcre_string_t *str, int options,
+             int *ovector, int count)
+{
+    Py_buffer view;
+    int i, offset, rc = 0;
+
+    if (PyObject_GetBuffer(saved, &view, PyBUF_SIMPLE) < 0)
+        return -1;
+
+    if (view.len != (Py_ssize_t)(count * 2 * sizeof(int))) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "ovector size does not match the pattern");
+        return -1;
+    }
+
+    /* The buffer need not be aligned. */
+    memcpy(ovector, view.buf, view.len);
+    PyBuffer_Release(&view);
+
+    for (i = 0; i < count * 2; ++i) {
+        offset = ovector[i];
+        if (offset == -1 && ovector[i ^ 1] == -1)
+            continue;
+        if (offset < 0 || offset > str->length || ((options & PCRE_UTF8) &&
+                offset < str->length && !ISUTF8(str->string[offset]))) {
+            PyErr_SetString(PyExc_ValueError, "ovector does not fit the subject");
+            return -1;
+        }
+        rc = (i / 2) + 1;
+    }
+
+    if (rc == 0) {
+        PyErr_SetString(PyExc_ValueError, "ovector does not contain a match");
+        return -1;
+    }
+    return rc;
+}
+
+static int
+match_init(PyMatchObject *self, PyObject *args, PyObject *kwds)
+{
+    pypcre_state_t *state = get_state(self);
+    PyPatternObject *pattern;
+    PyObject *subject, *saved = NULL, *detached = Py_None;
+    int pos = -1, endpos = -1, flags = 0, options, *ovector, ovecsize, startoffset, size, rc;
+    int base = 0, basebyte = 0;
+    int static_ovector[PYPCRE_STATIC_OVECSIZE];
+    pypcre_string_t str;
+
+    static const char *const kwlist[] = {"pattern", "string", "pos", "endpos", "flags",
+        "ovector", "detached", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!O|iiiOO:__init__", (char **)kwlist,
+            state->Pattern_Type, &pattern, &subject, &pos, &endpos, &flags, &saved,
+            &detached))
+        return -1;
+
+    if (assert_pattern_ready(pattern) < 0)
+        return -1;
+
+    /* A detached match is recreated from its matched part, the offsets
+     * of that part and the ovector.  Positions refer to the original
+     * subject.
+     */
+    if (detached != Py_None) {
+        if (saved == NULL) {
+            PyErr_SetString(PyExc_ValueError, "detached requires ovector");
+            return -1;
+        }
+        if (!PyArg_ParseTuple(detached, "ii:__init__", &base, &basebyte))
+            return -1;
+    }
+
+    /* Fail trivially impossible matches before encoding the subject. */
+    if (saved == NULL && pattern_cannot_match(pattern, subject, pos, endpos, flags)) {
+        PyErr_SetNone(state->NoMatch);
+        return -1;
+    }
+
+    /* Extract UTF-8 string from the subject object.  Encode if needed. */
+    options = flags;
+    if (pypcre_string_get(&str, subject, &options) < 0)
+        return -1;
+
+    /* Check bounds. */
+    if (detached != Py_None) {
+        startoffset = 0;
+        size = str.length;
+    }
+    else {
+        if (pos < 0)
+            pos = 0;
+        if (endpos < 0 || endpos > str.length)
+            endpos = str.length;
+        if (pos > endpos) {
+            pypcre_string_release(&str);
+            PyErr_SetNone(state->NoMatch);
+            return -1;
+        }
+
+        /* If subject has been encoded internally, convert provided character
+         * offsets into byte offsets.
+         */
+        startoffset = pos;
+        size = endpos;
+        if (str.op != subject)
+            pypcre_string_char_to_byte_offsets(&str, &startoffset, &size);
+    }
+    options = pypcre_string_check_offsets(&str, options, startoffset, size);
+
+    /* Create ovector array.  Use the stack if it's small enough so that
+     * failed matches don't allocate it.
+     */
+    ovecsize = (pattern->groups + 1) * 3;
+    if (ovecsize <= PYPCRE_STATIC_OVECSIZE)
+        ovector = static_ovector;
+    else {
+        ovector = PyMem_Malloc(ovecsize * sizeof(int));
+        if (ovector == NULL) {
+            pypcre_string_release(&str);
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+
+    /* Perform the match, unless the offsets of a previous one are provided
+     * (used by unpickling).
+     */
+    if (saved != NULL)
+        rc = load_ovector(saved, &str, options, ovector, pattern->groups + 1);
+    else {
+        rc = pattern_exec(pattern, str.string, size, startoffset, options & ~PCRE_UTF8,
+                ovector, ovecsize);
+        if (rc < 0)
+            set_pcre_error(state, rc, "failed to match pattern");
+    }
+    if (rc < 0) {
+        pypcre_string_release(&str);
+        if (ovector != static_ovector)
+            PyMem_Free(ovector);
+        return -1;
+    }
+
+    /* The match keeps the ovector. */
+    if (ovector == static_ovector) {
+        ovector = PyMem_Malloc(ovecsize * sizeof(int));
+        if (ovector == NULL) {
+            pypcre_string_release(&str);
+            PyErr_NoMemory();
+            return -1;
+        }
+        memcpy(ovector, static_ovector, ovecsize * sizeof(int));
+    }
+
+    /* The match keeps the encoded string. */
+    if (pypcre_string_own(&str) < 0) {
+        pypcre_string_release(&str);
+        PyMem_Free(ovector);
+        return -1;
+    }
+
+    Py_CLEAR(self->pattern);
+    self->pattern = pattern;
+    Py_INCREF(pattern);
+
+    Py_CLEAR(self->subject);
+    self->subject = subject;
+    Py_INCREF(subject);
+
+    pypcre_string_release(&self->str);
+    memcpy(&self->str, &str, sizeof(pypcre_string_t));
+
+    PyMem_Free(self->ovector);
+    self->ovector = ovector;
+
+    self->startpos = pos;
+    self->endpos = endpos;
+    self->flags = flags;
+    self->lastindex = rc - 1;
+    self->detached = (detached != Py_None);
+    self->base = base;
+    self->basebyte = basebyte;
+
+    return 0;
+}
+
+static void
+match_dealloc(PyMatchObject *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    Py_XDECREF(self->pattern);
+    Py_XDECREF(self->subject);
+    pypcre_string_release(&self->str);
+    PyMem_Free(self->ovector);
+    type->tp_free(self);
+#ifdef PYPCRE_MODULE_STATE
+    Py_DECREF(type);
+#endif
+}
+
+/* Creates a match object of given type from results of a pcre_exec()
+ * call performed elsewhere, without calling Match.__init__.  The <str>
+ * is shared with the new object.  Returns new reference.
+ */
+static PyObject *
+make_match(PyTypeObject *type, PyPatternObject *pattern, PyObject *subject,
+           pypcre_string_t *str, const int *ovector, int rc,
+           int pos, int endpos, int flags)
+{
+    PyMatchObject *op;
+    int ovecsize = (pattern->groups + 1) * 3;
+
+    op = (PyMatchObject *)type->tp_alloc(type, 0);
+    if (op == NULL)
+        return NULL;
+
+    op->ovector = PyMem_Malloc(ovecsize * sizeof(int));
+    if (op->ovector == NULL) {
+        Py_DECREF(op);
+        return PyErr_NoMemory();
+    }
+    memcpy(op->ovector, ovector, ovecsize * sizeof(int));
+
+    if (pypcre_string_copy(&op->str, str) < 0) {
+        Py_DECREF(op);
+        return NULL;
+    }
+
+    op->pattern = pattern;
+    Py_INCREF(pattern);
+
+    op->subject = subject;
+    Py_INCREF(subject);
+
+    op->startpos = pos;
+    op->endpos = endpos;
+    op->flags = flags;
+    op->lastindex = rc - 1;
+
+    return (PyObject *)op;
+}
+
+/* Returns 0 if at most <max> arguments have been passed to the method
+ * <name> or sets an exception and returns -1.
+ */
+static int
+check_nargs(const char *name, Py_ssize_t nargs, Py_ssize_t max)
+{
+    if (nargs <= max)
+        return 0;
+
+    PyErr_Format(PyExc_TypeError, "%s expected at most %d arguments, got %d",
+            name, (int)max, (int)nargs);
+    return -1;
+}
+
+static PyObject *
+match_group(PyMatchObject *self, PYPCRE_FASTCALL_ARGS)
+{
+    PYPCRE_FASTCALL_UNPACK
+    PyObject *result;
+    Py_ssize_t i;
+
+    if (assert_match_ready(self) < 0)
+        return NULL;
+
+    switch (nargs) {
+        case 0: /* no args -- return the whole match */
+            result = get_slice(self, 0, Py_None);
+            break;
+
+        case 1: /* one arg -- return a single slice */
+            result = get_slice_o(self, args[0], Py_None);
+            break;
+
+        default: /* more than one arg -- return a tuple of slices */
+            result = PyTuple_New(nargs);
+            if (result == NULL)
+                return NULL;
+            for (i = 0; i < nargs; ++i) {
+                PyObject *item = get_slice_o(self, args[i], Py_None);
+                if (item == NULL) {
+                    Py_DECREF(result);
+                    return NULL;
+                }
+                PyTuple_SET_ITEM(result, i, item);
+            }
+            break;
+    }
+
+    return result;
+}
+
+static PyObject *
+match_start(PyMatchObject *self, PYPCRE_FASTCALL_ARGS)
+{
+    PYPCRE_FASTCALL_UNPACK
+    PyObject *index = NULL;
+    Py_ssize_t i = 0;
+    int pos;
+
+    if (check_nargs("start", nargs, 1) < 0)
+        return NULL;
+    if (nargs > 0)
+        index = args[0];
+
+    if (assert_match_ready(self) < 0)
+        return NULL;
+
+    if (index) {
+        i = get_index(self->pattern, index);
+        if (i < 0)
+            return NULL;
+    }
+
+    if (get_span(self, i, &pos, NULL) < 0)
+        return NULL;
+
+    return PyInt_FromLong(pos);
+}
+
+static PyObject *
+match_end(PyMatchObject *self, PYPCRE_FASTCALL_ARGS)
+{
+    PYPCRE_FASTCALL_UNPACK
+    PyObject *index = NULL;
+    Py_ssize_t i = 0;
+    int endpos;
+
+    if (check_nargs("end", nargs, 1) < 0)
+        return NULL;
+    if (nargs > 0)
+        index = args[0];
+
+    if (assert_match_ready(self) < 0)
+        return NULL;
+
+    if (index) {
+        i = get_index(self->pattern, index);
+        if (i < 0)
+            return NULL;
+    }
+
+    if (get_span(self, i, NULL, &endpos) < 0)
+        return NULL;
+
+    return PyInt_FromLong(endpos);
+}
+
+static PyObject *
+match_span(PyMatchObject *self, PYPCRE_FASTCALL_ARGS)
+{
+    PYPCRE_FASTCALL_UNPACK
+    PyObject *index = NULL;
+    Py_ssize_t i = 0;
+    int pos, endpos;
+
+    if (check_nargs("span", nargs, 1) < 0)
+        return NULL;
+    if (nargs > 0)
+        index = args[0];
+
+    if (assert_match_ready(self) < 0)
+        return NULL;
+
+    if (index) {
+        i = get_index(self->pattern, index);
+        if (i < 0)
+            return NULL;
+    }
+
+    if (get_span(self, i, &pos, &endpos) < 0)
+        return NULL;
+
+    return Py_BuildValue("(ii)", pos, endpos);
+}
+
+static PyObject *
+match_groups(PyMatchObject *self, PYPCRE_FASTCALL_ARGS)
+{
+    PYPCRE_FASTCALL_UNPACK
+    PyObject *result;
+    PyObject *def = Py_None;
+    Py_ssize_t index;
+
+    if (check_nargs("groups", nargs, 1) < 0)
+        return NULL;
+    if (nargs > 0)
+        def = args[0];
+
+    if (assert_match_ready(self) < 0)
+        return NULL;
+
+    result = PyTuple_New(self->pattern->groups);
+    if (result == NULL)
+        return NULL;
+
+    for (index = 1; index <= self->pattern->groups; ++index) {
+        PyObject *item = get_slice(self, index, def);
+        if (item == NULL) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(result, index - 1, item);
+    }
+
+    return result;
+}
+
+static PyObject *
+match_groupdict(PyMatchObject *self, PYPCRE_FASTCALL_ARGS)
+{
+    PYPCRE_FASTCALL_UNPACK
+    PyObject *def = Py_None;
+    PyObject *dict, *value;
+    int i, rc;
+
+    if (check_nargs("groupdict", nargs, 1) < 0)
+        return NULL;
+    if (nargs > 0)
+        def = args[0];
+
+    if (assert_match_ready(self) < 0)
+        return NULL;
+
+    dict = PyDict_New();
+    if (dict == NULL)
+        return NULL;
+
+    for (i = 0; i < self->pattern->namecount; ++i) {
+        const pypcre_groupname_t *name = &self->pattern->names[i];
+
+        value = get_slice(self, name->index, def);
+        if (value == NULL) {
+            Py_DECREF(dict);
+            return NULL;
+        }
+        rc = PyDict_SetItem(dict, name->name, value);
+        Py_DECREF(value);
+        if (rc < 0) {
+            Py_DECREF(dict);
+            return NULL;
+        }
+    }
+
+    return dict;
+}
+
+static PyObject *
+match_lastindex_getter(PyMatchObject *self, void *closure)
+{
+    if (self->lastindex > 0)
+        return PyInt_FromLong(self->lastindex);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+match_lastgroup_getter(PyMatchObject *self, void *closure)
+{
+    PyObject *name;
+
+    if (assert_match_ready(self) < 0)
+        return NULL;
+
+    if (self->lastindex <= 0 || self->lastindex > self->pattern->groups)
+        Py_RETURN_NONE;
+
+    name = PyTuple_GET_ITEM(self->pattern->groupnames, self->lastindex);
+    Py_INCREF(name);
+    return name;
+}
+
+static PyObject *
+match_regs_getter(PyMatchObject *self, void *closure)
+{
+    PyObject *regs, *item;
+    Py_ssize_t count, i;
+
+    if (assert_match_ready(self) < 0)
+        return NULL;
+
+    count = self->pattern->groups + 1;
+    regs = PyTuple_New(count);
+    if (regs == NULL)
+        return NULL;
+
+    for (i = 0; i < count; ++i) {
+        int start = self->ovector[i * 2], end = self->ovector[i * 2 + 1];
+
+        /* Same offsets as before detaching. */
+        if (start >= 0 && end >= 0) {
+            start += self->basebyte;
+            end += self->basebyte;
+        }
+        item = Py_BuildValue("(ii)", start, end);
+        if (item == NULL) {
+            Py_DECREF(regs);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(regs, i, item);
+    }
+
+    return regs;
+}
+
+/* Returns the byte offsets of the match and its groups as bytes holding
+ * native ints, for Match.__init__(ovector=...).
+ */
+static PyObject *
+match_ovector(PyMatchObject *self, PyObject *unused)
+{
+    if (assert_match_ready(self) < 0)
+        return NULL;
+
+    return PyBytes_FromStringAndSize((const char *)self->ovector,
+            (self->pattern->groups + 1) * 2 * sizeof(int));
+}
+
+/* Replaces the subject with the part spanned by the groups and the
+ * encoded string with its encoding so the match no longer keeps the
+ * whole subject alive.  Returns 0 if successful or sets an exception
+ * and returns -1.
+ */
+static int
+detach_match(PyMatchObject *self)
+{
+    PyObject *part;
+    pypcre_string_t str;
+    Py_buffer view;
+    int i, count, lo = -1, hi = -1, charlo, charhi, options;
+
+    if (self->detached)
+        return 0;
+
+    count = (self->pattern->groups + 1) * 2;
+    for (i = 0; i < count; i += 2) {
+        if (self->ovector[i] < 0 || self->ovector[i + 1] < 0)
+            continue;
+        if (lo < 0 || self->ovector[i] < lo)
+            lo = self->ovector[i];
+        if (self->ovector[i + 1] > hi)
+            hi = self->ovector[i + 1];
+    }
+
+    charlo = lo;
+    charhi = hi;
+    if (self->subject != self->str.op)
+        pypcre_string_byte_to_char_offsets(&self->str, &charlo, &charhi);
+
+    /* Strings and objects only exporting an old-style buffer are sliced,
+     * other objects exporting a buffer are copied into bytes or, if they
+     * contain characters, into a string.  Slices of those may be views.
+     */
+    if (PyUnicode_Check(self->subject) || PyBytes_Check(self->subject)
+            || PyByteArray_Check(self->subject) || !PyObject_CheckBuffer(self->subject))
+        part = PySequence_GetSlice(self->subject, charlo, charhi);
+    else {
+        if (PyObject_GetBuffer(self->subject, &view, PyBUF_ND) < 0)
+            return -1;
+        if (view.ndim != 1 || charhi > view.shape[0])
+            part = PyErr_Format(PyExc_RuntimeError, "subject has changed");
+        else if (view.itemsize == 1)
+            part = PyBytes_FromStringAndSize((const char *)view.buf + charlo,
+                    charhi - charlo);
+#ifdef PY3_NEW_UNICODE
+        else if (view.itemsize == 2 || view.itemsize == 4)
+            part = PyUnicode_FromKindAndData(
+                    (view.itemsize == 2 ? PyUnicode_2BYTE_KIND : PyUnicode_4BYTE_KIND),
+                    (const char *)view.buf + charlo * view.itemsize, charhi - charlo);
+#else
+        else if (view.itemsize == sizeof(Py_UNICODE))
+            part = PyUnicode_FromUnicode((const Py_UNICODE *)view.buf + charlo,
+                    charhi - charlo);
+#endif
+        else
+            part = PyErr_Format(PyExc_RuntimeError, "subject has changed");
+        PyBuffer_Release(&view);
+    }
+    if (part == NULL)
+        return -1;
+
+    options = self->flags;
+    if (pypcre_string_get(&str, part, &options) < 0) {
+        Py_DECREF(part);
+        return -1;
+    }
+    if (pypcre_string_own(&str) < 0 || str.length != hi - lo) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError, "subject has changed");
+        pypcre_string_release(&str);
+        Py_DECREF(part);
+        return -1;
+    }
+
+    for (i = 0; i < count; i += 2) {
+        if (self->ovector[i] >= 0 && self->ovector[i + 1] >= 0) {
+            self->ovector[i] -= lo;
+            self->ovector[i + 1] -= lo;
+        }
+    }
+
+    Py_DECREF(self->subject);
+    self->subject = part;
+    pypcre_string_release(&self->str);
+    memcpy(&self->str, &str, sizeof(pypcre_string_t));
+
+    self->detached = 1;
+    self->base = charlo;
+    self->basebyte = lo;
+    return 0;
+}
+
+/* Makes the match keep only the text it spans.  Returns self. */
+static PyObject *
+match_detach(PyMatchObject *self, PyObject *unused)
+{
+    if (assert_match_ready(self) < 0 || detach_match(self) < 0)
+        return NULL;
+
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+/* Returns None or the matched part and the (base, basebyte) offsets of
+ * a detached match, for Match.__init__(detached=...).
+ */
+static PyObject *
+match_detached(PyMatchObject *self, PyObject *unused)
+{
+    if (assert_match_ready(self) < 0)
+        return NULL;
+
+    if (!self->detached)
+        Py_RETURN_NONE;
+    return Py_BuildValue("(O(ii))", self->subject, self->base, self->basebyte);
+}
+
+static PyObject *
+match_string_getter(PyMatchObject *self, void *closure)
+{
+    PyObject *subject = self->detached ? NULL : self->subject;
+
+    if (subject == NULL)
+        subject = Py_None;
+    Py_INCREF(subject);
+    return subject;
+}
+
+static const PyMethodDef match_methods[] = {
+    {"group",       (PyCFunction)match_group,       PYPCRE_METH_FASTCALL},
+    {"start",       (PyCFunction)match_start,       PYPCRE_METH_FASTCALL},
+    {"end",         (PyCFunction)match_end,         PYPCRE_METH_FASTCALL},
+    {"span",        (PyCFunction)match_span,        PYPCRE_METH_FASTCALL},
+    {"groups",      (PyCFunction)match_groups,      PYPCRE_METH_FASTCALL},
+    {"groupdict",   (PyCFunction)match_groupdict,   PYPCRE_METH_FASTCALL},
+    {"_ovector",    (PyCFunction)match_ovector,     METH_NOARGS},
+    {"detach",      (PyCFunction)match_detach,      METH_NOARGS},
+    {"_detached",   (PyCFunction)match_detached,    METH_NOARGS},
+    {NULL}      /* sentinel */
+};
+
+static const PyGetSetDef match_getset[] = {
+    {"lastindex",   (getter)match_lastindex_getter},
+    {"lastgroup",   (getter)match_lastgroup_getter},
+    {"regs",        (getter)match_regs_getter},
+    {"string",      (getter)match_string_getter},
+    {NULL}      /* sentinel */
+};
+
+static const PyMemberDef match_members[] = {
+    {"re",          T_OBJECT,   offsetof(PyMatchObject, pattern),   READONLY},
+    {"pos",         T_INT,      offsetof(PyMatchObject, startpos),  READONLY},
+    {"endpos",      T_INT,      offsetof(PyMatchObject, endpos),    READONLY},
+    {"flags",       T_INT,      offsetof(PyMatchObject, flags),     READONLY},
+    {NULL}      /* sentinel */
+};
+
+#ifdef PYPCRE_MODULE_STATE
+static PyType_Slot match_slots[] = {
+    {Py_tp_dealloc, match_dealloc},
+    {Py_tp_methods, (void *)match_methods},
+    {Py_tp_members, (void *)match_members},
+    {Py_tp_getset, (void *)match_getset},
+    {Py_tp_init, match_init},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec match_spec = {
+    "_pcre.Match",
+    sizeof(PyMatchObject),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    match_slots
+};
+#else
+static PyTypeObject PyMatch_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_pcre.Match",                      /* tp_name */
+    sizeof(PyMatchObject),              /* tp_basicsize */
+    0,                                  /* tp_itemsize */
+    (destructor)match_dealloc,          /* tp_dealloc */
+    0,                                  /* tp_print */
+    0,                                  /* tp_getattr */
+    0,                                  /* tp_setattr */
+    0,                                  /* tp_compare */
+    0,                                  /* tp_repr */
+    0,                                  /* tp_as_number */
+    0,                                  /* tp_as_sequence */
+    0,                                  /* tp_as_mapping */
+    0,                                  /* tp_hash */
+    0,                                  /* tp_call */
+    0,                                  /* tp_str */
+    0,                                  /* tp_getattro */
+    0,                                  /* tp_setattro */
+    0,                                  /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* tp_flags */
+    0,                                  /* tp_doc */
+    0,                                  /* tp_traverse */
+    0,                                  /* tp_clear */
+    0,                                  /* tp_richcompare */
+    0,                                  /* tp_weaklistoffset */
+    0,                                  /* tp_iter */
+    0,                                  /* tp_iternext */
+    (PyMethodDef *)match_methods,       /* tp_methods */
+    (PyMemberDef *)match_members,       /* tp_members */
+    (PyGetSetDef *)match_getset,        /* tp_getset */
+    0,                                  /* tp_base */
+    0,                                  /* tp_dict */
+    0,                                  /* tp_descr_get */
+    0,                                  /* tp_descr_set */
+    0,                                  /* tp_dictoffset */
+    (initproc)match_init,               /* tp_init */
+    0,                                  /* tp_alloc */
+    0,                                  /* tp_new */
+    0,                                  /* tp_free */
+};
+#endif
+
+/*
+ * Match iterator
+ */
+
+/* Iterates over matches like Pattern.finditer() but the subject is
+ * encoded only once.  In reuse mode, the last match is updated in place
+ * instead of allocating a new one if it's not referenced by anything
+ * other than the iterator.
+ */
+typedef struct {
+    PyObject_HEAD
+    PyPatternObject *pattern; /* pattern instance */
+    PyTypeObject *type; /* of created matches */
+    PyObject *subject; /* as passed in */
+    pypcre_string_t str; /* UTF-8 string */
+    PyMatchObject *match; /* last match in reuse mode */
+    int *ovector; /* for pcre_exec */
+    int groups; /* pattern groups count when created */
+    int offset; /* where the next search starts, -1 if done */
+    int size; /* endpos in bytes */
+    int endpos; /* after boundary checks */
+    int options; /* for pcre_exec */
+    int flags; /* as passed in */
+    int reuse; /* reuse matches if possible */
+    int detached; /* detach created matches */
+    int cursor; /* byte offset of charpos */
+    int charpos; /* character offset of cursor */
+} PyMatchIterObject;
+
+/* References to the last match when it can be reused: only the one
+ * held by the iterator.  Any other reference, including a loop variable
+ * still bound to it, may be used after the next iteration.
+ */
+#define PYPCRE_REUSE_REFCNT     (1)
+
+static void
+matchiter_dealloc(PyMatchIterObject *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    Py_XDECREF(self->pattern);
+    Py_XDECREF(self->type);
+    Py_XDECREF(self->subject);
+    Py_XDECREF(self->match);
+    pypcre_string_release(&self->str);
+    PyMem_Free(self->ovector);
+    type->tp_free(self);
+#ifdef PYPCRE_MODULE_STATE
+    Py_DECREF(type);
+#endif
+}
+
+static PyObject *
+matchiter_next(PyMatchIterObject *self)
+{
+    PyPatternObject *pattern = self->pattern;
+    PyMatchObject *match;
+    const char *s = self->str.string;
+    int ovecsize, rc, pos;
+
+    if (self->offset < 0)
+        return NULL;
+
+    if (pattern->groups != self->groups) {
+        self->offset = -1;
+        PyErr_SetString(PyExc_AssertionError, "pattern changed");
+        return NULL;
+    }
+
+    ovecsize = (self->groups + 1) * 3;
+    rc = pattern_exec(pattern, s, self->size, self->offset, self->options,
+            self->ovector, ovecsize);
+    if (rc < 0) {
+        self->offset = -1;
+        if (rc != PCRE_ERROR_NOMATCH)
+            set_pcre_error(get_state(pattern), rc, "failed to match pattern");
+        return NULL;
+    }
+
+    /* Matches start their search where the previous one ended.  Convert
+     * the offset into character offset incrementally if needed.
+     */
+    pos = self->offset;
+    if (self->subject != self->str.op) {
+        while (self->cursor < pos) {
+            if (ISUTF8(s[self->cursor]))
+                ++self->charpos;
+            ++self->cursor;
+        }
+        pos = self->charpos;
+    }
+
+    /* Continue after the match or after the next character if it's empty. */
+    self->offset = self->ovector[1];
+    if (self->ovector[0] == self->ovector[1]) {
+        if (self->offset >= self->size)
+            self->offset = -1;
+        else {
+            ++self->offset;
+            while (self->offset < self->str.length && !ISUTF8(s[self->offset]))
+                ++self->offset;
+        }
+    }
+    if (self->offset > self->size)
+        self->offset = -1;
+
+    match = self->match;
+    if (match && !match->detached && Py_REFCNT(match) <= PYPCRE_REUSE_REFCNT) {
+        memcpy(match->ovector, self->ovector, ovecsize * sizeof(int));
+        match->startpos = pos;
+        match->lastindex = rc - 1;
+        Py_INCREF(match);
+        return (PyObject *)match;
+    }
+
+    match = (PyMatchObject *)make_match(self->type, pattern, self->subject, &self->str,
+            self->ovector, rc, pos, self->endpos, self->flags);
+    if (match && self->detached && detach_match(match) < 0)
+        Py_CLEAR(match);
+    if (match && self->reuse && !self->detached) {
+        Py_XDECREF(self->match);
+        self->match = match;
+        Py_INCREF(match);
+    }
+    return (PyObject *)match;
+}
+
+#ifdef PYPCRE_MODULE_STATE
+static PyType_Slot matchiter_slots[] = {
+    {Py_tp_dealloc, matchiter_dealloc},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, matchiter_next},
+    {0, NULL}
+};
+
+static PyType_Spec matchiter_spec = {
+    "_pcre.MatchIterator",
+    sizeof(PyMatchIterObject),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    matchiter_slots
+};
+#else
+static PyTypeObject PyMatchIter_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_pcre.MatchIterator",              /* tp_name */
+    sizeof(PyMatchIterObject),          /* tp_basicsize */
+    0,                                  /* tp_itemsize */
+    (destructor)matchiter_dealloc,      /* tp_dealloc */
+    0,                                  /* tp_print */
+    0,                                  /* tp_getattr */
+    0,                                  /* tp_setattr */
+    0,                                  /* tp_compare */
+    0,                                  /* tp_repr */
+    0,                                  /* tp_as_number */
+    0,                                  /* tp_as_sequence */
+    0,                                  /* tp_as_mapping */
+    0,                                  /* tp_hash */
+    0,                                  /* tp_call */
+    0,                                  /* tp_str */
+    0,                                  /* tp_getattro */
+    0,                                  /* tp_setattro */
+    0,                                  /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                 /* tp_flags */
+    0,                                  /* tp_doc */
+    0,                                  /* tp_traverse */
+    0,                                  /* tp_clear */
+    0,                                  /* tp_richcompare */
+    0,                                  /* tp_weaklistoffset */
+    PyObject_SelfIter,                  /* tp_iter */
+    (iternextfunc)matchiter_next,       /* tp_iternext */
+};
+#endif
+
+/* Returns an iterator over matches of type <match_type>.  With <reuse>
+ * set, matches not kept by the caller are updated in place.  With
+ * <detached> set, matches keep only the text they span.
+ */
+static PyObject *
+pattern_finditer(PyPatternObject *self, PyObject *args, PyObject *kwds)
+{
+    pypcre_state_t *state = get_state(self);
+    PyMatchIterObject *it;
+    PyTypeObject *type;
+    PyObject *subject;
+    int pos = -1, endpos = -1, flags = 0, reuse = 0, detached = 0, startoffset, size;
+
+    static const char *const kwlist[] = {"match_type", "string", "pos", "endpos",
+            "flags", "reuse", "detached", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|iiiii:_finditer", (char **)kwlist,
+            &type, &subject, &pos, &endpos, &flags, &reuse, &detached))
+        return NULL;
+
+    if (!PyType_Check(type) || !PyType_IsSubtype(type, state->Match_Type)) {
+        PyErr_SetString(PyExc_TypeError, "match_type must be a Match subclass");
+        return NULL;
+    }
+
+    if (assert_pattern_ready(self) < 0)
+        return NULL;
+
+    it = PyObject_New(PyMatchIterObject, state->MatchIter_Type);
+    if (it == NULL)
+        return NULL;
+    memset(&it->pattern, 0, sizeof(PyMatchIterObject) - offsetof(PyMatchIterObject, pattern));
+
+    it->pattern = self;
+    Py_INCREF(self);
+    it->type = type;
+    Py_INCREF(type);
+    it->subject = subject;
+    Py_INCREF(subject);
+
+    /* Extract UTF-8 string from the subject object.  Encode if needed.
+     * Matches keep the string so it has to be owned.
+     */
+    it->options = flags;
+    if (pypcre_string_get(&it->str, subject, &it->options) < 0
+            || pypcre_string_own(&it->str) < 0) {
+        Py_DECREF(it);
+        return NULL;
+    }
+    it->options &= ~PCRE_UTF8;
+
+    /* Check bounds, same as Match.__init__. */
+    if (pos < 0)
+        pos = 0;
+    if (endpos < 0 || endpos > it->str.length)
+        endpos = it->str.length;
+
+    startoffset = pos;
+    size = endpos;
+    if (it->str.op != subject)
+        pypcre_string_char_to_byte_offsets(&it->str, &startoffset, &size);
+    it->options = pypcre_string_check_offsets(&it->str, it->options, startoffset, size);
+
+    it->groups = self->groups;
+    it->ovector = PyMem_Malloc((self->groups + 1) * 3 * sizeof(int));
+    if (it->ovector == NULL) {
+        Py_DECREF(it);
+        return PyErr_NoMemory();
+    }
+
+    it->offset = (pos > endpos) ? -1 : startoffset;
+    it->size = size;
+    it->endpos = endpos;
+    it->flags = flags;
+    it->reuse = reuse;
+    it->detached = detached;
+    it->cursor = startoffset;
+    it->charpos = pos;
+
+    return (PyObject *)it;
+}
+
+/* Same as creating a <match_type> object but returns None instead of
+ * raising NoMatch, without creating the match object if there is no
+ * match.  Used by search() and match().
+ */
+static PyObject *
+pattern_search(PyPatternObject *self, PyObject *args, PyObject *kwds)
+{
+    pypcre_state_t *state = get_state(self);
+    PyTypeObject *type;
+    PyObject *subject, *match;
+    int pos = -1, endpos = -1, flags = 0, options, *ovector, ovecsize, startoffset, size, rc;
+    int static_ovector[PYPCRE_STATIC_OVECSIZE];
+    pypcre_string_t str;
+
+    static const char *const kwlist[] = {"match_type", "string", "pos", "endpos",
+            "flags", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|iii:_search", (char **)kwlist,
+            &type, &subject, &pos, &endpos, &flags))
+        return NULL;
+
+    if (!PyType_Check(type) || !PyType_IsSubtype(type, state->Match_Type)) {
+        PyErr_SetString(PyExc_TypeError, "match_type must be a Match subclass");
+        return NULL;
+    }
+
+    if (assert_pattern_ready(self) < 0)
+        return NULL;
+
+    /* Fail trivially impossible matches before encoding the subject. */
+    if (pattern_cannot_match(self, subject, pos, endpos, flags))
+        Py_RETURN_NONE;
+
+    /* Extract UTF-8 string from the subject object.  Encode if needed. */
+    options = flags;
+    if (pypcre_string_get(&str, subject, &options) < 0)
+        return NULL;
+
+    /* Check bounds, same as Match.__init__. */
+    if (pos < 0)
+        pos = 0;
+    if (endpos < 0 || endpos > str.length)
+        endpos = str.length;
+    if (pos > endpos) {
+        pypcre_string_release(&str);
+        Py_RETURN_NONE;
+    }
+
+    startoffset = pos;
+    size = endpos;
+    if (str.op != subject)
+        pypcre_string_char_to_byte_offsets(&str, &startoffset, &size);
+    options = pypcre_string_check_offsets(&str, options, startoffset, size);
+
+    ovecsize = (self->groups + 1) * 3;
+    if (ovecsize <= PYPCRE_STATIC_OVECSIZE)
+        ovector = static_ovector;
+    else {
+        ovector = PyMem_Malloc(ovecsize * sizeof(int));
+        if (ovector == NULL) {
+            pypcre_string_release(&str);
+            return PyErr_NoMemory();
+        }
+    }
+
+    rc = pattern_exec(self, str.string, size, startoffset, options & ~PCRE_UTF8,
+            ovector, ovecsize);
+    if (rc >= 0)
+        match = make_match(type, self, subject, &str, ovector, rc, pos, endpos, flags);
+    else if (rc == PCRE_ERROR_NOMATCH) {
+        match = Py_None;
+        Py_INCREF(match);
+    }
+    else {
+        set_pcre_error(state, rc, "failed to match pattern");
+        match = NULL;
+    }
+
+    pypcre_string_release(&str);
+    if (ovector != static_ovector)
+        PyMem_Free(ovector);
+    return match;
+}
+
+/*
+ * Parallel finditer
+ */
+
+/* Subjects shorter than this are not split between threads. */
+#define PYPCRE_PARALLEL_MIN_CHUNK   (64 * 1024)
+
+/* Matches found in one chunk of the subject by a native thread.
+ * Chunks own the matches starting in [start, end) but pcre_exec()
+ * looks up to <window> bytes into the subject.
+ */
+typedef struct {
+    const pcre *code;
+    const pcre_extra *extra;
+    const char *subject;
+    int length; /* of the whole subject */
+    int start, end, window;
+    int options;
+    int ovecsize;
+    int limit; /* max number of matches or 0 */
+    int *records; /* origin, rc and ovector for each match */
+    int count, allocated;
+    int origin; /* where the final search started */
+    int rc; /* error code of the final search or 0 */
+    PyThread_type_lock done;
+} pypcre_chunk_t;
+
+#define CHUNK_RECORD(chunk, i) ((chunk)->records + (i) * ((chunk)->ovecsize + 2))
+
+/* Returns offset of the next character.  PCRE requires offsets at
+ * character boundaries.
+ */
+static int
+next_offset(const char *s, int length, int offset)
+{
+    ++offset;
+    while (offset < length && !ISUTF8(s[offset]))
+        ++offset;
+    return offset;
+}
+
+/* Returns offset <count> characters after <offset>, at most <length>. */
+static int
+skip_chars(const char *s, int length, int offset, int count)
+{
+    while (count-- > 0 && offset < length)
+        offset = next_offset(s, length, offset);
+    return offset;
+}
+
+/* Finds all matches starting in the chunk, same as serial finditer
+ * would if started from chunk->start.  Runs without the GIL.
+ */
+static void
+chunk_search(pypcre_chunk_t *chunk)
+{
+    int origin = chunk->start, recsize = chunk->ovecsize + 2, rc;
+    int *rec;
+
+    chunk->rc = 0;
+    while (origin < chunk->end && (chunk->limit == 0 || chunk->count < chunk->limit)) {
+        /* Make room for the next record. */
+        if (chunk->count == chunk->allocated) {
+            int allocated = chunk->allocated ? chunk->allocated * 2 : 16;
+            int *records = realloc(chunk->records, allocated * recsize * sizeof(int));
+            if (records == NULL) {
+                chunk->rc = PCRE_ERROR_NOMEMORY;
+                break;
+            }
+            chunk->records = records;
+            chunk->allocated = allocated;
+        }
+
+        rec = CHUNK_RECORD(chunk, chunk->count);
+        rc = pcre_exec(chunk->code, chunk->extra, chunk->subject, chunk->window,
+                origin, chunk->options, rec + 2, chunk->ovecsize);
+
+        /* Matches reaching the end of the window may depend on what follows
+         * (think "$" or "\b") so redo them with the whole subject.
+         */
+        if (rc >= 0 && rec[3] == chunk->window && chunk->window < chunk->length)
+            rc = pcre_exec(chunk->code, chunk->extra, chunk->subject, chunk->length,
+                    origin, chunk->options, rec + 2, chunk->ovecsize);
+
+        if (rc < 0) {
+            if (rc != PCRE_ERROR_NOMATCH)
+                chunk->rc = rc;
+            break;
+        }
+
+        /* Belongs to the next chunk. */
+        if (rec[2] >= chunk->end)
+            break;
+
+        rec[0] = origin;
+        rec[1] = rc;
+        ++chunk->count;
+
+        origin = rec[3];
+        if (rec[2] == rec[3])
+            origin = next_offset(chunk->subject, chunk->length, origin);
+    }
+    chunk->origin = origin;
+}
+
+static void
+chunk_thread(void *arg)
+{
+    pypcre_chunk_t *chunk = (pypcre_chunk_t *)arg;
+
+    chunk_search(chunk);
+#ifdef PYPCRE_PCRE2
+    pypcre2_thread_cleanup();
+#endif
+    PyThread_release_lock(chunk->done);
+}
+
+/* Appends a match to the <list>.  Converts <pos> into a character offset
+ * incrementally using <cursor> (byte offset) and <charpos> if needed.
+ */
+static int
+append_match(PyObject *list, PyTypeObject *type, PyPatternObject *pattern,
+             PyObject *subject, pypcre_string_t *str, const int *ovector,
+             int rc, int pos, int endpos, int flags, int *cursor, int *charpos)
+{
+    PyObject *match;
+    int rv;
+
+    if (subject != str->op) {
+        const char *s = str->string;
+        while (*cursor < pos && *cursor < str->length) {
+            if (ISUTF8(s[*cursor]))
+                ++*charpos;
+            ++*cursor;
+        }
+        pos = *charpos + (pos - *cursor);
+    }
+
+    match = make_match(type, pattern, subject, str, ovector, rc, pos, endpos, flags);
+    if (match == NULL)
+        return -1;
+    rv = PyList_Append(list, match);
+    Py_DECREF(match);
+    return rv;
+}
+
+/* Merges matches found in <count> <chunks> of <str> into a list of <type>
+ * objects, the same list serial finditer would give if started from
+ * <startoffset>.  Returns at most <limit> matches unless it's 0.  Returns
+ * new reference.
+ */
+static PyObject *
+merge_chunks(PyPatternObject *self, PyTypeObject *type, PyObject *subject,
+             pypcre_string_t *str, pypcre_chunk_t *chunks, int count,
+             int startoffset, int pos, int endpos, int flags, int limit)
+{
+    PyObject *result;
+    int size = chunks[0].length, options = chunks[0].options;
+    int ovecsize = chunks[0].ovecsize, *ovector;
+    int i, rc, e, serialpos, cursor = 0, charpos = 0;
+
+    result = PyList_New(0);
+    ovector = PyMem_Malloc(ovecsize * sizeof(int));
+    if (result == NULL || ovector == NULL) {
+        if (ovector == NULL)
+            PyErr_NoMemory();
+        goto error;
+    }
+
+    /* Merge.  <e> is an offset such that searching from it would give
+     * the same next match as searching from <serialpos>, the offset
+     * serial finditer would search from.
+     */
+    e = serialpos = startoffset;
+    i = 0;
+    for (;;) {
+        pypcre_chunk_t *chunk;
+        int j, origin;
+
+        while (i < count && e >= chunks[i].end)
+            ++i;
+        if (i == count)
+            break;
+        chunk = &chunks[i];
+
+        /* Find first match not overlapped by already merged ones and
+         * the offset the search that found it started from.
+         */
+        for (j = 0; j < chunk->count && CHUNK_RECORD(chunk, j)[2] < e; ++j)
+            ;
+        origin = (j < chunk->count) ? CHUNK_RECORD(chunk, j)[0] : chunk->origin;
+
+        /* If it started no later than <e>, the chunk is in sync with
+         * serial finditer from here on.  Searches which failed with an
+         * error are redone below.
+         */
+        if (origin <= e && (j < chunk->count || chunk->rc == 0)) {
+            for (; j < chunk->count; ++j) {
+                int *rec = CHUNK_RECORD(chunk, j);
+                if (append_match(result, type, self, subject, str, rec + 2, rec[1],
+                        serialpos, endpos, flags, &cursor, &charpos) < 0)
+                    goto error;
+                serialpos = e = (j + 1 < chunk->count) ? rec[chunk->ovecsize + 2] : chunk->origin;
+                if (PyList_GET_SIZE(result) == limit)
+                    goto done;
+            }
+
+            /* No more matches starting before the end of the chunk. */
+            if (chunk->rc == 0 && e < chunk->end)
+                e = chunk->end;
+            continue;
+        }
+
+        /* Out of sync.  Do one search the way serial finditer would. */
+        rc = pcre_exec(self->code, self->extra, str->string, size, e, options,
+                ovector, ovecsize);
+        if (rc == PCRE_ERROR_NOMATCH)
+            break;
+        if (rc < 0) {
+            set_pcre_error(get_state(self), rc, "failed to match pattern");
+            goto error;
+        }
+        if (append_match(result, type, self, subject, str, ovector, rc,
+                serialpos, endpos, flags, &cursor, &charpos) < 0)
+            goto error;
+        if (PyList_GET_SIZE(result) == limit)
+            break;
+        serialpos = e = ovector[1];
+        if (ovector[0] == ovector[1])
+            serialpos = e = next_offset(str->string, size, e);
+    }
+
+
+    goto done;
+
+error:
+    Py_CLEAR(result);
+
+done:
+    PyMem_Free(ovector);
+    return result;
+}
+
+/* Same as repeatedly calling Match.__init__ like finditer does but
+ * the subject is split into chunks searched by native threads with the
+ * GIL released.  Results are merged in order, dropping and redoing
+ * matches around the chunk boundaries as needed.  Results are the same
+ * as serial finditer's if no match looks more than <max_match_len>
+ * characters past its start.
+ */
+static PyObject *
+pattern_finditer_parallel(PyPatternObject *self, PyObject *args, PyObject *kwds)
+{
+    PyTypeObject *type;
+    PyObject *subject, *result = NULL;
+    int maxlen, workers = 1, pos = -1, endpos = -1, flags = 0;
+    int options, ovecsize, startoffset, size, count, chunksize, i, rc;
+    unsigned long pattern_options = 0;
+    pypcre_chunk_t *chunks = NULL;
+    pcre_extra extra;
+    pypcre_string_t str;
+
+    static const char *const kwlist[] = {"match_type", "string", "max_match_len",
+            "workers", "pos", "endpos", "flags", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOi|iiii:_finditer_parallel",
+            (char **)kwlist, &type, &subject, &maxlen, &workers, &pos, &endpos, &flags))
+        return NULL;
+
+    if (!PyType_Check(type) || !PyType_IsSubtype(type, get_state(self)->Match_Type)) {
+        PyErr_SetString(PyExc_TypeError, "match_type must be a Match subclass");
+        return NULL;
+    }
+    if (maxlen < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_match_len must not be negative");
+        return NULL;
+    }
+
+    if (assert_pattern_ready(self) < 0)
+        return NULL;
+
+    /* Extract UTF-8 string from the subject object.  Encode if needed. */
+    options = flags;
+    if (pypcre_string_get(&str, subject, &options) < 0)
+        return NULL;
+    options &= ~PCRE_UTF8;
+
+    /* Check bounds, same as Match.__init__. */
+    if (pos < 0)
+        pos = 0;
+    if (endpos < 0 || endpos > str.length)
+        endpos = str.length;
+    if (pos > endpos) {
+        result = PyList_New(0);
+        goto done;
+    }
+
+    startoffset = pos;
+    size = endpos;
+    if (str.op != subject)
+        pypcre_string_char_to_byte_offsets(&str, &startoffset, &size);
+    options = pypcre_string_check_offsets(&str, options, startoffset, size);
+
+    /* Searches from chunk boundaries wouldn't be equivalent to serial
+     * ones for anchored patterns.
+     */
+    if ((rc = pcre_fullinfo(self->code, NULL, PCRE_INFO_OPTIONS, &pattern_options)) != 0) {
+        set_pcre_error(get_state(self), rc, "failed to query pattern options");
+        goto error;
+    }
+    count = (size - startoffset) / PYPCRE_PARALLEL_MIN_CHUNK;
+    if (count > workers)
+        count = workers;
+    if (count < 1 || ((options | pattern_options) & (PCRE_ANCHORED | PCRE_NOTEMPTY_ATSTART)))
+        count = 1;
+
+    ovecsize = (self->groups + 1) * 3;
+    chunks = PyMem_Malloc(count * sizeof(pypcre_chunk_t));
+    if (chunks == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    memset(chunks, 0, count * sizeof(pypcre_chunk_t));
+
+    /* A JIT stack assigned to the pattern can't be shared between threads. */
+    if (self->extra && self->jit_stack) {
+        memcpy(&extra, self->extra, sizeof(pcre_extra));
+        extra.flags &= ~PCRE_EXTRA_EXECUTABLE_JIT;
+    }
+
+    /* Split the subject at character boundaries. */
+    chunksize = (size - startoffset) / count;
+    for (i = 0; i < count; ++i) {
+        pypcre_chunk_t *chunk = &chunks[i];
+
+        chunk->code = self->code;
+        chunk->extra = (self->extra && self->jit_stack) ? &extra : self->extra;
+        chunk->subject = str.string;
+        chunk->length = size;
+        chunk->options = options;
+        chunk->ovecsize = ovecsize;
+
+        chunk->start = (i == 0) ? startoffset : chunks[i - 1].end;
+        if (i == count - 1) {
+            /* Empty match at the end of the subject belongs to the last chunk. */
+            chunk->end = size + 1;
+            chunk->window = size;
+        }
+        else {
+            chunk->end = startoffset + (i + 1) * chunksize;
+            while (chunk->end < size && !ISUTF8(str.string[chunk->end]))
+                ++chunk->end;
+            chunk->window = skip_chars(str.string, size, chunk->end, maxlen);
+        }
+    }
+
+    /* Start the threads.  Chunks for which a thread couldn't be started,
+     * as well as the first one, are searched by the current thread.
+     */
+    PYPCRE_BUSY_INC(self);
+    for (i = 1; i < count; ++i) {
+        chunks[i].done = PyThread_allocate_lock();
+        if (chunks[i].done == NULL)
+            continue;
+        PyThread_acquire_lock(chunks[i].done, 1);
+        if (PyThread_start_new_thread(chunk_thread, &chunks[i]) == PYTHREAD_INVALID_THREAD_ID) {
+            PyThread_release_lock(chunks[i].done);
+            PyThread_free_lock(chunks[i].done);
+            chunks[i].done = NULL;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < count; ++i) {
+        if (chunks[i].done == NULL)
+            chunk_search(&chunks[i]);
+    }
+    for (i = 1; i < count; ++i) {
+        if (chunks[i].done) {
+            PyThread_acquire_lock(chunks[i].done, 1);
+            PyThread_release_lock(chunks[i].done);
+        }
+    }
+    Py_END_ALLOW_THREADS
+    PYPCRE_BUSY_DEC(self);
+
+    result = merge_chunks(self, type, subject, &str, chunks, count, startoffset,
+            pos, endpos, flags, 0);
+
+    goto done;
+
+error:
+    Py_CLEAR(result);
+
+done:
+    if (chunks) {
+        for (i = 0; i < count; ++i) {
+            if (chunks[i].done)
+                PyThread_free_lock(chunks[i].done);
+            free(chunks[i].records);
+        }
+        PyMem_Free(chunks);
+    }
+    pypcre_string_release(&str);
+    return result;
+}
+
+/*
+ * Background search
+ */
+
+/* Max number of native threads running submitted searches. */
+#define PYPCRE_MAX_WORKERS  (4)
+
+/* Search submitted with Pattern._submit(). */
+typedef struct pypcre_job {
+    struct pypcre_job *next;
+    PyPatternObject *pattern;
+    PyTypeObject *type;
+    PyObject *subject;
+    PyObject *callback;
+    pypcre_string_t str;
+    pcre_extra extra;
+    pypcre_chunk_t chunk;
+    int pos, endpos, flags;
+#ifdef PYPCRE_MODULE_STATE
+    PyInterpreterState *interp; /* the job has been submitted from */
+#endif
+} pypcre_job_t;
+
+/* Worker thread waiting for jobs. */
+typedef struct pypcre_worker {
+    struct pypcre_worker *next; /* idle worker */
+    struct pypcre_worker *link; /* any worker */
+    PyThread_type_lock wake;
+    pypcre_job_t *job; /* being done */
+    int stop; /* exit instead of waiting for jobs, see stop_workers() */
+} pypcre_worker_t;
+
+/* Queue, workers and their count are protected by jobs_lock. */
+static PyThread_type_lock jobs_lock = NULL;
+static pypcre_job_t *jobs_head = NULL, *jobs_tail = NULL;
+static pypcre_worker_t *idle_workers = NULL;
+static pypcre_worker_t *all_workers = NULL;
+static int workers_count = 0;
+
+/* Creates the matches and passes them to the job's callback. */
+static void
+job_finish(pypcre_job_t *job)
+{
+    PyObject *result, *rv, *type, *value, *traceback;
+
+    result = merge_chunks(job->pattern, job->type, job->subject, &job->str,
+            &job->chunk, 1, job->chunk.start, job->pos, job->endpos, job->flags,
+            job->chunk.limit);
+    if (result)
+        rv = PyObject_CallFunction(job->callback, "OO", result, Py_None);
+    else {
+        PyErr_Fetch(&type, &value, &traceback);
+        PyErr_NormalizeException(&type, &value, &traceback);
+        rv = PyObject_CallFunction(job->callback, "OO", Py_None, value);
+        Py_XDECREF(type);
+        Py_XDECREF(value);
+        Py_XDECREF(traceback);
+    }
+    if (rv == NULL)
+        PyErr_WriteUnraisable(job->callback);
+
+    Py_XDECREF(rv);
+    Py_XDECREF(result);
+    PYPCRE_BUSY_DEC(job->pattern);
+    Py_DECREF(job->pattern);
+    Py_DECREF(job->type);
+    Py_DECREF(job->subject);
+    Py_DECREF(job->callback);
+    pypcre_string_release(&job->str);
+    free(job->chunk.records);
+    PyMem_Free(job);
+}
+
+static void
+worker_thread(void *arg)
+{
+    pypcre_worker_t *worker = (pypcre_worker_t *)arg;
+    pypcre_job_t *job;
+#ifdef PYPCRE_MODULE_STATE
+    PyThreadState *tstate;
+#else
+    PyGILState_STATE state;
+#endif
+
+    for (;;) {
+        PyThread_acquire_lock(jobs_lock, 1);
+        worker->job = NULL;
+        job = jobs_head;
+        if (worker->stop) {
+            pypcre_worker_t **link = &all_workers;
+
+            while (*link != worker)
+                link = &(*link)->link;
+            *link = worker->link;
+            PyThread_release_lock(jobs_lock);
+            break;
+        }
+        else if (job) {
+            jobs_head = job->next;
+            if (jobs_head == NULL)
+                jobs_tail = NULL;
+            worker->job = job;
+        }
+        else {
+            worker->next = idle_workers;
+            idle_workers = worker;
+        }
+        PyThread_release_lock(jobs_lock);
+
+        /* Sleep until a job is submitted. */
+        if (job == NULL) {
+            PyThread_acquire_lock(worker->wake, 1);
+            continue;
+        }
+
+        chunk_search(&job->chunk);
+
+#ifdef PYPCRE_MODULE_STATE
+        /* Workers are shared by all interpreters.  Call back in the one
+         * the job came from.
+         */
+        tstate = PyThreadState_New(job->interp);
+        PyEval_RestoreThread(tstate);
+        job_finish(job);
+        PyThreadState_Clear(tstate);
+        PyThreadState_DeleteCurrent();
+#else
+        state = PyGILState_Ensure();
+        job_finish(job);
+        PyGILState_Release(state);
+#endif
+    }
+
+    /* Nothing may touch the worker once it's unlinked. */
+    PyThread_release_lock(worker->wake);
+    PyThread_free_lock(worker->wake);
+    pypcre_raw_free(worker);
+#ifdef PYPCRE_PCRE2
+    pypcre2_thread_cleanup();
+#endif
+}
+
+/* Creates jobs_lock if it doesn't exist yet.  Returns 0 if successful
+ * or -1 otherwise.
+ */
+static int
+init_jobs_lock(void)
+{
+    PyThread_type_lock lock;
+
+    if (jobs_lock)
+        return 0;
+
+#if PY_VERSION_HEX < 0x03070000
+    /* Workers take the GIL to call back. */
+    PyEval_InitThreads();
+#endif
+    lock = PyThread_allocate_lock();
+    if (lock == NULL)
+        return -1;
+
+    /* Another interpreter may be doing the same. */
+    PYPCRE_GLOBAL_LOCK();
+    if (jobs_lock == NULL) {
+        jobs_lock = lock;
+        lock = NULL;
+    }
+    PYPCRE_GLOBAL_UNLOCK();
+
+    if (lock)
+        PyThread_free_lock(lock);
+    return 0;
+}
+
+/* Starts a worker thread.  The caller has already counted it in
+ * workers_count.  Returns 0 if successful or -1 otherwise.
+ */
+static int
+start_worker(void)
+{
+    pypcre_worker_t *worker;
+
+    worker = (pypcre_worker_t *)pypcre_raw_malloc(sizeof(pypcre_worker_t));
+    if (worker == NULL)
+        return -1;
+    memset(worker, 0, sizeof(pypcre_worker_t));
+
+    /* Held while the worker is running. */
+    worker->wake = PyThread_allocate_lock();
+    if (worker->wake == NULL) {
+        pypcre_raw_free(worker);
+        return -1;
+    }
+    PyThread_acquire_lock(worker->wake, 1);
+
+    /* Linked first, the worker may be stopped as soon as it's idle. */
+    PyThread_acquire_lock(jobs_lock, 1);
+    worker->link = all_workers;
+    all_workers = worker;
+    PyThread_release_lock(jobs_lock);
+
+    if (PyThread_start_new_thread(worker_thread, worker) == PYTHREAD_INVALID_THREAD_ID) {
+        pypcre_worker_t **link;
+
+        PyThread_acquire_lock(jobs_lock, 1);
+        for (link = &all_workers; *link != worker; link = &(*link)->link)
+            ;
+        *link = worker->link;
+        PyThread_release_lock(jobs_lock);
+
+        PyThread_release_lock(worker->wake);
+        PyThread_free_lock(worker->wake);
+        pypcre_raw_free(worker);
+        return -1;
+    }
+    return 0;
+}
+
+/* Same as finditer but the search is done by a native worker thread
+ * with the GIL released.  When done, the worker calls <callback> with
+ * a list of at most <limit> matches (all if 0) and None, or None and
+ * an exception.  The callback is called from the worker thread.
+ */
+static PyObject *
+pattern_submit(PyPatternObject *self, PyObject *args, PyObject *kwds)
+{
+    PyTypeObject *type;
+    PyObject *subject, *callback;
+    int pos = -1, endpos = -1, flags = 0, limit = 0, startoffset, size, start, running;
+    pypcre_worker_t *worker;
+    pypcre_job_t *job;
+
+    static const char *const kwlist[] = {"match_type", "string", "callback",
+            "pos", "endpos", "flags", "limit", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOO|iiii:_submit", (char **)kwlist,
+            &type, &subject, &callback, &pos, &endpos, &flags, &limit))
+        return NULL;
+
+    if (!PyType_Check(type) || !PyType_IsSubtype(type, get_state(self)->Match_Type)) {
+        PyErr_SetString(PyExc_TypeError, "match_type must be a Match subclass");
+        return NULL;
+    }
+
+    if (assert_pattern_ready(self) < 0)
+        return NULL;
+
+    if (get_state(self)->closed) {
+        PyErr_SetString(PyExc_RuntimeError, "background searches have been cancelled");
+        return NULL;
+    }
+    if (init_jobs_lock() < 0)
+        return PyErr_NoMemory();
+
+    job = (pypcre_job_t *)PyMem_Malloc(sizeof(pypcre_job_t));
+    if (job == NULL)
+        return PyErr_NoMemory();
+    memset(job, 0, sizeof(pypcre_job_t));
+
+    /* Extract UTF-8 string from the subject object.  Encode if needed. */
+    job->chunk.options = flags;
+    if (pypcre_string_get(&job->str, subject, &job->chunk.options) < 0) {
+        PyMem_Free(job);
+        return NULL;
+    }
+    job->chunk.options &= ~PCRE_UTF8;
+
+    /* Check bounds, same as Match.__init__. */
+    if (pos < 0)
+        pos = 0;
+    if (endpos < 0 || endpos > job->str.length)
+        endpos = job->str.length;
+
+    startoffset = pos;
+    size = endpos;
+    if (job->str.op != subject)
+        pypcre_string_char_to_byte_offsets(&job->str, &startoffset, &size);
+    job->chunk.options = pypcre_string_check_offsets(&job->str, job->chunk.options,
+            startoffset, size);
+
+    /* Search everything in one chunk, nothing if pos > endpos. */
+    job->chunk.code = self->code;
+    job->chunk.extra = self->extra;
+    job->chunk.subject = job->str.string;
+    job->chunk.length = job->chunk.window = size;
+    job->chunk.start = startoffset;
+    job->chunk.end = (pos > endpos) ? startoffset : size + 1;
+    job->chunk.ovecsize = (self->groups + 1) * 3;
+    job->chunk.limit = limit;
+
+    /* A JIT stack assigned to the pattern can't be shared between threads. */
+    if (self->extra && self->jit_stack) {
+        memcpy(&job->extra, self->extra, sizeof(pcre_extra));
+        job->extra.flags &= ~PCRE_EXTRA_EXECUTABLE_JIT;
+        job->chunk.extra = &job->extra;
+    }
+
+    /* Start another worker if all are busy.  The slot is taken under the
+     * lock, the thread is started outside of it.
+     */
+    PyThread_acquire_lock(jobs_lock, 1);
+    start = (idle_workers == NULL && workers_count < PYPCRE_MAX_WORKERS);
+    if (start)
+        ++workers_count;
+    running = workers_count;
+    PyThread_release_lock(jobs_lock);
+    if (start && start_worker() < 0) {
+        PyThread_acquire_lock(jobs_lock, 1);
+        running = --workers_count;
+        PyThread_release_lock(jobs_lock);
+    }
+    if (running == 0) {
+        pypcre_string_release(&job->str);
+        PyMem_Free(job);
+        PyErr_SetString(PyExc_RuntimeError, "can't start worker thread");
+        return NULL;
+    }
+
+    job->pattern = self;
+    Py_INCREF(self);
+    job->type = type;
+    Py_INCREF(type);
+    job->subject = subject;
+    Py_INCREF(subject);
+    job->callback = callback;
+    Py_INCREF(callback);
+    job->pos = pos;
+    job->endpos = endpos;
+    job->flags = flags;
+#ifdef PYPCRE_MODULE_STATE
+    job->interp = PyInterpreterState_Get();
+#endif
+    PYPCRE_BUSY_INC(self);
+
+    /* Queue the job and wake up an idle worker. */
+    PyThread_acquire_lock(jobs_lock, 1);
+    if (jobs_tail)
+        jobs_tail->next = job;
+    else
+        jobs_head = job;
+    jobs_tail = job;
+    worker = idle_workers;
+    if (worker)
+        idle_workers = worker->next;
+    PyThread_release_lock(jobs_lock);
+    if (worker)
+        PyThread_release_lock(worker->wake);
+
+    Py_RETURN_NONE;
+}
+
+/* Waits about a millisecond. */
+static void
+pypcre_sleep(void)
+{
+#ifdef _WIN32
+    Sleep(1);
+#else
+    struct timespec ts;
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = 1000000;
+    nanosleep(&ts, NULL);
+#endif
+}
+
+/* Tells whether <job> has been submitted from the current interpreter. */
+static int
+is_own_job(pypcre_job_t *job)
+{
+#ifdef PYPCRE_MODULE_STATE
+    return job->interp == PyInterpreterState_Get();
+#else
+    (void)job;
+    return 1;
+#endif
+}
+
+/* Makes idle workers exit and waits until they have.  Exiting doesn't
+ * need the GIL.  They are no longer counted so new ones are started by
+ * submits if needed.
+ */
+static void
+stop_workers(void)
+{
+    pypcre_worker_t *worker;
+    int stopping;
+
+    PyThread_acquire_lock(jobs_lock, 1);
+    while ((worker = idle_workers) != NULL) {
+        idle_workers = worker->next;
+        worker->stop = 1;
+        --workers_count;
+        PyThread_release_lock(worker->wake);
+    }
+    PyThread_release_lock(jobs_lock);
+
+    do {
+        stopping = 0;
+        PyThread_acquire_lock(jobs_lock, 1);
+        for (worker = all_workers; worker; worker = worker->link)
+            stopping |= worker->stop;
+        PyThread_release_lock(jobs_lock);
+        if (stopping)
+            pypcre_sleep();
+    } while (stopping);
+}
+
+/* Drops searches submitted from the current interpreter that haven't
+ * started yet and, if <wait> is set, waits for the running ones so that
+ * no worker calls into the interpreter after it's finalized.  Idle
+ * workers exit.  Further submits fail.  Called at exit and when the
+ * module is freed.
+ */
+static void
+cancel_jobs(pypcre_state_t *state, int wait)
+{
+    pypcre_job_t *job, **link, *cancelled = NULL;
+    pypcre_worker_t *worker;
+    int running;
+
+    state->closed = 1;
+    if (jobs_lock == NULL)
+        return;
+
+    PyThread_acquire_lock(jobs_lock, 1);
+    jobs_tail = NULL;
+    for (link = &jobs_head; (job = *link) != NULL;) {
+        if (is_own_job(job)) {
+            *link = job->next;
+            job->next = cancelled;
+            cancelled = job;
+        }
+        else {
+            jobs_tail = job;
+            link = &job->next;
+        }
+    }
+    PyThread_release_lock(jobs_lock);
+
+    while ((job = cancelled) != NULL) {
+        cancelled = job->next;
+        PYPCRE_BUSY_DEC(job->pattern);
+        Py_DECREF(job->pattern);
+        Py_DECREF(job->type);
+        Py_DECREF(job->subject);
+        Py_DECREF(job->callback);
+        pypcre_string_release(&job->str);
+        free(job->chunk.records);
+        PyMem_Free(job);
+    }
+
+    /* Running jobs need the GIL to finish. */
+    while (wait) {
+        running = 0;
+        PyThread_acquire_lock(jobs_lock, 1);
+        for (worker = all_workers; worker; worker = worker->link)
+            running |= (worker->job && is_own_job(worker->job));
+        PyThread_release_lock(jobs_lock);
+        if (!running)
+            break;
+
+        Py_BEGIN_ALLOW_THREADS
+        pypcre_sleep();
+        Py_END_ALLOW_THREADS
+    }
+
+    stop_workers();
+}
+
+/* Cancels background searches, see cancel_jobs().  Registered with
+ * atexit by the pcre module.
+ */
+static PyObject *
+pypcre_cancel_jobs(PyObject *self, PyObject *unused)
+{
+    cancel_jobs(get_module_state(self), 1);
+    Py_RETURN_NONE;
+}
+
+/*
+ * Scanner
+ */
+
+/* Output modes of Pattern._scan(). */
+#define PYPCRE_SCAN_TUPLES      (0)
+#define PYPCRE_SCAN_TEXT        (1)
+#define PYPCRE_SCAN_COLUMNS     (2)
+
+/* Builds the output of Pattern._scan() from <count> tokens in <records>
+ * (rule, start and end byte offsets).  Returns new reference.
+ */
 static PyObject *
-get_slice_o(PyMatchObject *op, PyObject *index, PyObject *def)
+make_tokens(PyObject *subject, const pypcre_string_t *str, PyObject *kinds,
+            int *records, int count, int mode)
 {
-    Py_ssize_t i = get_index(op->pattern, index);
-    if (i < 0)
+    PyObject *result, *item;
+    const char *s = str->string;
+    int i, j, *rec, cursor = 0, charpos = 0;
+
+    /* Convert byte offsets into character offsets in place.  The offsets
+     * never decrease so it's done incrementally.
+     */
+    if (subject != str->op) {
+        for (i = 0, rec = records; i < count; ++i, rec += 3) {
+            for (j = 1; j < 3; ++j) {
+                while (cursor < rec[j]) {
+                    if (ISUTF8(s[cursor]))
+                        ++charpos;
+                    ++cursor;
+                }
+                rec[j] = charpos;
+            }
+        }
+    }
+
+    if (mode == PYPCRE_SCAN_COLUMNS) {
+        PyObject *column;
+        int *data;
+
+        result = PyTuple_New(3);
+        if (result == NULL)
+            return NULL;
+        for (j = 0; j < 3; ++j) {
+            column = PyBytes_FromStringAndSize(NULL, count * sizeof(int));
+            if (column == NULL) {
+                Py_DECREF(result);
+                return NULL;
+            }
+            data = (int *)PyBytes_AS_STRING(column);
+            for (i = 0; i < count; ++i)
+                data[i] = records[i * 3 + j];
+            PyTuple_SET_ITEM(result, j, column);
+        }
+        return result;
+    }
+
+    result = PyList_New(count);
+    if (result == NULL)
         return NULL;
 
-    return get_slice(op, i, def);
+    for (i = 0, rec = records; i < count; ++i, rec += 3) {
+        PyObject *kind = PyTuple_GET_ITEM(kinds, rec[0]);
+
+        if (mode == PYPCRE_SCAN_TEXT) {
+            PyObject *text = PySequence_GetSlice(subject, rec[1], rec[2]);
+            if (text == NULL) {
+                Py_DECREF(result);
+                return NULL;
+            }
+            item = Py_BuildValue("(OiiN)", kind, rec[1], rec[2], text);
+        }
+        else
+            item = Py_BuildValue("(Oii)", kind, rec[1], rec[2]);
+        if (item == NULL) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
+
+    return result;
 }
 
-static int
-match_init(PyMatchObject *self, PyObject *args, PyObject *kwds)
+/* Tokenizes the subject using a pattern made of alternatives prefixed
+ * with (*MARK:n) where n is index of the rule in <kinds>.  Each token
+ * must immediately follow the previous one.  Scanning stops at the end
+ * of the subject, if no rule matches or if a rule matches an empty string.
+ * Tokens of rules with non-zero bytes in <skip> are not returned.  The
+ * matching is done with the GIL released.  Returns the tokens and the
+ * offset where scanning stopped.
+ */
+static PyObject *
+pattern_scan(PyPatternObject *self, PyObject *args, PyObject *kwds)
 {
-    PyPatternObject *pattern;
-    PyObject *subject;
-    int pos = -1, endpos = -1, flags = 0, options, *ovector, ovecsize, startoffset, size, rc;
+    PyObject *subject, *kinds, *skip, *tokens, *result = NULL;
+    int mode = PYPCRE_SCAN_TUPLES, pos = -1, endpos = -1, flags = 0;
+    int options, offset, size, rules, count = 0, allocated = 0, ovector[3], rc = 0;
+    int *records = NULL, stop;
+    unsigned char *mark = NULL;
+    const char *skipmask;
+    pcre_extra extra;
     pypcre_string_t str;
 
-    static const char *const kwlist[] = {"pattern", "string", "pos", "endpos", "flags", NULL};
+    static const char *const kwlist[] = {"string", "kinds", "skip", "mode",
+            "pos", "endpos", "flags", NULL};
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!O|iii:__init__", (char **)kwlist,
-            &PyPattern_Type, &pattern, &subject, &pos, &endpos, &flags))
-        return -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO!S|iiii:_scan", (char **)kwlist,
+            &subject, &PyTuple_Type, &kinds, &skip, &mode, &pos, &endpos, &flags))
+        return NULL;
 
-    if (assert_pattern_ready(pattern) < 0)
-        return -1;
+    rules = (int)PyTuple_GET_SIZE(kinds);
+    if (PyBytes_GET_SIZE(skip) != rules) {
+        PyErr_SetString(PyExc_ValueError, "skip and kinds must have the same length");
+        return NULL;
+    }
+    skipmask = PyBytes_AS_STRING(skip);
+
+    if (assert_pattern_ready(self) < 0)
+        return NULL;
 
     /* Extract UTF-8 string from the subject object.  Encode if needed. */
     options = flags;
     if (pypcre_string_get(&str, subject, &options) < 0)
-        return -1;
+        return NULL;
+    options = (options & ~PCRE_UTF8) | PCRE_ANCHORED;
 
-    /* Check bounds. */
+    /* Check bounds, same as Match.__init__. */
     if (pos < 0)
         pos = 0;
     if (endpos < 0 || endpos > str.length)
         endpos = str.length;
-    if (pos > endpos) {
-        pypcre_string_release(&str);
-        PyErr_SetNone(PyExc_NoMatch);
-        return -1;
-    }
+    if (pos > endpos)
+        pos = endpos;
 
-    /* If subject has been encoded internally, convert provided character offsets
-     * into byte offsets.
-     */
-    startoffset = pos;
+    offset = pos;
     size = endpos;
     if (str.op != subject)
-        pypcre_string_char_to_byte_offsets(&str, &startoffset, &size);
+        pypcre_string_char_to_byte_offsets(&str, &offset, &size);
+    options = pypcre_string_check_offsets(&str, options, offset, size);
 
-    /* Create ovector array. */
-    ovecsize = (pattern->groups + 1) * 3;
-    ovector = pcre_malloc(ovecsize * sizeof(int));
-    if (ovector == NULL) {
-        pypcre_string_release(&str);
-        PyErr_NoMemory();
-        return -1;
+    /* Ask for the mark.  A JIT stack assigned to the pattern can't be
+     * used without the GIL.
+     */
+    if (self->extra) {
+        memcpy(&extra, self->extra, sizeof(pcre_extra));
+        if (self->jit_stack)
+            extra.flags &= ~PCRE_EXTRA_EXECUTABLE_JIT;
     }
+    else
+        memset(&extra, 0, sizeof(pcre_extra));
+    extra.flags |= PCRE_EXTRA_MARK;
+    extra.mark = &mark;
+
+    PYPCRE_BUSY_INC(self);
+    Py_BEGIN_ALLOW_THREADS
+    while (offset < size) {
+        const unsigned char *p;
+        int rule = 0;
+
+        mark = NULL;
+        rc = pcre_exec(self->code, &extra, str.string, size, offset, options, ovector, 3);
+        if (rc < 0 || ovector[1] == offset || mark == NULL)
+            break;
 
-    /* Perform the match. */
-    rc = pcre_exec(pattern->code, pattern->extra, str.string, size, startoffset,
-            options & ~PCRE_UTF8, ovector, ovecsize);
-    if (rc < 0) {
-        pypcre_string_release(&str);
-        pcre_free(ovector);
-        set_pcre_error(rc, "failed to match pattern");
-        return -1;
+        for (p = mark; *p >= '0' && *p <= '9'; ++p)
+            rule = rule * 10 + (*p - '0');
+        if (*p != '\0' || rule >= rules) {
+            rc = PCRE_ERROR_INTERNAL;
+            break;
+        }
+
+        if (!skipmask[rule]) {
+            if (count == allocated) {
+                int *newrecords;
+                allocated = allocated ? allocated * 2 : 256;
+                newrecords = realloc(records, allocated * 3 * sizeof(int));
+                if (newrecords == NULL) {
+                    rc = PCRE_ERROR_NOMEMORY;
+                    break;
+                }
+                records = newrecords;
+            }
+            records[count * 3] = rule;
+            records[count * 3 + 1] = offset;
+            records[count * 3 + 2] = ovector[1];
+            ++count;
+        }
+
+        offset = ovector[1];
     }
+    Py_END_ALLOW_THREADS
+    PYPCRE_BUSY_DEC(self);
 
-    Py_CLEAR(self->pattern);
-    self->pattern = pattern;
-    Py_INCREF(pattern);
+    if (rc < 0 && rc != PCRE_ERROR_NOMATCH) {
+        set_pcre_error(get_state(self), rc, "failed to match pattern");
+        goto done;
+    }
 
-    Py_CLEAR(self->subject);
-    self->subject = subject;
-    Py_INCREF(subject);
+    tokens = make_tokens(subject, &str, kinds, records, count, mode);
+    if (tokens == NULL)
+        goto done;
 
-    pypcre_string_release(&self->str);
-    memcpy(&self->str, &str, sizeof(pypcre_string_t));
+    stop = offset;
+    if (str.op != subject)
+        pypcre_string_byte_to_char_offsets(&str, &stop, NULL);
+    result = Py_BuildValue("(Ni)", tokens, stop);
 
-    pcre_free(self->ovector);
-    self->ovector = ovector;
+done:
+    free(records);
+    pypcre_string_release(&str);
+    return result;
+}
 
-    self->startpos = pos;
-    self->endpos = endpos;
-    self->flags = flags;
-    self->lastindex = rc - 1;
+/*
+ * Grep
+ */
 
-    return 0;
+/* Returns pointer to the last <c> in <n> bytes at <s> or NULL. */
+static const char *
+pypcre_memrchr(const char *s, int c, size_t n)
+{
+    while (n > 0) {
+        if (s[--n] == (char)c)
+            return s + n;
+    }
+    return NULL;
 }
 
-static void
-match_dealloc(PyMatchObject *self)
+typedef struct {
+    int *data; /* start and end of each line */
+    int count;
+    int allocated;
+} pypcre_lines_t;
+
+/* Adds lines of <s> found between <pos> and <end> to <lines>.  If <end>
+ * is not preceded by a newline, the last line ends there.  Returns 0
+ * or PCRE_ERROR_NOMEMORY.
+ */
+static int
+add_lines(pypcre_lines_t *lines, const char *s, int pos, int end)
 {
-    Py_XDECREF(self->pattern);
-    Py_XDECREF(self->subject);
-    pypcre_string_release(&self->str);
-    pcre_free(self->ovector);
-    Py_TYPE(self)->tp_free(self);
+    const char *p;
+
+    while (pos < end) {
+        if (lines->count == lines->allocated) {
+            int *data;
+            lines->allocated = lines->allocated ? lines->allocated * 2 : 256;
+            data = realloc(lines->data, lines->allocated * 2 * sizeof(int));
+            if (data == NULL)
+                return PCRE_ERROR_NOMEMORY;
+            lines->data = data;
+        }
+        p = memchr(s + pos, '\n', end - pos);
+        lines->data[lines->count * 2] = pos;
+        lines->data[lines->count * 2 + 1] = p ? (int)(p - s) : end;
+        ++lines->count;
+        pos = p ? (int)(p - s) + 1 : end;
+    }
+    return 0;
 }
 
+/* Returns a list of (start, end) offsets of lines of the subject that
+ * contain a match of the pattern, or that don't with <invert>.  Instead
+ * of matching each line separately, the subject is searched as a whole
+ * and the line of every match is searched alone to confirm it, so the
+ * pattern should be compiled with MULTILINE.  Patterns whose matches
+ * depend on text outside of the line (lookarounds, \A, \Z, \G...)
+ * would skip lines that way, with <per_line> every line is searched
+ * alone.  Lines don't include the newline.
+ */
 static PyObject *
-match_group(PyMatchObject *self, PyObject *args)
+pattern_grep(PyPatternObject *self, PyObject *args, PyObject *kwds)
 {
-    PyObject *result;
-    Py_ssize_t i, size;
+    PyObject *subject, *result = NULL;
+    int invert = 0, endpos = -1, flags = 0, per_line = 0;
+    int options, offset = 0, size, start, linestart, lineend, stop, matched;
+    int ovector[3], rc = 0, i;
+    const char *s, *p;
+    pcre_extra extra;
+    pypcre_string_t str;
+    pypcre_lines_t lines = {NULL, 0, 0};
 
-    if (assert_match_ready(self) < 0)
+    static const char *const kwlist[] = {"string", "invert", "endpos", "flags",
+            "per_line", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iiii:_grep", (char **)kwlist,
+            &subject, &invert, &endpos, &flags, &per_line))
         return NULL;
 
-    size = PyTuple_GET_SIZE(args);
-    switch (size) {
-        case 0: /* no args -- return the whole match */
-            result = get_slice(self, 0, Py_None);
-            break;
+    if (assert_pattern_ready(self) < 0)
+        return NULL;
 
-        case 1: /* one arg -- return a single slice */
-            result = get_slice_o(self, PyTuple_GET_ITEM(args, 0), Py_None);
-            break;
+    /* Extract UTF-8 string from the subject object.  Encode if needed. */
+    options = flags;
+    if (pypcre_string_get(&str, subject, &options) < 0)
+        return NULL;
+    options &= ~PCRE_UTF8;
+    s = str.string;
 
-        default: /* more than one arg -- return a tuple of slices */
-            result = PyTuple_New(size);
-            if (result == NULL)
-                return NULL;
-            for (i = 0; i < size; ++i) {
-                PyObject *item = get_slice_o(self, PyTuple_GET_ITEM(args, i), Py_None);
-                if (item == NULL) {
-                    Py_DECREF(result);
-                    return NULL;
-                }
-                PyTuple_SET_ITEM(result, i, item);
-            }
-            break;
+    if (endpos < 0 || endpos > str.length)
+        endpos = str.length;
+    size = endpos;
+    if (str.op != subject)
+        pypcre_string_char_to_byte_offsets(&str, &offset, &size);
+    options = pypcre_string_check_offsets(&str, options, offset, size);
+
+    /* A JIT stack assigned to the pattern can't be used without the GIL. */
+    if (self->extra) {
+        memcpy(&extra, self->extra, sizeof(pcre_extra));
+        if (self->jit_stack)
+            extra.flags &= ~PCRE_EXTRA_EXECUTABLE_JIT;
     }
+    else
+        memset(&extra, 0, sizeof(pcre_extra));
+
+    PYPCRE_BUSY_INC(self);
+    Py_BEGIN_ALLOW_THREADS
+    while (offset < size) {
+        if (per_line) {
+            /* Every line is checked by the search below. */
+            linestart = offset;
+            p = memchr(s + offset, '\n', size - offset);
+            lineend = p ? (int)(p - s) : size;
+        }
+        else {
+            rc = pcre_exec(self->code, &extra, s, size, offset, options, ovector, 3);
+            if (rc < 0)
+                break;
+
+            /* The first call has checked the whole subject. */
+            options |= PCRE_NO_UTF8_CHECK;
+
+            /* Expand the match to its line.  A match at the end of subject
+             * ending with a newline isn't in any line.
+             */
+            start = ovector[0] < offset ? offset : ovector[0];
+            if (start == size && s[size - 1] == '\n') {
+                rc = PCRE_ERROR_NOMATCH;
+                break;
+            }
+            p = pypcre_memrchr(s + offset, '\n', start - offset);
+            linestart = p ? (int)(p - s) + 1 : offset;
+            p = memchr(s + start, '\n', size - start);
+            lineend = p ? (int)(p - s) : size;
+        }
 
-    return result;
-}
-
-static PyObject *
-match_start(PyMatchObject *self, PyObject *args)
-{
-    PyObject *index = NULL;
-    Py_ssize_t i = 0;
-    int pos;
+        /* Lines never match across a newline and lookarounds, \A or \Z
+         * must not see the other lines, so the line is searched alone.
+         */
+        rc = pcre_exec(self->code, &extra, s + linestart, lineend - linestart, 0,
+                options, ovector, 3);
+        if (rc < 0 && rc != PCRE_ERROR_NOMATCH)
+            break;
+        matched = (rc >= 0);
+
+        /* Lines before the matching one are the ones without matches.
+         * An empty line is passed together with its newline.
+         */
+        stop = (lineend > linestart) ? lineend : lineend + 1;
+        if (invert)
+            rc = add_lines(&lines, s, offset, matched ? linestart : stop);
+        else
+            rc = matched ? add_lines(&lines, s, linestart, stop) : 0;
+        if (rc < 0)
+            break;
 
-    if (!PyArg_UnpackTuple(args, "start", 0, 1, &index))
-        return NULL;
+        /* Continue with the next line. */
+        offset = lineend + 1;
+    }
+    if (rc == PCRE_ERROR_NOMATCH)
+        rc = invert ? add_lines(&lines, s, offset, size) : 0;
+    Py_END_ALLOW_THREADS
+    PYPCRE_BUSY_DEC(self);
 
-    if (assert_match_ready(self) < 0)
-        return NULL;
+    if (rc < 0) {
+        set_pcre_error(get_state(self), rc, "failed to match pattern");
+        goto done;
+    }
 
-    if (index) {
-        i = get_index(self->pattern, index);
-        if (i < 0)
-            return NULL;
+    /* Convert byte offsets into character offsets in place.  The offsets
+     * never decrease so it's done incrementally.
+     */
+    if (str.op != subject) {
+        int cursor = 0, charpos = 0;
+
+        for (i = 0; i < lines.count * 2; ++i) {
+            while (cursor < lines.data[i]) {
+                if (ISUTF8(s[cursor]))
+                    ++charpos;
+                ++cursor;
+            }
+            lines.data[i] = charpos;
+        }
     }
 
-    if (get_span(self, i, &pos, NULL) < 0)
-        return NULL;
+    result = PyList_New(lines.count);
+    if (result == NULL)
+        goto done;
+    for (i = 0; i < lines.count; ++i) {
+        PyObject *item = Py_BuildValue("(ii)", lines.data[i * 2], lines.data[i * 2 + 1]);
+        if (item == NULL) {
+            Py_CLEAR(result);
+            goto done;
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
 
-    return PyInt_FromLong(pos);
+done:
+    free(lines.data);
+    pypcre_string_release(&str);
+    return result;
 }
 
-static PyObject *
-match_end(PyMatchObject *self, PyObject *args)
+/*
+ * Masking
+ */
+
+/* Gets a writable buffer of bytes from <op>. */
+static Py_buffer *
+get_writable_buffer(PyObject *op)
 {
-    PyObject *index = NULL;
-    Py_ssize_t i = 0;
-    int endpos;
+    Py_buffer *view;
 
-    if (!PyArg_UnpackTuple(args, "end", 0, 1, &index))
-        return NULL;
+#ifndef PY3
+    /* Python 2 mmap only supports the old buffer interface. */
+    if (!PyObject_CheckBuffer(op)) {
+        void *buf;
+        Py_ssize_t len;
 
-    if (assert_match_ready(self) < 0)
-        return NULL;
+        if (PyObject_AsWriteBuffer(op, &buf, &len) < 0)
+            return NULL;
 
-    if (index) {
-        i = get_index(self->pattern, index);
-        if (i < 0)
+        view = (Py_buffer *)PyMem_Malloc(sizeof(Py_buffer));
+        if (view == NULL) {
+            PyErr_NoMemory();
             return NULL;
+        }
+        memset(view, 0, sizeof(Py_buffer));
+        view->buf = buf;
+        view->len = len;
+        view->obj = op;
+        Py_INCREF(op);
+        return view;
     }
+#endif
 
-    if (get_span(self, i, NULL, &endpos) < 0)
+    view = pypcre_buffer_get(op, PyBUF_WRITABLE | PyBUF_ND);
+    if (view && (view->itemsize != 1 || view->ndim != 1)) {
+        pypcre_buffer_release(view);
+        PyErr_SetString(PyExc_TypeError, "buffer must contain bytes");
         return NULL;
-
-    return PyInt_FromLong(endpos);
+    }
+    return view;
 }
 
+/* Overwrites <group> of every match of the pattern in a writable buffer
+ * of bytes with <fill>.  All matches are found before the buffer is
+ * changed so that lookbehinds see the original data.  Returns the number
+ * of matches sub() would replace.
+ */
 static PyObject *
-match_span(PyMatchObject *self, PyObject *args)
+pattern_mask_inplace(PyPatternObject *self, PyObject *args, PyObject *kwds)
 {
-    PyObject *index = NULL;
-    Py_ssize_t i = 0;
-    int pos, endpos;
+    PyObject *buffer, *group = NULL, *result = NULL;
+    Py_ssize_t index = 0;
+    char fill = 'X', *buf;
+    int flags = 0, options, offset = 0, last = 0, size, ovecsize, *ovector;
+    int *spans = NULL, count = 0, allocated = 0, matches = 0, rc = 0, i;
+    const char *s;
+    Py_buffer *view;
+    pcre_extra extra;
+    pypcre_string_t str;
 
-    if (!PyArg_UnpackTuple(args, "span", 0, 1, &index))
-        return NULL;
+    static const char *const kwlist[] = {"buffer", "fill", "group", "flags", NULL};
 
-    if (assert_match_ready(self) < 0)
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|cOi:mask_inplace", (char **)kwlist,
+            &buffer, &fill, &group, &flags))
         return NULL;
 
-    if (index) {
-        i = get_index(self->pattern, index);
-        if (i < 0)
-            return NULL;
-    }
-
-    if (get_span(self, i, &pos, &endpos) < 0)
+    if (assert_pattern_ready(self) < 0)
         return NULL;
 
-    return Py_BuildValue("(ii)", pos, endpos);
-}
-
-static PyObject *
-match_groups(PyMatchObject *self, PyObject *args)
-{
-    PyObject *result;
-    PyObject *def = Py_None;
-    Py_ssize_t index;
-
-    if (!PyArg_UnpackTuple(args, "groups", 0, 1, &def))
+    if (group && (index = get_index(self, group)) < 0)
         return NULL;
 
-    if (assert_match_ready(self) < 0)
+    view = get_writable_buffer(buffer);
+    if (view == NULL)
         return NULL;
+    buf = (char *)view->buf;
 
-    result = PyTuple_New(self->pattern->groups);
-    if (result == NULL)
+    /* Non-ascii bytes are matched in an encoded copy unless the buffer
+     * is declared UTF-8.
+     */
+    options = flags;
+    memset(&str, 0, sizeof(pypcre_string_t));
+    if (_string_get_from_bytes(&str, buffer, &options, view, 0) < 0) {
+        pypcre_buffer_release(view);
         return NULL;
+    }
+    options &= ~PCRE_UTF8;
+    s = str.string;
+    size = str.length;
 
-    for (index = 1; index <= self->pattern->groups; ++index) {
-        PyObject *item = get_slice(self, index, def);
-        if (item == NULL) {
-            Py_DECREF(result);
-            return NULL;
+    ovecsize = (self->groups + 1) * 3;
+    ovector = PyMem_Malloc(ovecsize * sizeof(int));
+    if (ovector == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    /* A JIT stack assigned to the pattern can't be used without the GIL. */
+    if (self->extra) {
+        memcpy(&extra, self->extra, sizeof(pcre_extra));
+        if (self->jit_stack)
+            extra.flags &= ~PCRE_EXTRA_EXECUTABLE_JIT;
+    }
+    else
+        memset(&extra, 0, sizeof(pcre_extra));
+
+    PYPCRE_BUSY_INC(self);
+    Py_BEGIN_ALLOW_THREADS
+    while (offset <= size) {
+        rc = pcre_exec(self->code, &extra, s, size, offset, options, ovector, ovecsize);
+        if (rc < 0)
+            break;
+
+        /* The first call has checked the whole subject. */
+        options |= PCRE_NO_UTF8_CHECK;
+
+        /* Same as subn(), an empty match right after a match is skipped. */
+        if (ovector[0] != ovector[1] || ovector[0] != last || last == 0) {
+            ++matches;
+            last = ovector[1];
+
+            /* Groups that didn't match or are empty leave nothing to mask. */
+            if (index < rc && ovector[index * 2 + 1] > ovector[index * 2]) {
+                if (count == allocated) {
+                    int *newspans;
+                    allocated = allocated ? allocated * 2 : 256;
+                    newspans = realloc(spans, allocated * 2 * sizeof(int));
+                    if (newspans == NULL) {
+                        rc = PCRE_ERROR_NOMEMORY;
+                        break;
+                    }
+                    spans = newspans;
+                }
+                spans[count * 2] = ovector[index * 2];
+                spans[count * 2 + 1] = ovector[index * 2 + 1];
+                ++count;
+            }
         }
-        PyTuple_SET_ITEM(result, index - 1, item);
+
+        offset = ovector[1];
+        if (ovector[0] == ovector[1])
+            offset = next_offset(s, size, offset);
     }
 
-    return result;
-}
+    if (rc == PCRE_ERROR_NOMATCH || rc >= 0) {
+        rc = 0;
+
+        /* Convert offsets in the encoded copy into buffer offsets.  Groups
+         * in lookaheads may end after the next match so the offsets can
+         * decrease.
+         */
+        if (s != buf) {
+            int cursor = 0, charpos = 0;
+
+            for (i = 0; i < count * 2; ++i) {
+                if (spans[i] < cursor)
+                    cursor = charpos = 0;
+                while (cursor < spans[i]) {
+                    if (ISUTF8(s[cursor]))
+                        ++charpos;
+                    ++cursor;
+                }
+                spans[i] = charpos;
+            }
+        }
 
-static PyObject *
-match_groupdict(PyMatchObject *self, PyObject *args)
-{
-    PyObject *def = Py_None;
-    PyObject *dict, *key, *value;
-    Py_ssize_t pos;
-    int rc;
+        for (i = 0; i < count; ++i)
+            memset(buf + spans[i * 2], fill, spans[i * 2 + 1] - spans[i * 2]);
+    }
+    Py_END_ALLOW_THREADS
+    PYPCRE_BUSY_DEC(self);
 
-    if (!PyArg_UnpackTuple(args, "groupdict", 0, 1, &def))
-        return NULL;
+    if (rc < 0)
+        set_pcre_error(get_state(self), rc, "failed to match pattern");
+    else
+        result = PyInt_FromLong(matches);
 
-    if (assert_match_ready(self) < 0)
-        return NULL;
+done:
+    free(spans);
+    PyMem_Free(ovector);
+    pypcre_string_release(&str);
+    pypcre_buffer_release(view);
+    return result;
+}
 
-    dict = PyDict_New();
-    if (dict == NULL)
-        return NULL;
+/*
+ * Bulk compilation
+ */
 
-    pos = 0;
-    while (PyDict_Next(self->pattern->groupindex, &pos, &key, &value)) {
-        value = get_slice_o(self, value, def);
-        if (value == NULL) {
-            Py_DECREF(dict);
-            return NULL;
+/* Pattern compiled by a native thread for compile_many(). */
+typedef struct {
+    PyObject *pattern;
+    int flags;
+    pypcre_string_t str; /* encoded pattern, NULL string if it failed */
+    int options;
+    pcre *code;
+    pcre_extra *extra;
+    pypcre_locale_t *locale;
+    int rc; /* compilation error code or PYPCRE_ERROR_STUDY */
+    int offset; /* of the compilation error */
+    char err[128]; /* copied, the message may be thread-local */
+} pypcre_compiled_t;
+
+/* Native thread compiling items until none are left.  All threads share
+ * the <next> item counter.
+ */
+typedef struct {
+    pypcre_compiled_t *items;
+    long count;
+    volatile long *next;
+    int study; /* pcre_study() options or -1 */
+    PyThread_type_lock done;
+} pypcre_compiler_t;
+
+/* Compiles and studies items picked from the shared counter.  Runs
+ * without the GIL.
+ */
+static void
+compile_items(pypcre_compiler_t *compiler)
+{
+    pypcre_compiled_t *item;
+    const char *err;
+    long i;
+
+    while ((i = pypcre_atomic_add(compiler->next, 1)) < compiler->count) {
+        item = &compiler->items[i];
+        if (item->str.string == NULL)
+            continue;
+
+        err = NULL;
+        item->code = pcre_compile2(item->str.string, item->options | PCRE_UTF8,
+                &item->rc, &err, &item->offset, item->locale ? item->locale->tables : NULL);
+        if (item->code == NULL) {
+            strncpy(item->err, err, sizeof(item->err) - 1);
+            continue;
         }
-        rc = PyDict_SetItem(dict, key, value);
-        Py_DECREF(value);
-        if (rc < 0) {
-            Py_DECREF(dict);
-            return NULL;
+
+        item->rc = 0;
+        if (compiler->study >= 0) {
+            item->extra = pcre_study(item->code, compiler->study, &err);
+            if (err) {
+                item->rc = PYPCRE_ERROR_STUDY;
+                strncpy(item->err, err, sizeof(item->err) - 1);
+            }
         }
     }
-
-    return dict;
 }
 
-static PyObject *
-match_lastindex_getter(PyMatchObject *self, void *closure)
+static void
+compiler_thread(void *arg)
 {
-    if (self->lastindex > 0)
-        return PyInt_FromLong(self->lastindex);
-    Py_RETURN_NONE;
+    pypcre_compiler_t *compiler = (pypcre_compiler_t *)arg;
+
+    compile_items(compiler);
+#ifdef PYPCRE_PCRE2
+    pypcre2_thread_cleanup();
+#endif
+    PyThread_release_lock(compiler->done);
 }
 
+/* Returns the normalized value of the current exception and clears it. */
 static PyObject *
-match_lastgroup_getter(PyMatchObject *self, void *closure)
+fetch_error(void)
 {
-    PyObject *key, *value;
-    Py_ssize_t pos;
-
-    if (assert_match_ready(self) < 0)
-        return NULL;
-
-    /* Simple reverse lookup into groupindex. */
-    pos = 0;
-    while (PyDict_Next(self->pattern->groupindex, &pos, &key, &value)) {
-#ifdef PY3
-        if (PyLong_Check(value) && PyLong_AS_LONG(value) == self->lastindex)
-#else
-        if (PyInt_Check(value) && PyInt_AS_LONG(value) == self->lastindex)
-#endif
-        {
-            Py_INCREF(key);
-            return key;
-        }
-    }
+    PyObject *type, *value, *tb;
 
-    Py_RETURN_NONE;
+    PyErr_Fetch(&type, &value, &tb);
+    PyErr_NormalizeException(&type, &value, &tb);
+    Py_XDECREF(type);
+    Py_XDECREF(tb);
+    return value;
 }
 
+/* Compiles a sequence of (pattern, flags) tuples into objects of the
+ * Pattern subclass <type>, studying them with <study> options unless it's
+ * -1.  Sources are encoded up front, then compiled and studied by up to
+ * <workers> native threads with the GIL released.  Returns a list holding
+ * a pattern or the exception Pattern.__init__ would have raised for each
+ * tuple, in order, and the number of threads that did the work, including
+ * the current one.
+ */
 static PyObject *
-match_regs_getter(PyMatchObject *self, void *closure)
+compile_many(PyObject *self, PyObject *args)
 {
-    PyObject *regs, *item;
-    Py_ssize_t count, i;
+    pypcre_state_t *state = get_module_state(self);
+    PyTypeObject *type;
+    PyObject *patterns, *seq, *op, *result = NULL;
+    pypcre_compiled_t *items = NULL;
+    pypcre_compiler_t *compilers = NULL;
+    volatile long next = 0;
+    Py_ssize_t count = 0, i;
+    int study, workers, started = 1, j;
+
+    if (!PyArg_ParseTuple(args, "OOii:_compile_many", &type, &patterns, &study, &workers))
+        return NULL;
 
-    if (assert_match_ready(self) < 0)
+    if (!PyType_Check(type) || !PyType_IsSubtype(type, state->Pattern_Type)) {
+        PyErr_SetString(PyExc_TypeError, "pattern_type must be a Pattern subclass");
         return NULL;
+    }
 
-    count = self->pattern->groups + 1;
-    regs = PyTuple_New(count);
-    if (regs == NULL)
+    seq = PySequence_Fast(patterns, "patterns must be a sequence");
+    if (seq == NULL)
         return NULL;
+    count = PySequence_Fast_GET_SIZE(seq);
 
+    result = PyList_New(count);
+    items = PyMem_Malloc(count * sizeof(pypcre_compiled_t));
+    if (result == NULL || items == NULL) {
+        if (items == NULL)
+            PyErr_NoMemory();
+        goto error;
+    }
+    memset(items, 0, count * sizeof(pypcre_compiled_t));
+
+    /* Encode the sources.  Scratch buffers are only meant to be held
+     * briefly so the data is moved into bytes objects.
+     */
     for (i = 0; i < count; ++i) {
-        item = Py_BuildValue("(ii)", self->ovector[(i * 2)],
-                self->ovector[(i * 2) + 1]);
-        if (item == NULL) {
-            Py_DECREF(regs);
-            return NULL;
+        pypcre_compiled_t *item = &items[i];
+
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "Oi:_compile_many",
+                &item->pattern, &item->flags))
+            goto error;
+        item->options = item->flags & ~PYPCRE_LOCALE;
+        if (pypcre_string_get(&item->str, item->pattern, &item->options) < 0
+                || pypcre_string_own(&item->str) < 0
+                || ((item->flags & PYPCRE_LOCALE) && (item->locale = locale_acquire()) == NULL)) {
+            pypcre_string_release(&item->str);
+            if ((op = fetch_error()) == NULL)
+                goto error;
+            PyList_SET_ITEM(result, i, op);
         }
-        PyTuple_SET_ITEM(regs, i, item);
     }
 
-    return regs;
-}
+    if (workers > count)
+        workers = (int)count;
+    if (workers < 1)
+        workers = 1;
+    compilers = PyMem_Malloc(workers * sizeof(pypcre_compiler_t));
+    if (compilers == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    memset(compilers, 0, workers * sizeof(pypcre_compiler_t));
 
-static const PyMethodDef match_methods[] = {
-    {"group",       (PyCFunction)match_group,       METH_VARARGS},
-    {"start",       (PyCFunction)match_start,       METH_VARARGS},
-    {"end",         (PyCFunction)match_end,         METH_VARARGS},
-    {"span",        (PyCFunction)match_span,        METH_VARARGS},
-    {"groups",      (PyCFunction)match_groups,      METH_VARARGS},
-    {"groupdict",   (PyCFunction)match_groupdict,   METH_VARARGS},
-    {NULL}      /* sentinel */
-};
+    /* Start the threads.  The current thread compiles too, so items are
+     * done even if no thread could be started.
+     */
+    for (j = 0; j < workers; ++j) {
+        compilers[j].items = items;
+        compilers[j].count = (long)count;
+        compilers[j].next = &next;
+        compilers[j].study = study;
+        if (j == 0)
+            continue;
+        compilers[j].done = PyThread_allocate_lock();
+        if (compilers[j].done == NULL)
+            continue;
+        PyThread_acquire_lock(compilers[j].done, 1);
+        if (PyThread_start_new_thread(compiler_thread, &compilers[j]) == PYTHREAD_INVALID_THREAD_ID) {
+            PyThread_release_lock(compilers[j].done);
+            PyThread_free_lock(compilers[j].done);
+            compilers[j].done = NULL;
+        }
+        else
+            ++started;
+    }
 
-static const PyGetSetDef match_getset[] = {
-    {"lastindex",   (getter)match_lastindex_getter},
-    {"lastgroup",   (getter)match_lastgroup_getter},
-    {"regs",        (getter)match_regs_getter},
-    {NULL}      /* sentinel */
-};
+    Py_BEGIN_ALLOW_THREADS
+    compile_items(&compilers[0]);
+    for (j = 1; j < workers; ++j) {
+        if (compilers[j].done) {
+            PyThread_acquire_lock(compilers[j].done, 1);
+            PyThread_release_lock(compilers[j].done);
+        }
+    }
+    Py_END_ALLOW_THREADS
 
-static const PyMemberDef match_members[] = {
-    {"string",      T_OBJECT,   offsetof(PyMatchObject, subject),   READONLY},
-    {"re",          T_OBJECT,   offsetof(PyMatchObject, pattern),   READONLY},
-    {"pos",         T_INT,      offsetof(PyMatchObject, startpos),  READONLY},
-    {"endpos",      T_INT,      offsetof(PyMatchObject, endpos),    READONLY},
-    {"flags",       T_INT,      offsetof(PyMatchObject, flags),     READONLY},
-    {NULL}      /* sentinel */
-};
+    /* Create the patterns, or the exceptions for failed items. */
+    for (i = 0; i < count; ++i) {
+        pypcre_compiled_t *item = &items[i];
+        pcre *code = item->code;
 
-static PyTypeObject PyMatch_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "_pcre.Match",                      /* tp_name */
-    sizeof(PyMatchObject),              /* tp_basicsize */
-    0,                                  /* tp_itemsize */
-    (destructor)match_dealloc,          /* tp_dealloc */
-    0,                                  /* tp_print */
-    0,                                  /* tp_getattr */
-    0,                                  /* tp_setattr */
-    0,                                  /* tp_compare */
-    0,                                  /* tp_repr */
-    0,                                  /* tp_as_number */
-    0,                                  /* tp_as_sequence */
-    0,                                  /* tp_as_mapping */
-    0,                                  /* tp_hash */
-    0,                                  /* tp_call */
-    0,                                  /* tp_str */
-    0,                                  /* tp_getattro */
-    0,                                  /* tp_setattro */
-    0,                                  /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* tp_flags */
-    0,                                  /* tp_doc */
-    0,                                  /* tp_traverse */
-    0,                                  /* tp_clear */
-    0,                                  /* tp_richcompare */
-    0,                                  /* tp_weaklistoffset */
-    0,                                  /* tp_iter */
-    0,                                  /* tp_iternext */
-    (PyMethodDef *)match_methods,       /* tp_methods */
-    (PyMemberDef *)match_members,       /* tp_members */
-    (PyGetSetDef *)match_getset,        /* tp_getset */
-    0,                                  /* tp_base */
-    0,                                  /* tp_dict */
-    0,                                  /* tp_descr_get */
-    0,                                  /* tp_descr_set */
-    0,                                  /* tp_dictoffset */
-    (initproc)match_init,               /* tp_init */
-    0,                                  /* tp_alloc */
-    0,                                  /* tp_new */
-    0,                                  /* tp_free */
-};
+        if (PyList_GET_ITEM(result, i))
+            continue;
+
+        item->code = NULL;
+        if (code == NULL) {
+            set_compile_error(state, &item->str, item->pattern, item->rc, item->err,
+                    item->offset);
+            op = fetch_error();
+        }
+        else if (item->rc == PYPCRE_ERROR_STUDY) {
+            pypcre_code_free(code);
+            set_pcre_error(state, PYPCRE_ERROR_STUDY, item->err);
+            op = fetch_error();
+        }
+        else {
+            op = type->tp_alloc(type, 0);
+            if (op == NULL) {
+                pypcre_code_free(code);
+                goto error;
+            }
+            if (pattern_setup_code((PyPatternObject *)op, item->pattern, item->flags,
+                    code, NULL, NULL) < 0) {
+                Py_DECREF(op);
+                op = fetch_error();
+            }
+            else {
+                ((PyPatternObject *)op)->extra = item->extra;
+                ((PyPatternObject *)op)->locale = item->locale;
+                set_match_hints((PyPatternObject *)op, item->extra);
+                item->extra = NULL;
+                item->locale = NULL;
+            }
+        }
+        if (op == NULL)
+            goto error;
+        PyList_SET_ITEM(result, i, op);
+    }
+
+    op = Py_BuildValue("Oi", result, started);
+    Py_DECREF(result);
+    result = op;
+    goto done;
+
+error:
+    Py_CLEAR(result);
+
+done:
+    if (compilers) {
+        for (j = 1; j < workers; ++j) {
+            if (compilers[j].done)
+                PyThread_free_lock(compilers[j].done);
+        }
+        PyMem_Free(compilers);
+    }
+    if (items) {
+        for (i = 0; i < count; ++i) {
+            pypcre_string_release(&items[i].str);
+            if (items[i].code)
+                pypcre_code_free(items[i].code);
+            pcre_free_study(items[i].extra);
+            locale_release(items[i].locale);
+        }
+        PyMem_Free(items);
+    }
+    Py_DECREF(seq);
+    return result;
+}
 
 /*
  * _pcre
@@ -1456,62 +6339,86 @@ get_config(PyObject *self)
     return dict;
 }
 
+/* Returns totals of memory allocated by PCRE through the module's hooks.
+ * JIT code is allocated elsewhere so it's not included.
+ */
+static PyObject *
+get_memory_usage(PyObject *self)
+{
+    return Py_BuildValue("{s:n,s:n}",
+            "allocated", pypcre_atomic_add_ssize(&pcre_allocated, 0),
+            "blocks", pypcre_atomic_add_ssize(&pcre_blocks, 0));
+}
+
 static const PyMethodDef pypcre_methods[] = {
     {"get_config",  (PyCFunction)get_config,    METH_NOARGS},
+    {"get_memory_usage", (PyCFunction)get_memory_usage, METH_NOARGS},
+    {"_compile_many", (PyCFunction)compile_many, METH_VARARGS},
+    {"_cancel_jobs", (PyCFunction)pypcre_cancel_jobs, METH_NOARGS},
     {NULL}          /* sentinel */
 };
 
-#ifdef PY3
-static PyModuleDef pypcre_module = {
-    PyModuleDef_HEAD_INIT,
-    "_pcre",
-    NULL,
-    -1,
-    (PyMethodDef *)pypcre_methods
-};
-#endif
-
-static PyObject *
-pypcre_init(void)
+static int
+pypcre_exec(PyObject *m)
 {
-    PyObject *m;
+    pypcre_state_t *state = get_module_state(m);
 
-    /* Use Python memory manager for PCRE allocations. */
-    pcre_malloc = PyMem_Malloc;
-    pcre_free = PyMem_Free;
+    /* Use hooks keeping track of memory allocated by PCRE, see
+     * get_memory_usage().  They don't need the GIL which is released while
+     * matching in native threads.
+     */
+    pcre_malloc = pypcre_malloc_hook;
+    pcre_free = pypcre_free_hook;
 
-    /* _pcre */
-#ifdef PY3
-    m = PyModule_Create(&pypcre_module);
-#else
-    m = Py_InitModule("_pcre", (PyMethodDef *)pypcre_methods);
-#endif
-    if (m == NULL)
-        return NULL;
+    if (pypcre_scratch_init() < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "can't create thread-local storage");
+        return -1;
+    }
 
-    /* Pattern */
+    /* Pattern and Match */
+#ifdef PYPCRE_MODULE_STATE
+    state->Pattern_Type = (PyTypeObject *)PyType_FromModuleAndSpec(m, &pattern_spec, NULL);
+    if (state->Pattern_Type == NULL)
+        return -1;
+    state->Match_Type = (PyTypeObject *)PyType_FromModuleAndSpec(m, &match_spec, NULL);
+    if (state->Match_Type == NULL)
+        return -1;
+    state->MatchIter_Type = (PyTypeObject *)PyType_FromModuleAndSpec(m, &matchiter_spec, NULL);
+    if (state->MatchIter_Type == NULL)
+        return -1;
+#else
     PyPattern_Type.tp_new = PyType_GenericNew;
-    PyType_Ready(&PyPattern_Type);
-    Py_INCREF(&PyPattern_Type);
-    PyModule_AddObject(m, "Pattern", (PyObject *)&PyPattern_Type);
-
-    /* Match */
+    if (PyType_Ready(&PyPattern_Type) < 0)
+        return -1;
+    state->Pattern_Type = &PyPattern_Type;
     PyMatch_Type.tp_new = PyType_GenericNew;
-    PyType_Ready(&PyMatch_Type);
-    Py_INCREF(&PyMatch_Type);
-    PyModule_AddObject(m, "Match", (PyObject *)&PyMatch_Type);
+    if (PyType_Ready(&PyMatch_Type) < 0)
+        return -1;
+    state->Match_Type = &PyMatch_Type;
+    if (PyType_Ready(&PyMatchIter_Type) < 0)
+        return -1;
+    state->MatchIter_Type = &PyMatchIter_Type;
+#endif
+    Py_INCREF(state->Pattern_Type);
+    PyModule_AddObject(m, "Pattern", (PyObject *)state->Pattern_Type);
+    Py_INCREF(state->Match_Type);
+    PyModule_AddObject(m, "Match", (PyObject *)state->Match_Type);
 
     /* NoMatch exception */
-    PyExc_NoMatch = PyErr_NewException("pcre.NoMatch",
+    state->NoMatch = PyErr_NewException("pcre.NoMatch",
             PyExc_Exception, NULL);
-    Py_INCREF(PyExc_NoMatch);
-    PyModule_AddObject(m, "NoMatch", PyExc_NoMatch);
+    if (state->NoMatch == NULL)
+        return -1;
+    Py_INCREF(state->NoMatch);
+    PyModule_AddObject(m, "NoMatch", state->NoMatch);
 
     /* PCREError exception */
-    PyExc_PCREError = PyErr_NewException("pcre.PCREError",
+    state->PCREError = PyErr_NewException("pcre.PCREError",
             PyExc_EnvironmentError, NULL);
-    Py_INCREF(PyExc_PCREError);
-    PyModule_AddObject(m, "PCREError", PyExc_PCREError);
+    if (state->PCREError == NULL)
+        return -1;
+    Py_INCREF(state->PCREError);
+    PyModule_AddObject(m, "PCREError", state->PCREError);
 
     /* pcre_compile and/or pcre_exec flags */
     PyModule_AddIntConstant(m, "IGNORECASE", PCRE_CASELESS);
@@ -1526,23 +6433,108 @@ pypcre_init(void)
     PyModule_AddIntConstant(m, "NOTEMPTY_ATSTART", PCRE_NOTEMPTY_ATSTART);
     PyModule_AddIntConstant(m, "UTF8", PCRE_UTF8);
     PyModule_AddIntConstant(m, "NO_UTF8_CHECK", PCRE_NO_UTF8_CHECK);
+    PyModule_AddIntConstant(m, "LOCALE", PYPCRE_LOCALE);
 
     /* pcre_study flags */
     PyModule_AddIntConstant(m, "STUDY_JIT", PCRE_STUDY_JIT_COMPILE);
 
-    return m;
+    return 0;
+}
+
+#ifdef PYPCRE_MODULE_STATE
+static int
+pypcre_traverse(PyObject *m, visitproc visit, void *arg)
+{
+    pypcre_state_t *state = get_module_state(m);
+
+    Py_VISIT(state->Pattern_Type);
+    Py_VISIT(state->Match_Type);
+    Py_VISIT(state->MatchIter_Type);
+    Py_VISIT(state->PCREError);
+    Py_VISIT(state->NoMatch);
+    return 0;
+}
+
+static int
+pypcre_clear(PyObject *m)
+{
+    pypcre_state_t *state = get_module_state(m);
+
+    Py_CLEAR(state->Pattern_Type);
+    Py_CLEAR(state->Match_Type);
+    Py_CLEAR(state->MatchIter_Type);
+    Py_CLEAR(state->PCREError);
+    Py_CLEAR(state->NoMatch);
+    return 0;
+}
+
+static void
+pypcre_free(void *m)
+{
+    /* Running jobs can't finish during finalization, atexit has waited
+     * for them.
+     */
+    cancel_jobs(get_module_state(m), 0);
+    pypcre_clear((PyObject *)m);
 }
 
+static PyModuleDef_Slot pypcre_slots[] = {
+    {Py_mod_exec, pypcre_exec},
+    /* No Py_mod_gil slot: patterns aren't locked against study() and
+     * friends running next to a match, see README.
+     */
+#if PY_VERSION_HEX >= 0x030C0000
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+    {0, NULL}
+};
+
+static PyModuleDef pypcre_module = {
+    PyModuleDef_HEAD_INIT,
+    "_pcre",
+    NULL,
+    sizeof(pypcre_state_t),
+    (PyMethodDef *)pypcre_methods,
+    pypcre_slots,
+    pypcre_traverse,
+    pypcre_clear,
+    pypcre_free
+};
+
+PyMODINIT_FUNC
+PyInit__pcre(void)
+{
+    return PyModuleDef_Init(&pypcre_module);
+}
+#else
 #ifdef PY3
+static PyModuleDef pypcre_module = {
+    PyModuleDef_HEAD_INIT,
+    "_pcre",
+    NULL,
+    -1,
+    (PyMethodDef *)pypcre_methods
+};
+
 PyMODINIT_FUNC
 PyInit__pcre(void)
 {
-    return pypcre_init();
+    PyObject *m;
+
+    m = PyModule_Create(&pypcre_module);
+    if (m && pypcre_exec(m) < 0)
+        Py_CLEAR(m);
+    return m;
 }
 #else
 PyMODINIT_FUNC
 init_pcre(void)
 {
-    pypcre_init();
+    PyObject *m;
+
+    m = Py_InitModule("_pcre", (PyMethodDef *)pypcre_methods);
+    if (m)
+        pypcre_exec(m);
 }
 #endif
+#endif
@@ -19,6 +19,7 @@ from test.test_support import captured_stdout
 #from re import Scanner
 #import sre_constants
 import pcre as re
+from pcre import Scanner
 re.enable_re_template_mode()
 sre_constants = re
 re._pattern_type = re.Pattern
@@ -393,11 +394,10 @@ class ReTests(unittest.TestCase):
                                    "abcd abc bcd bx").group(1), "bx")
         self.assertEqual(re.search(r"\B(b.)\B",
                                    "abc bcd bc abxd").group(1), "bx")
-        # PCRE: python-pcre doesn't support LOCALE flag
-        #self.assertEqual(re.search(r"\b(b.)\b",
-        #                           "abcd abc bcd bx", re.LOCALE).group(1), "bx")
-        #self.assertEqual(re.search(r"\B(b.)\B",
-        #                           "abc bcd bc abxd", re.LOCALE).group(1), "bx")
+        self.assertEqual(re.search(r"\b(b.)\b",
+                                   "abcd abc bcd bx", re.LOCALE).group(1), "bx")
+        self.assertEqual(re.search(r"\B(b.)\B",
+                                   "abc bcd bc abxd", re.LOCALE).group(1), "bx")
         self.assertEqual(re.search(r"\b(b.)\b",
                                    "abcd abc bcd bx", re.UNICODE).group(1), "bx")
         self.assertEqual(re.search(r"\B(b.)\B",
@@ -414,9 +414,8 @@ class ReTests(unittest.TestCase):
         self.assertEqual(re.search(r"^\Aabc\Z$", u"\nabc\n", re.M), None)
         self.assertEqual(re.search(r"\d\D\w\W\s\S",
                                    "1aa! a").group(0), "1aa! a")
-        # PCRE: python-pcre doesn't support LOCALE flag
-        #self.assertEqual(re.search(r"\d\D\w\W\s\S",
-        #                           "1aa! a", re.LOCALE).group(0), "1aa! a")
+        self.assertEqual(re.search(r"\d\D\w\W\s\S",
+                                   "1aa! a", re.LOCALE).group(0), "1aa! a")
         self.assertEqual(re.search(r"\d\D\w\W\s\S",
                                    "1aa! a", re.UNICODE).group(0), "1aa! a")
 
@@ -591,16 +590,13 @@ class ReTests(unittest.TestCase):
 
     def test_constants(self):
         self.assertEqual(re.I, re.IGNORECASE)
-        # PCRE: python-pcre doesn't support LOCALE flag
-        #self.assertEqual(re.L, re.LOCALE)
+        self.assertEqual(re.L, re.LOCALE)
         self.assertEqual(re.M, re.MULTILINE)
         self.assertEqual(re.S, re.DOTALL)
         self.assertEqual(re.X, re.VERBOSE)
 
     def test_flags(self):
-        # PCRE: python-pcre doesn't support LOCALE flag
-        #for flag in [re.I, re.M, re.X, re.S, re.L]:
-        for flag in [re.I, re.M, re.X, re.S]:
+        for flag in [re.I, re.M, re.X, re.S, re.L]:
             self.assertNotEqual(re.compile('^pattern$', flag), None)
 
     def test_sre_character_literals(self):
@@ -678,8 +674,7 @@ class ReTests(unittest.TestCase):
         self.assertIsNone(re.match(r'(?:a?)+?y', 'z'))
         self.assertIsNone(re.match(r'(?:a?){2,}?y', 'z'))
 
-    # PCRE: python-pcre doesn't support scanner APIs
-    def __test_scanner(self):
+    def test_scanner(self):
         def s_ident(scanner, token): return token
         def s_operator(scanner, token): return "op%s" % token
         def s_float(scanner, token): return float(token)
@@ -693,7 +688,9 @@ class ReTests(unittest.TestCase):
             (r"\s+", None),
             ])
 
-        self.assertNotEqual(scanner.scanner.scanner("").pattern, None)
+        # PCRE: the rules are combined into a single compiled pattern
+        #self.assertNotEqual(scanner.scanner.scanner("").pattern, None)
+        self.assertNotEqual(scanner.pattern.pattern, None)
 
         self.assertEqual(scanner.scan("sum = 3*foo + 312.50 + bar"),
                          (['sum', 'op=', 3, 'op*', 'foo', 'op+', 312.5,
@@ -866,9 +863,7 @@ class ReTests(unittest.TestCase):
         # 2**128 should be big enough to overflow on both. For smaller values
         # a RuntimeError is raised instead of OverflowError.
         #long_overflow = 2**128
-        # PCRE: finditer is implemented as generator function -- next() has to be called
-        #self.assertRaises(TypeError, re.finditer, "a", {})
-        self.assertRaises(TypeError, re.finditer("a", {}).next)
+        self.assertRaises(TypeError, re.finditer, "a", {})
         #self.assertRaises(OverflowError, _sre.compile, "abc", 0, [long_overflow])
 
     def test_compile(self):
@@ -881,6 +876,8 @@ class ReTests(unittest.TestCase):
         # Test behaviour when not given a string or pattern as parameter
         self.assertRaises(TypeError, re.compile, 0)
 
+    # PCRE: PCRE2 rejects \B in a character class.
+    @unittest.skipIf(re.config.version.startswith('10.'), 'PCRE2 rejects [\\B]')
     def test_bug_13899(self):
         # Issue #13899: re pattern r"[\A]" should work like "A" but matches
         # nothing. Ditto B and Z.
@@ -1030,6 +1027,468 @@ class ReTests(unittest.TestCase):
             ['', 'ab', 'racadabra'])
 
 
+# PCRE: tests of python-pcre specific APIs
+class PcreTests(unittest.TestCase):
+
+    def test_finditer_parallel(self):
+        subject = 'ab12 cd345 ' * 7000 + 'x9'
+        for pattern in (r'\d+', r'\b\w', r'\d*', r'^ab'):
+            p = re.compile(pattern)
+            expected = [m.span() for m in p.finditer(subject)]
+            for workers in (1, 2, 7):
+                self.assertEqual([m.span() for m in
+                                  p.finditer_parallel(subject, 8, workers)],
+                                 expected)
+        p = re.compile(r'(\w)(\d)')
+        m = list(p.finditer_parallel(subject, 2, 4, 3, 100))
+        self.assertEqual([x.span() for x in m],
+                         [x.span() for x in p.finditer(subject, 3, 100)])
+        self.assertEqual(m[0].groups(), ('d', '3'))
+
+    def test_submit(self):
+        import threading
+        done = threading.Event()
+        results = []
+        def callback(matches, error):
+            results.append((matches, error))
+            done.set()
+        p = re.compile(r'(\d+)')
+        subject = 'a1 b22 c333 ' * 1000
+        p._submit(re.Match, subject, callback, 5, -1, 0, 2)
+        done.wait(10)
+        matches, error = results.pop()
+        self.assertEqual(error, None)
+        self.assertEqual([m.span() for m in matches],
+                         [m.span() for m in p.finditer(subject, 5)][:2])
+        done.clear()
+        re.compile(r'\d')._submit(re.Match, '\xff', callback, flags=re.UTF8)
+        done.wait(10)
+        matches, error = results.pop()
+        self.assertEqual(matches, None)
+        self.assertTrue(isinstance(error, re.PCREError))
+
+    def test_async(self):
+        try:
+            import asyncio
+        except ImportError:
+            return
+        p = re.compile(r'(\d+)')
+        small = 'a1 b22 c333'
+        large = small + ' ' * re.ASYNC_INLINE_SIZE + 'd4444'
+        def run(make_future):
+            # Futures are made from a callback of the running loop.
+            loop = asyncio.new_event_loop()
+            try:
+                outer = loop.create_future()
+                def start():
+                    future = make_future()
+                    inline.append(future.done())
+                    future.add_done_callback(lambda f: outer.set_result(f.result()))
+                loop.call_soon(start)
+                return loop.run_until_complete(asyncio.wait_for(outer, 10))
+            finally:
+                loop.close()
+        for subject in (small, large):
+            inline = []
+            m = run(lambda: p.search_async(subject, 3))
+            self.assertEqual(inline, [subject is small])
+            self.assertEqual(m.span(), p.search(subject, 3).span())
+            self.assertEqual(m.group(1), '22')
+            matches = run(lambda: p.finditer_async(subject))
+            self.assertEqual([m.span() for m in matches],
+                             [m.span() for m in p.finditer(subject)])
+            self.assertEqual(run(lambda: p.sub_async(lambda m: '<%s>' % m.group(), subject)),
+                             p.sub(lambda m: '<%s>' % m.group(), subject))
+        self.assertEqual(run(lambda: p.search_async(large, len(large))), None)
+
+    def test_pattern_hash(self):
+        p = re.compile(r'(?P<a>\w+)-(\d)')
+        q = re.compile(r'(?P<a>\w+)-(\d)')
+        self.assertEqual(p, q)
+        self.assertEqual(hash(p), hash(q))
+        self.assertEqual(p, re.loads(p.dumps()))
+        self.assertEqual(hash(p), hash(re.loads(p.dumps())))
+        self.assertNotEqual(p, re.compile(r'(?P<a>\w+)-(\d+)'))
+        self.assertEqual(len(set([p, q, re.compile('x')])), 2)
+
+    def test_encoded_subject_lifetime(self):
+        # Encoded subjects of failed matches reuse internal buffers.
+        p = re.compile(u'\u20ac(\\w)', re.UNICODE)
+        matches = []
+        for i in range(10):
+            matches.append(p.search(u'\xe9' * i + u'\u20ac\xe9'))
+            self.assertEqual(p.search(u'\xe9\u20ac!' * i), None)
+            self.assertEqual(p.search('\xe9\xe8'), None)
+        for i, m in enumerate(matches):
+            self.assertEqual(m.span(1), (i + 1, i + 2))
+            self.assertEqual(m.group(1), u'\xe9')
+
+    def test_scanner_tokenize(self):
+        scanner = Scanner([(r'\d+', 'num'), (r'\w+', 'word'), (r'\s+', 'space')],
+                          flags=re.UNICODE, skip=('space',))
+        tokens, end = scanner.tokenize(u'\xe9t\xe9 42 !')
+        self.assertEqual(tokens, [('word', 0, 3), ('num', 4, 6)])
+        self.assertEqual(end, 7)
+        tokens, end = scanner.tokenize('ab 12', pos=1, endpos=4, text=True)
+        self.assertEqual(tokens, [('word', 1, 2, 'b'), ('num', 3, 4, '1')])
+        self.assertEqual(end, 4)
+        (rules, starts, ends), end = scanner.columns('ab 12 cd')
+        self.assertEqual(list(rules), [1, 0, 1])
+        self.assertEqual(list(starts), [0, 3, 6])
+        self.assertEqual(list(ends), [2, 5, 8])
+        # Scanning stops at empty matches.
+        self.assertEqual(Scanner([(r'a*', 'a')]).tokenize('aab'), ([('a', 0, 2)], 2))
+
+    def test_shared_pattern_store(self):
+        import os, tempfile
+        fd, path = tempfile.mkstemp()
+        os.close(fd)
+        try:
+            store = re.SharedPatternStore([r'(\d+)', (r'[a-z]+', re.I)], path=path)
+            attached = re.SharedPatternStore.attach(path)
+            self.assertEqual(len(attached), 2)
+            self.assertEqual(attached[0].search('ab 12').group(1), '12')
+            self.assertEqual(attached.get(1, jit=True).findall('Ab 1 cD'), ['Ab', 'cD'])
+            self.assertEqual(attached[0], store[0])
+            self.assertTrue(attached[0] is attached[0])
+            # JIT is honoured for patterns already used without it.
+            self.assertTrue(attached.get(0, jit=True) is attached.get(0, jit=True))
+            self.assertFalse(attached.get(0, jit=True) is attached[0])
+            if re.config.jit:
+                self.assertTrue(attached.get(0, jit=True).memory_usage()['jit'] > 0)
+                self.assertEqual(attached[0].memory_usage()['jit'], 0)
+        finally:
+            os.remove(path)
+
+    def test_reuse_match(self):
+        p = re.compile(r'(\w)(\w)?', re.UNICODE)
+        subject = u'ab \xe9 d\xe8f g'
+        expected = [(m.span(), m.groups(), m.pos) for m in p.finditer(subject)]
+        spans, ids = [], set()
+        for m in p.finditer(subject, reuse_match=True):
+            spans.append((m.span(), m.groups(), m.pos))
+            ids.add(id(m))
+            del m
+        self.assertEqual(spans, expected)
+        self.assertEqual(len(ids), 1)
+        # Matches still referenced are never changed.
+        self.assertEqual([m.span() for m in list(p.finditer(subject, reuse_match=True))],
+                         [e[0] for e in expected])
+        it = p.finditer(subject, reuse_match=True)
+        a = next(it)
+        b = next(it)
+        self.assertEqual((a.span(), b.span()), (expected[0][0], expected[1][0]))
+        # Matches kept by the caller are not reused.
+        kept = []
+        for m in p.finditer(subject, reuse_match=True):
+            kept.append(m)
+        self.assertEqual([m.span() for m in kept], [e[0] for e in expected])
+        spans = []
+        for m in re.compile('x*').finditer(u'axx\xe9b', reuse_match=True):
+            spans.append(m.span())
+        self.assertEqual(spans, [(0, 0), (1, 3), (3, 3), (4, 4), (5, 5)])
+        self.assertEqual(p.subn(lambda m: m.group(2) or '-', subject, reuse_match=True),
+                         (u'b - \xe8- -', 5))
+
+    def test_memory_usage(self):
+        p = re.compile(r'(?P<word>\w+) (\d+)')
+        usage = p.memory_usage()
+        self.assertTrue(usage['code'] > 0)
+        self.assertTrue(usage['groupindex'] > 0)
+        self.assertEqual(usage['jit_stack'], 0)
+        self.assertTrue(sys.getsizeof(p) > usage['code'])
+        if re.config.jit:
+            p.study(re.STUDY_JIT)
+            p.set_jit_stack(32 * 1024, 256 * 1024)
+            usage = p.memory_usage()
+            self.assertTrue(usage['jit'] > 0)
+            self.assertEqual(usage['jit_stack'], 256 * 1024)
+        total = re.memory_usage()
+        self.assertTrue(total['allocated'] >= usage['code'])
+        self.assertTrue(total['blocks'] > 0)
+        # Match objects are not counted.
+        p.search('ab 12')
+        blocks = re.memory_usage()['blocks']
+        matches = [p.search('ab 12') for i in range(10)]
+        self.assertEqual(re.memory_usage()['blocks'], blocks)
+
+    def test_utf8_subject(self):
+        p = re.compile(r'\S+')
+        subject = u'h\xe9llo w\u20acrld x'.encode('utf-8')
+        self.assertEqual([m.group() for m in p.finditer(subject, flags=re.UTF8)],
+                         subject.split(b' '))
+        self.assertEqual(re.compile('').findall(b'\xc3\xa9a', flags=re.UTF8), [b'', b'', b''])
+        for invalid in (b'a\xc3', b'\xc0\x80', b'\xed\xa0\x80', b'\xf4\x90\x80\x80'):
+            self.assertRaises(re.error, p.search, invalid, flags=re.UTF8)
+            self.assertRaises(re.error, p.count, invalid, flags=re.UTF8)
+        # Offsets must not split characters.
+        self.assertRaises(re.error, p.search, subject, 2, flags=re.UTF8)
+        self.assertRaises(re.error, p.search, subject, 0, 2, flags=re.UTF8)
+
+    def test_contains_count(self):
+        p = re.compile(r'\w+', re.UNICODE)
+        subject = u'\xe9t\xe9 42 ab'
+        self.assertTrue(p.contains(subject))
+        self.assertFalse(p.contains(u'!?'))
+        self.assertFalse(p.contains(subject, 3, 4))
+        self.assertEqual(p.count(subject), 3)
+        self.assertEqual(p.count(subject, 1), 3)
+        self.assertEqual(p.count(subject, 4, 6), 1)
+        self.assertEqual(p.count(subject, 7, 2), 0)
+        self.assertEqual(re.compile('x*').count('axxb'), len(re.findall('x*', 'axxb')))
+
+    def test_grep(self):
+        import io
+        data = b'foo 1\nbar\n\nbaz 22\nfoo\n3'
+        p = re.compile(r'\d$')
+        self.assertEqual(list(p.grep(data)), [b'foo 1', b'baz 22', b'3'])
+        self.assertEqual(list(p.grep(data, invert=True)), [b'bar', b'', b'foo'])
+        self.assertEqual(list(p.grep(data, offsets=True)), [(0, 5), (11, 17), (22, 23)])
+        # Matches don't cross lines.
+        self.assertEqual(list(re.compile(r'r\s+b').grep(data)), [])
+        # Lookarounds and \Z don't see the other lines.
+        self.assertEqual(list(re.compile(r'foo(?=\s*b)|(?<=\n)b|z\Z').grep(data)), [])
+        for pattern, subject in [(r'\A\w+', data), (r'\Afoo', b'foo\nfoo\n'),
+                                 (r'a(?!\n)', b'a\nab\n'), (r'\Ax', b'ax\nx\n'),
+                                 (r'(?<!\n)b', b'x\nb\n')]:
+            p = re.compile(pattern)
+            lines = subject.rstrip(b'\n').split(b'\n')
+            self.assertEqual(list(p.grep(subject)), [x for x in lines if p.search(x)])
+            self.assertEqual(list(p.grep(io.BytesIO(subject))), list(p.grep(subject)))
+            self.assertEqual(list(p.grep(subject, invert=True)),
+                             [x for x in lines if not p.search(x)])
+        p = re.compile(r'\d$')
+        # The MULTILINE pattern is studied like the original.
+        p.study(re.STUDY_JIT)
+        self.assertEqual(p._multiline()._study_options, re.STUDY_JIT)
+        size = re.GREP_BUFFER_SIZE
+        re.GREP_BUFFER_SIZE = 4
+        try:
+            self.assertEqual(list(p.grep(io.BytesIO(data), offsets=True)),
+                             [(0, 5), (11, 17), (22, 23)])
+            self.assertEqual(list(re.compile('^$').grep(io.BytesIO(data))), [b''])
+        finally:
+            re.GREP_BUFFER_SIZE = size
+
+    def test_sub_to(self):
+        import io, os, tempfile
+        data = b'id 12 and 345\n' * 5
+        p = re.compile(r'\d+')
+        size = re.SUB_BUFFER_SIZE
+        re.SUB_BUFFER_SIZE = 4
+        try:
+            out = io.BytesIO()
+            self.assertEqual(p.sub_to(out, b'#', io.BytesIO(data), max_match_len=3), 10)
+            self.assertEqual(out.getvalue(), b'id # and #\n' * 5)
+            out = io.BytesIO()
+            self.assertEqual(p.sub_to(out, lambda m: m.group()[::-1], io.BytesIO(data),
+                                      count=3, max_match_len=3), 3)
+            self.assertEqual(out.getvalue(), data.replace(b'345', b'543', 1).replace(b'12', b'21', 2))
+            # Empty matches and lookbehinds across chunk boundaries.
+            out = io.BytesIO()
+            re.compile(r'(?<=a)x*').sub_to(out, b'-', io.BytesIO(b'aaxxbaa'), max_match_len=3)
+            self.assertEqual(out.getvalue(), b'a-a-b' + b'a-a-')
+        finally:
+            re.SUB_BUFFER_SIZE = size
+        # File descriptor sinks and in-memory sources.
+        f = tempfile.TemporaryFile()
+        self.assertEqual(p.sub_to(f.fileno(), b'#', b'a 1 b 22'), 2)
+        os.lseek(f.fileno(), 0, 0)
+        self.assertEqual(os.read(f.fileno(), 100), b'a # b #')
+        f.close()
+        out = io.StringIO()
+        self.assertEqual(p.sub_to(out, lambda m: u'<%s>' % m.group(), u'a 1 b 22'), 2)
+        self.assertEqual(out.getvalue(), u'a <1> b <22>')
+
+    def test_mask_inplace(self):
+        buf = bytearray(b'card 4111-1111 exp 12/25')
+        p = re.compile(r'(?P<head>\d{2})\d\d')
+        self.assertEqual(p.mask_inplace(buf), 2)
+        self.assertEqual(bytes(buf), b'card XXXX-XXXX exp 12/25')
+        buf = bytearray(b'pin 1234 \xe9 5678')
+        self.assertEqual(p.mask_inplace(buf, b'*', 'head'), 2)
+        self.assertEqual(bytes(buf), b'pin **34 \xe9 **78')
+        # Lookbehinds see the original data.
+        buf = bytearray(b'a123')
+        self.assertEqual(re.compile(r'(?<=\d)\d').mask_inplace(buf), 2)
+        self.assertEqual(bytes(buf), b'a1XX')
+        buf = bytearray(u'\xe9 42'.encode('utf-8'))
+        self.assertEqual(re.compile(r'\S').mask_inplace(buf, flags=re.UTF8), 3)
+        self.assertEqual(bytes(buf), b'XX XX')
+        self.assertRaises((TypeError, BufferError), p.mask_inplace, b'1234')
+        self.assertRaises(IndexError, p.mask_inplace, bytearray(b'1234'), group=2)
+
+    def test_locale(self):
+        import pickle
+        p = re.compile(r'(\w+) (?i)K', re.LOCALE)
+        self.assertEqual(p.flags, re.LOCALE)
+        self.assertEqual(p.match('abc k').group(1), 'abc')
+        # Patterns compiled under the same locale share the tables.
+        self.assertEqual(p, re.compile(r'(\w+) (?i)K', re.L))
+        self.assertRaises(ValueError, p.dumps)
+        self.assertEqual(pickle.loads(pickle.dumps(p)), p)
+        result = re.compile_many([(r'\w+', re.L)], study=None)
+        self.assertEqual(result.patterns[0], re.compile(r'\w+', re.L))
+
+    def test_compile_many(self):
+        patterns = [r'(?P<a>\w+)-\d', (r'X+', re.I), r'a(b', r'a{2,1}']
+        result = re.compile_many(patterns, workers=2)
+        self.assertEqual(len(result.patterns), 4)
+        self.assertEqual(result.patterns[0], re.compile(patterns[0]))
+        self.assertEqual(result.patterns[0].groupindex, {'a': 1})
+        self.assertEqual(result.patterns[1].findall('xXy'), ['xX'])
+        self.assertTrue(isinstance(result.patterns[2], re.error))
+        self.assertEqual(result.patterns[2].args[0], 14)
+        self.assertEqual(result.patterns[3].args[0], 4)
+        self.assertEqual(result.stats['patterns'], 4)
+        self.assertEqual(result.stats['errors'], 2)
+        self.assertEqual(result.stats['workers'], 2)
+        result = re.compile_many([u'\xe9+'], re.I, study=None)
+        self.assertEqual(result.patterns[0].search(u'x\xc9\xe9').span(), (1, 3))
+        self.assertEqual(re.compile_many([]).patterns, [])
+
+    def test_engine_auto(self):
+        p = re.compile(r'(\d+)-(\d+)|x', engine='auto')
+        info = p.engine_info()
+        self.assertEqual(info['mode'], 'auto')
+        self.assertEqual(info['engine'], 'interpreter')
+        self.assertEqual(info['decisions'], [(0, 'interpreter', 'auto mode enabled')])
+        for i in range(200):
+            self.assertEqual(p.search('ab 12-345').groups(), ('12', '345'))
+            self.assertEqual(p.findall('1-2 x 3-4'), [('1', '2'), ('', ''), ('3', '4')])
+        info = p.engine_info()
+        self.assertEqual(info['calls'], 1000)
+        self.assertEqual(sum(info['lengths']), 1000)
+        self.assertEqual(sum(info['latencies']['interpreter']) +
+                         sum(info['latencies']['jit']), 1000)
+        self.assertEqual(info['decisions'][-1][1], info['engine'])
+        p.set_engine(None)
+        self.assertEqual(p.engine_info()['mode'], None)
+        self.assertEqual(p.search('ab 12-345').groups(), ('12', '345'))
+        self.assertRaises(ValueError, p.set_engine, 'dfa')
+        # Matches exceeding the JIT stack are run interpreted.
+        p = re.compile(r'(a|b)*c')
+        p.study(re.STUDY_JIT)
+        p.set_engine('auto')
+        subject = 'ab' * 1000 + 'c'
+        for i in range(100):
+            self.assertEqual(p.search(subject).span(), (0, 2001))
+        if p.engine_info()['decisions'][0][1] == 'jit':
+            self.assertEqual(p.engine_info()['decisions'][1][2], 'JIT stack limit exceeded')
+
+    def test_extract(self):
+        import collections
+        p = re.compile(r'(?P<host>\S+) (?P<status>\w+) (?P<ts>[\d.]+)(?: (?P<tag>\w+))?', re.UNICODE)
+        types = {'status': int, 'ts': float}
+        self.assertEqual(p.extract('h 200 1.5', types),
+                         {'host': 'h', 'status': 200, 'ts': 1.5, 'tag': None})
+        self.assertEqual(p.extract(u'\xe9 200 15 x', types, tuple), (u'\xe9', 200, 15.0, u'x'))
+        self.assertEqual(p.extract(u'h \u0663 2', types)['status'], 3)
+        self.assertEqual(p.extract('h 200 1.5', {'tag': int, 'host': len})['host'], 1)
+        self.assertEqual(p.extract('nothing', types), None)
+        self.assertRaises(ValueError, p.extract, 'h x 1', types)
+        self.assertRaises(IndexError, p.extract, 'h 1 1', {'size': int})
+        self.assertRaises(TypeError, p.extract, 'h 1 1', {'ts': 1})
+        Hit = collections.namedtuple('Hit', 'ts host')
+        self.assertEqual(p.extract('h 200 1.5', types, Hit), Hit(1.5, 'h'))
+        self.assertEqual(p.extract_many(['a 1 2', '-', 'b 3 4'], types, Hit),
+                         [Hit(2.0, 'a'), None, Hit(4.0, 'b')])
+        # Dicts are in group order, converters are kept even if types changes.
+        if sys.version_info >= (3, 7):
+            self.assertEqual(list(p.extract('h 200 1.5', types)),
+                             ['host', 'status', 'ts', 'tag'])
+        types = {'host': lambda text: (types.clear(), text.upper())[1]}
+        self.assertEqual([d['host'] for d in p.extract_many(['a 1 2', 'b 3 4'], types)],
+                         ['A', 'B'])
+
+    def test_detach(self):
+        import pickle
+        p = re.compile(r'(?<=(.))(?P<w>\w+)(x)?', re.UNICODE)
+        subject = u'\xe9\xe9 ab\xfc cd'
+        matches = list(p.finditer(subject))
+        for m in matches:
+            state = (m.span(), m.span(1), m.groups(), m.groupdict(), m.regs, m.pos, m.endpos)
+            self.assertTrue(m.detach() is m)
+            self.assertEqual(m.string, None)
+            self.assertEqual((m.span(), m.span(1), m.groups(), m.groupdict(), m.regs,
+                              m.pos, m.endpos), state)
+            n = pickle.loads(pickle.dumps(m))
+            self.assertEqual((n.span(), n.groups(), n.regs, n.string), (m.span(), m.groups(),
+                                                                         m.regs, None))
+        detached = list(p.finditer(subject, detached=True))
+        self.assertEqual([m.span() for m in detached], [m.span() for m in matches])
+        self.assertEqual([m.string for m in detached], [None] * len(matches))
+        m = re.search(b'(b+)', bytearray(b'aabbcc')).detach()
+        self.assertEqual((m.group(1), m.span()), (bytearray(b'bb'), (2, 4)))
+        from array import array
+        for subject in [u'xx hello yy', u'xx h\xe9llo yy']:
+            m = re.compile(r'h\w+', re.UNICODE).search(array('u', subject))
+            self.assertEqual(m.detach().span(), (3, 8))
+            self.assertEqual(u''.join(m.group()), subject[3:8])
+
+    def test_pickle_match(self):
+        import pickle
+        p = re.compile(r'(?P<a>\w+)-(\d+)?', re.UNICODE)
+        p.study()
+        for m in [p.search(u'\xe9t\xe9-12'), p.search('foo-')]:
+            for proto in range(pickle.HIGHEST_PROTOCOL + 1):
+                n = pickle.loads(pickle.dumps(m, proto))
+                self.assertEqual(n.regs, m.regs)
+                self.assertEqual(n.groups(), m.groups())
+                self.assertEqual(n.lastgroup, m.lastgroup)
+                self.assertEqual(n.re.pattern, p.pattern)
+        self.assertRaises(ValueError, re.Match, p, 'foo', -1, -1, 0, b'')
+        if hasattr(pickle, 'PickleBuffer'):
+            buffers = []
+            data = pickle.dumps(p, 5, buffer_callback=buffers.append)
+            self.assertEqual(len(buffers), 1)
+            q = pickle.loads(data, buffers=buffers)
+            self.assertEqual(q.pattern, p.pattern)
+            self.assertEqual(q.search('x-1').groups(), ('x', '1'))
+            self.assertEqual(q.memory_usage()['study'], p.memory_usage()['study'])
+            if not re.config.version.startswith('10.'):
+                # PCRE 8.x patterns export the code itself.
+                self.assertEqual(memoryview(p).tobytes(), p.dumps())
+                self.assertRaises(BufferError, p.__init__, 'x')
+
+    def test_impossible_matches(self):
+        p = re.compile(r'foo\d+bar')
+        p.study()
+        self.assertEqual(p.search('foo1ba'), None)
+        self.assertEqual(p.search(u'xfoo1bar', 1).span(), (1, 8))
+        self.assertEqual(p.search('xfoo1barx', 1, 7), None)
+        self.assertEqual(p.match(u'xfoo1bar\xe9'), None)
+        self.assertEqual(p.match(b'foo1bar').span(), (0, 7))
+        self.assertFalse(p.contains('foo1ba'))
+        self.assertEqual(p.count('foo1barfoo2ba'), 1)
+        self.assertTrue(isinstance(p.search('foo1bar'), re.Match))
+        self.assertRaises(re.NoMatch, re.Match, p, 'foo1ba')
+        # Caseless first characters.
+        p = re.compile(r'(?i)kelvin', re.UNICODE)
+        self.assertTrue(p.match('KELVIN'))
+        self.assertTrue(p.match(u'\u212aelvin'))
+        self.assertEqual(p.match(u'xkelvin'), None)
+        # Invalid UTF-8 is still reported.
+        self.assertRaises(re.error, p.search, b'\xc3', flags=re.UTF8)
+
+    def test_analyze(self):
+        risks = re.compile(r'(a+)+$').analyze()
+        self.assertEqual(len(risks), 1)
+        self.assertEqual(risks[0].severity, 'exponential')
+        self.assertEqual(risks[0].span, (0, 5))
+        self.assertEqual(risks[0].suggestion, '(a++)+$')
+        self.assertEqual(re.compile(r'(?x) (\w+ \s?)* $').analyze()[0].kind,
+                         'nested quantifier')
+        self.assertEqual(re.compile(r'(a|aa)*b').analyze()[0].kind,
+                         'overlapping alternation')
+        self.assertEqual([r.severity for r in re.compile(r'\d+\.?\d+').analyze()],
+                         ['polynomial'])
+        for safe in (r'(a+b)+', r'(?>a+)+', r'(a++)+', r'(ab|ac)*', r'[^"\\]*"'):
+            self.assertEqual(re.compile(safe).analyze(), [])
+        self.assertRaises(re.error, re.compile, r'(x+x+)+y', reject_redos=True)
+        self.assertTrue(re.compile(r'\d+\d+', reject_redos=True))
+
+
 def run_re_tests():
     # PCRE: use pcre_tests instead of re_tests
     #from test.re_tests import tests, SUCCEED, FAIL, SYNTAX_ERROR
@@ -1145,11 +1604,10 @@ def run_re_tests():
 
                 # Try the match with LOCALE enabled, and check that it
                 # still succeeds.
-                # PCRE: python-pcre doesn't support LOCALE flag
-                #obj = re.compile(pattern, re.LOCALE)
-                #result = obj.search(s)
-                #if result is None:
-                #    print '=== Fails on locale-sensitive match', t
+                obj = re.compile(pattern, re.LOCALE)
+                result = obj.search(s)
+                if result is None:
+                    print '=== Fails on locale-sensitive match', t
 
                 # Try the match with UNICODE locale enabled, and check
                 # that it still succeeds.
@@ -1159,7 +1617,7 @@ def run_re_tests():
                     print '=== Fails on unicode-sensitive match', t
 
 def test_main():
-    run_unittest(ReTests)
+    run_unittest(ReTests, PcreTests)
     run_re_tests()
 
 if __name__ == "__main__":